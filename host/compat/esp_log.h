@@ -0,0 +1,21 @@
+#pragma once
+#include <stdio.h>
+
+// Host build: ESP-IDF logging on stderr, filtered by hostLogLevel()
+enum { HOST_LOG_NONE, HOST_LOG_ERROR, HOST_LOG_WARN, HOST_LOG_INFO, HOST_LOG_DEBUG, HOST_LOG_VERBOSE };
+
+inline int &hostLogLevel() {
+    static int level = HOST_LOG_INFO;
+    return level;
+}
+
+#define HOST_LOG(level, letter, tag, format, ...) \
+    do { \
+        if (hostLogLevel() >= (level)) fprintf(stderr, letter " (%s) " format "\n", tag, ##__VA_ARGS__); \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...) HOST_LOG(HOST_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) HOST_LOG(HOST_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) HOST_LOG(HOST_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) HOST_LOG(HOST_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) HOST_LOG(HOST_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
@@ -0,0 +1,3 @@
+#pragma once
+// Host build: the FTP server includes this only for the lwIP socket headers,
+// which the host's own <sys/socket.h> replaces
@@ -0,0 +1,23 @@
+#pragma once
+// Host build: the subset of FreeRTOS used by lib/rtos, on top of pthreads
+#include <assert.h>
+#include <stdint.h>
+#include <pthread.h>
+
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+#define portBASE_TYPE int
+#define portSHORT short
+#define portMAX_DELAY ((TickType_t)0xFFFFFFFF)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+#define configMINIMAL_STACK_SIZE 768
+#define configUSE_TASK_NOTIFICATIONS 1
+#define tskNO_AFFINITY 0x7FFFFFFF
+#define IRAM_ATTR
+#define portYIELD_FROM_ISR(x) (void)(x)
@@ -0,0 +1,82 @@
+#pragma once
+#include "FreeRTOS.h"
+#include <errno.h>
+#include <time.h>
+
+// Binary semaphores and (recursive) mutexes, each one pthread mutex + condition
+struct HostSemaphore {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    bool mutex;         // Taken by an owner, as opposed to given by anyone
+    int count;          // Binary: 0/1; mutex: 1 when free
+    int depth;          // Recursive hold count of owner
+    pthread_t owner;
+};
+typedef HostSemaphore *SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t hostSemaphoreCreate(bool mutex) {
+    SemaphoreHandle_t s = new HostSemaphore();
+    pthread_mutex_init(&s->mtx, nullptr);
+    pthread_cond_init(&s->cond, nullptr);
+    s->mutex = mutex;
+    s->count = mutex ? 1 : 0;
+    return s;
+}
+
+static inline SemaphoreHandle_t xSemaphoreCreateBinary() { return hostSemaphoreCreate(false); }
+static inline SemaphoreHandle_t xSemaphoreCreateMutex() { return hostSemaphoreCreate(true); }
+static inline SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() { return hostSemaphoreCreate(true); }
+
+static inline void vSemaphoreDelete(SemaphoreHandle_t s) {
+    pthread_mutex_destroy(&s->mtx);
+    pthread_cond_destroy(&s->cond);
+    delete s;
+}
+
+static inline BaseType_t hostSemaphoreTake(SemaphoreHandle_t s, TickType_t timeout, bool recursive) {
+    pthread_mutex_lock(&s->mtx);
+    if (recursive && s->depth > 0 && pthread_equal(s->owner, pthread_self())) {
+        s->depth++;
+        pthread_mutex_unlock(&s->mtx);
+        return pdTRUE;
+    }
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout / 1000;
+    until.tv_nsec += (long)(timeout % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) { until.tv_sec++; until.tv_nsec -= 1000000000; }
+    int rc = 0;
+    while (s->count == 0 && rc != ETIMEDOUT) {
+        rc = timeout == portMAX_DELAY ? pthread_cond_wait(&s->cond, &s->mtx)
+                                      : pthread_cond_timedwait(&s->cond, &s->mtx, &until);
+    }
+    bool got = s->count > 0;
+    if (got) {
+        s->count--;
+        s->owner = pthread_self();
+        s->depth = 1;
+    }
+    pthread_mutex_unlock(&s->mtx);
+    return got ? pdTRUE : pdFALSE;
+}
+
+static inline BaseType_t hostSemaphoreGive(SemaphoreHandle_t s, bool recursive) {
+    pthread_mutex_lock(&s->mtx);
+    if (recursive && --s->depth > 0) {
+        pthread_mutex_unlock(&s->mtx);
+        return pdTRUE;
+    }
+    bool ok = s->count == 0;
+    if (ok) s->count = 1;
+    s->depth = 0;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mtx);
+    return ok ? pdTRUE : pdFALSE;
+}
+
+#define xSemaphoreTake(s, t) hostSemaphoreTake((s), (t), false)
+#define xSemaphoreGive(s) hostSemaphoreGive((s), false)
+#define xSemaphoreTakeRecursive(s, t) hostSemaphoreTake((s), (t), true)
+#define xSemaphoreGiveRecursive(s) hostSemaphoreGive((s), true)
+#define xSemaphoreTakeFromISR(s, w) ((void)(w), hostSemaphoreTake((s), 0, false))
+#define xSemaphoreGiveFromISR(s, w) ((void)(w), hostSemaphoreGive((s), false))
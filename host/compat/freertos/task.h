@@ -0,0 +1,117 @@
+#pragma once
+#include "FreeRTOS.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Tasks are threads; priority, stack depth and core are accepted and ignored
+struct HostTask {
+    pthread_t thread;
+    void (*fn)(void *);
+    void *arg;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    uint32_t notify;
+};
+typedef HostTask *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+enum eNotifyAction { eNoAction, eSetBits, eIncrement, eSetValueWithOverwrite, eSetValueWithoutOverwrite };
+
+static inline TaskHandle_t &hostCurrentTask() {
+    static thread_local TaskHandle_t current = nullptr;
+    return current;
+}
+
+static inline void *hostTaskEntry(void *p) {
+    TaskHandle_t t = static_cast<TaskHandle_t>(p);
+    hostCurrentTask() = t;
+    t->fn(t->arg);
+    return nullptr;
+}
+
+static inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *, uint32_t, void *arg,
+                                                 UBaseType_t, TaskHandle_t *handle, BaseType_t) {
+    TaskHandle_t t = new HostTask();
+    t->fn = fn;
+    t->arg = arg;
+    pthread_mutex_init(&t->mtx, nullptr);
+    pthread_cond_init(&t->cond, nullptr);
+    if (handle) *handle = t;
+    if (pthread_create(&t->thread, nullptr, hostTaskEntry, t) != 0) {
+        if (handle) *handle = nullptr;
+        delete t;
+        return pdFAIL;
+    }
+    return pdPASS;
+}
+
+static inline BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                     UBaseType_t prio, TaskHandle_t *handle) {
+    return xTaskCreatePinnedToCore(fn, name, stack, arg, prio, handle, tskNO_AFFINITY);
+}
+
+static inline TaskHandle_t xTaskGetCurrentTaskHandle() { return hostCurrentTask(); }
+
+static inline void vTaskDelete(TaskHandle_t t) {
+    if (!t || pthread_equal(t->thread, pthread_self())) {
+        // Self-deletion: the handle leaks, as nobody joins a thread that ended on its own
+        pthread_detach(pthread_self());
+        pthread_exit(nullptr);
+    }
+    pthread_cancel(t->thread);
+    pthread_join(t->thread, nullptr);
+    delete t;
+}
+
+static inline void vTaskSuspend(TaskHandle_t t) {
+    // Only self-suspension until deleted is supported
+    (void)t;
+    for (;;) pause();
+}
+
+static inline void vTaskDelay(TickType_t ticks) { usleep((useconds_t)ticks * 1000); }
+
+static inline TickType_t xTaskGetTickCount() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (TickType_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static inline BaseType_t xPortGetCoreID() { return 0; }
+
+static inline BaseType_t xTaskNotify(TaskHandle_t t, uint32_t value, eNotifyAction action) {
+    pthread_mutex_lock(&t->mtx);
+    if (action == eSetBits) t->notify |= value;
+    else if (action == eIncrement) t->notify++;
+    else t->notify = value;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->mtx);
+    return pdPASS;
+}
+
+static inline BaseType_t xTaskNotifyFromISR(TaskHandle_t t, uint32_t value, eNotifyAction action, BaseType_t *) {
+    return xTaskNotify(t, value, action);
+}
+
+static inline BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit, uint32_t *value,
+                                         TickType_t timeout) {
+    TaskHandle_t t = hostCurrentTask();
+    pthread_mutex_lock(&t->mtx);
+    t->notify &= ~clear_on_entry;
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout / 1000;
+    until.tv_nsec += (long)(timeout % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) { until.tv_sec++; until.tv_nsec -= 1000000000; }
+    int rc = 0;
+    while (!t->notify && rc != ETIMEDOUT) {
+        rc = timeout == portMAX_DELAY ? pthread_cond_wait(&t->cond, &t->mtx)
+                                      : pthread_cond_timedwait(&t->cond, &t->mtx, &until);
+    }
+    bool got = t->notify != 0;
+    if (value) *value = t->notify;
+    if (got) t->notify &= ~clear_on_exit;
+    pthread_mutex_unlock(&t->mtx);
+    return got ? pdPASS : pdFAIL;
+}
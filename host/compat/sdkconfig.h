@@ -0,0 +1,4 @@
+#pragma once
+// Host build: the Kconfig values the shared code depends on
+
+#define CONFIG_WL_SECTOR_SIZE 4096
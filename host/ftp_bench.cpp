@@ -0,0 +1,1383 @@
+// Throughput and latency benchmark for the firmware's FtpServer. By default
+// the server runs in this process on a scratch directory and is driven over
+// loopback; --connect points the same scenarios at another server, e.g. a
+// board on the bench. Every number also goes to a JSON file so runs can be
+// compared:
+//
+//   ftp_bench [--clients N] [--out FILE] [--quick] [--keep] [--verbose]
+//             [--connect IP:PORT]
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "esp_log.h"
+#include "FtpServer.h"
+#include "json.h"
+
+static double clockSec(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double nowSec() {
+    return clockSec(CLOCK_MONOTONIC);
+}
+
+/* ==== Bench root ==== */
+// The in-process server's files, counting the calls that reach the filesystem
+class CountingFileSystem : public PosixFileSystem {
+public:
+    std::atomic<uint64_t> writes{0};
+    std::atomic<uint64_t> truncates{0};
+
+    ssize_t write(int fd, const void *buf, size_t len) override {
+        writes++;
+        return PosixFileSystem::write(fd, buf, len);
+    }
+
+    int ftruncate(int fd, off_t length) override {
+        truncates++;
+        return PosixFileSystem::ftruncate(fd, length);
+    }
+};
+
+/* ==== Minimal FTP client ==== */
+class FtpClient {
+public:
+    FtpClient() = default;
+    ~FtpClient() { disconnect(); }
+
+    FtpClient(const FtpClient&) = delete;
+    FtpClient& operator=(const FtpClient&) = delete;
+
+    bool connect(const sockaddr_in &addr) {
+        server = addr;
+        ctrl = socket(AF_INET, SOCK_STREAM, 0);
+        if (ctrl < 0 || ::connect(ctrl, (const sockaddr *)&server, sizeof(server)) < 0) return false;
+        int nodelay = 1;
+        setsockopt(ctrl, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        return readReply() == 220 && command("USER bench") / 100 != 5 && command("PASS bench") == 230 &&
+               command("TYPE I") == 200;
+    }
+
+    void disconnect() {
+        if (ctrl >= 0) close(ctrl);
+        ctrl = -1;
+    }
+
+    // Sends one command, returns the reply code or 0 when the connection failed
+    int command(const char *format, ...) {
+        char cmd[512];
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(cmd, sizeof(cmd) - 2, format, args);
+        va_end(args);
+        memcpy(cmd + n, "\r\n", 2);
+        if (send(ctrl, cmd, n + 2, 0) != n + 2) return 0;
+        return readReply();
+    }
+
+    // Last line of the last reply
+    const char *reply() const { return line; }
+
+    bool retr(const char *name, uint64_t *bytes, double *epsv_sec = nullptr) {
+        int data = openData(epsv_sec);
+        if (data < 0) return false;
+        if (command("RETR %s", name) != 150) {
+            close(data);
+            return false;
+        }
+        *bytes = drain(data);
+        return readReply() == 226;
+    }
+
+    bool stor(const char *name, const void *buf, size_t len) {
+        int data = openData();
+        if (data < 0) return false;
+        if (command("STOR %s", name) != 150) {
+            close(data);
+            return false;
+        }
+        const char *p = static_cast<const char *>(buf);
+        bool ok = true;
+        while (len > 0 && ok) {
+            ssize_t n = send(data, p, len, 0);
+            ok = n > 0;
+            if (ok) {
+                p += n;
+                len -= n;
+            }
+        }
+        close(data);
+        return readReply() == 226 && ok;
+    }
+
+    // STOR or APPE of buf. With cut < len the data connection is reset after
+    // cut bytes, as when the link drops. Returns the reply code.
+    int upload(const char *verb, const char *name, const void *buf, size_t len, size_t cut) {
+        int data = openData();
+        if (data < 0) return 0;
+        int code = command("%s %s", verb, name);
+        if (code != 150) {
+            close(data);
+            return code;
+        }
+        size_t end = cut < len ? cut : len;
+        const char *p = static_cast<const char *>(buf);
+        size_t sent = 0;
+        while (sent < end) {
+            ssize_t n = send(data, p + sent, end - sent, 0);
+            if (n <= 0) break;
+            sent += n;
+        }
+        if (end < len) reset(data);
+        else close(data);
+        return readReply();
+    }
+
+    // RETR appended to out, from where a preceding REST put the server. With
+    // cut the data connection is reset once that many bytes arrived.
+    int download(const char *name, std::vector<char> &out, size_t cut = SIZE_MAX) {
+        int data = openData();
+        if (data < 0) return 0;
+        int code = command("RETR %s", name);
+        if (code != 150) {
+            close(data);
+            return code;
+        }
+        static thread_local char chunk[65536];
+        size_t got = 0;
+        ssize_t n;
+        while (got < cut && (n = recv(data, chunk, std::min(sizeof(chunk), cut - got), 0)) > 0) {
+            out.insert(out.end(), chunk, chunk + n);
+            got += n;
+        }
+        if (got == cut) reset(data);
+        else close(data);
+        return readReply();
+    }
+
+    // MODE Z download, inflated as it arrives: *wire counts the compressed bytes
+    bool retrCompressed(const char *name, uint64_t *wire, uint64_t *bytes) {
+        int data = openData();
+        if (data < 0) return false;
+        if (command("RETR %s", name) != 150) {
+            close(data);
+            return false;
+        }
+        static thread_local uint8_t chunk[65536];
+        Inflater *z = Inflater::create();
+        Inflater::Status st = Inflater::NEED_INPUT;
+        *wire = *bytes = 0;
+        for (;;) {
+            size_t space;
+            uint8_t *in = z->input(&space);
+            ssize_t n = recv(data, in, space, 0);
+            if (n <= 0) break;
+            z->commitInput(n);
+            *wire += n;
+            do {
+                size_t produced;
+                st = z->run(chunk, sizeof(chunk), &produced);
+                *bytes += produced;
+            } while (st == Inflater::OUTPUT_FULL);
+        }
+        Inflater::destroy(z);
+        close(data);
+        return readReply() == 226 && st == Inflater::DONE;
+    }
+
+    bool list(const char *verb, uint64_t *bytes) {
+        int data = openData();
+        if (data < 0) return false;
+        if (command("%s", verb) != 150) {
+            close(data);
+            return false;
+        }
+        *bytes = drain(data);
+        return readReply() == 226;
+    }
+
+private:
+    int ctrl = -1;
+    sockaddr_in server = {};
+    char buf[4096];
+    size_t buf_len = 0;
+    char line[1024] = {};
+
+    bool readLine() {
+        for (;;) {
+            char *eol = (char *)memchr(buf, '\n', buf_len);
+            if (eol) {
+                size_t n = eol - buf + 1;
+                size_t copy = n < sizeof(line) ? n : sizeof(line) - 1;
+                memcpy(line, buf, copy);
+                line[copy] = 0;
+                memmove(buf, buf + n, buf_len - n);
+                buf_len -= n;
+                return true;
+            }
+            if (buf_len == sizeof(buf)) buf_len = 0;   // Overlong line, drop it
+            ssize_t n = recv(ctrl, buf + buf_len, sizeof(buf) - buf_len, 0);
+            if (n <= 0) return false;
+            buf_len += n;
+        }
+    }
+
+    int readReply() {
+        if (!readLine() || strlen(line) < 4) return 0;
+        int code = atoi(line);
+        if (line[3] != '-') return code;
+        // Multi-line reply: runs until "<code> "
+        char end[5];
+        snprintf(end, sizeof(end), "%03d ", code);
+        while (readLine()) {
+            if (strncmp(line, end, 4) == 0) return code;
+        }
+        return 0;
+    }
+
+    int openData(double *epsv_sec = nullptr) {
+        double t0 = nowSec();
+        if (command("EPSV") != 229) return -1;
+        if (epsv_sec) *epsv_sec = nowSec() - t0;
+        const char *p = strstr(line, "(|||");
+        if (!p) return -1;
+
+        sockaddr_in addr = server;
+        addr.sin_port = htons((uint16_t)atoi(p + 4));
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) return -1;
+        if (::connect(sock, (const sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    static void reset(int sock) {
+        struct linger abort = { 1, 0 };
+        setsockopt(sock, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+        close(sock);
+    }
+
+    static uint64_t drain(int sock) {
+        static thread_local char chunk[65536];
+        uint64_t total = 0;
+        ssize_t n;
+        while ((n = recv(sock, chunk, sizeof(chunk), 0)) > 0) total += n;
+        close(sock);
+        return total;
+    }
+};
+
+/* ==== Statistics ==== */
+struct Latency {
+    size_t samples = 0;
+    double p50 = 0, p90 = 0, p99 = 0, max = 0;     // Microseconds
+
+    static Latency of(std::vector<double> seconds) {
+        Latency l;
+        if (seconds.empty()) return l;
+        std::sort(seconds.begin(), seconds.end());
+        auto at = [&](size_t pct) { return seconds[std::min(seconds.size() - 1, seconds.size() * pct / 100)] * 1e6; };
+        l.samples = seconds.size();
+        l.p50 = at(50);
+        l.p90 = at(90);
+        l.p99 = at(99);
+        l.max = seconds.back() * 1e6;
+        return l;
+    }
+
+    void write(JsonObjectWriter &o) const {
+        o.field("samples", (uint64_t)samples);
+        o.field("p50_us", p50);
+        o.field("p90_us", p90);
+        o.field("p99_us", p99);
+        o.field("max_us", max);
+    }
+};
+
+// Jain's fairness index: 1 when every client got the same, 1/n when one got everything
+static double jain(const std::vector<double> &x) {
+    double sum = 0, squares = 0;
+    for (double v : x) {
+        sum += v;
+        squares += v * v;
+    }
+    return squares > 0 ? sum * sum / (x.size() * squares) : 1.0;
+}
+
+struct Throughput {
+    double mbytes_per_sec = 0;  // All clients together, over the wall time
+    double jain = 0;
+    std::vector<double> per_client;
+    bool ok = true;
+
+    void write(JsonObjectWriter &o) const {
+        o.field("mbytes_per_sec", mbytes_per_sec);
+        o.field("jain", jain);
+        o.field("ok", ok);
+        o.withArray("per_client_mbytes_per_sec", [&](JsonArrayWriter &a) {
+            for (double v : per_client) a.value(v);
+        });
+    }
+};
+
+struct TransferResult {
+    size_t size;
+    int reps;
+    Throughput stor;
+    Throughput retr;
+};
+
+struct ListingResult {
+    int entries;
+    double setup_files_per_sec;     // STOR of the empty files, one EPSV each
+    uint64_t list_bytes;
+    double list_cold_ms;
+    Latency list_warm;
+    double mlsd_cold_ms;
+    Latency mlsd_warm;
+    bool ok;
+};
+
+struct SmallFilesResult {
+    int files;
+    bool pool;              // Passive listeners leased from the pool, or a fresh one per EPSV
+    double total_ms;
+    double per_file_us;
+    Latency epsv;
+    bool ok;
+};
+
+struct ResumeResult {
+    const char *kind;       // "STOR+REST", "STOR+APPE" or "RETR+REST"
+    size_t size;
+    uint64_t cut;           // Bytes the client moved before the link dropped
+    uint64_t kept;          // Where the resumed transfer started
+    uint64_t resent;        // Bytes moved twice: cut - kept
+    double ms;              // Both attempts and the SIZE/REST between them
+    bool ok;                // And the file arrived whole
+};
+
+struct AlloResult {
+    bool allo;              // ALLO <size> before each STOR
+    size_t size;
+    int reps;
+    double mbytes_per_sec;
+    double writes;          // Filesystem calls per file, in-process only
+    double truncates;
+    bool ok;
+};
+
+struct FairnessResult {
+    uint32_t global_bps;            // Caps set on the server, 0 = none
+    uint32_t session_bps;
+    bool upload;
+    uint32_t cap_bytes_per_sec;     // What the caps allow all clients together
+    double seconds;
+    double aggregate_bytes_per_sec;
+    double steady_bytes_per_sec;    // Without the initial burst
+    double cap_error;               // Steady rate relative to the cap, 0.01 = 1 % over
+    Throughput xfer;
+};
+
+struct CompressionResult {
+    const char *data;       // "log" text or "random" bytes
+    bool mode_z;
+    size_t bytes;           // File size
+    uint64_t stor_wire;     // Bytes on the data connection
+    uint64_t retr_wire;
+    double stor_ms;
+    double retr_ms;
+    double stor_cpu_ms;     // Server CPU time, in-process only
+    double retr_cpu_ms;
+    size_t stor_peak;       // Server transfer buffers at their peak, in-process only
+    size_t retr_peak;
+    uint64_t wire_bound;    // MODE Z: most the stream may take, checked both ways
+    bool ok;
+
+    // File bytes per byte the server sent, what its compressor achieved
+    double retrRatio() const { return retr_wire ? (double)bytes / retr_wire : 0; }
+};
+
+struct RetrBackendResult {
+    bool zero_copy;         // sendfile()/mapping, or the read-and-send loop
+    size_t size;
+    int reps;
+    double mbytes_per_sec;
+    double cpu_ms_per_mbyte;    // Server CPU
+    bool ok;
+};
+
+struct DispatchResult {
+    size_t entries;
+    double linear_ns;       // strcasecmp over the table in order, as before the perfect hash
+    double hash_ns;         // FtpServer::commandIndex, i.e. findCommand
+    bool ok;
+};
+
+struct HashResult {
+    size_t bytes;
+    double cold_ms;
+    double warm_ms;
+    bool ok;
+};
+
+struct LoopResult {
+    const char *driver;     // What calls tick(), see Bench::serverLoop()
+    int clients;
+    double seconds;
+    double idle_cpu_ms;     // Server CPU with every client silent
+    uint64_t ticks;         // tick() calls meanwhile, not counted for the task
+    Latency noop;           // One client's NOOPs at random moments
+    bool ok;
+
+    double cpuPercent() const { return idle_cpu_ms / (seconds * 10); }
+};
+
+/* ==== Scenarios ==== */
+struct Bench {
+    static constexpr int APP_TICK_MS = 10;     // Period of the app loop calling tick() in serverLoop()
+
+    sockaddr_in addr = {};
+    int nclients = 4;
+    bool quick = false;
+    std::vector<FtpClient> clients;
+    std::vector<char> payload;
+
+    // Runs fn(i) on every client at once, returns the wall time
+    template <typename FUNC>
+    double parallel(FUNC fn) {
+        std::atomic<int> ready{0};
+        std::atomic<bool> go{false};
+        std::vector<std::thread> threads;
+        for (int i = 0; i < nclients; i++) {
+            threads.emplace_back([&, i]() {
+                ready++;
+                while (!go) std::this_thread::yield();
+                fn(i);
+            });
+        }
+        while (ready < nclients) std::this_thread::yield();
+        double t0 = nowSec();
+        go = true;
+        for (std::thread &t : threads) t.join();
+        return nowSec() - t0;
+    }
+
+    bool connectAll() {
+        clients = std::vector<FtpClient>(nclients);
+        for (FtpClient &c : clients) {
+            if (!c.connect(addr)) return false;
+            c.command("MKD ftp_bench");
+            if (c.command("CWD ftp_bench") != 250) return false;
+        }
+        return true;
+    }
+
+    Latency rtt(int count, bool all) {
+        std::vector<std::vector<double>> samples(nclients);
+        auto noops = [&](int i) {
+            for (int k = 0; k < count; k++) {
+                double t0 = nowSec();
+                clients[i].command("NOOP");
+                samples[i].push_back(nowSec() - t0);
+            }
+        };
+        if (all) {
+            parallel(noops);
+        } else {
+            noops(0);
+        }
+        std::vector<double> merged;
+        for (auto &s : samples) merged.insert(merged.end(), s.begin(), s.end());
+        return Latency::of(merged);
+    }
+
+    Throughput transfer(size_t size, int reps, bool upload) {
+        Throughput t;
+        std::vector<double> busy(nclients);
+        std::vector<char> failed(nclients);
+        double wall = parallel([&](int i) {
+            char name[64];
+            snprintf(name, sizeof(name), "bench_%zu_%d.bin", size, i);
+            double t0 = nowSec();
+            for (int r = 0; r < reps && !failed[i]; r++) {
+                uint64_t got = 0;
+                bool ok = upload ? clients[i].stor(name, payload.data(), size)
+                                 : clients[i].retr(name, &got) && got == size;
+                failed[i] = !ok;
+            }
+            busy[i] = nowSec() - t0;
+        });
+        for (int i = 0; i < nclients; i++) {
+            t.per_client.push_back(size * reps / busy[i] / 1e6);
+            t.ok = t.ok && !failed[i];
+        }
+        t.mbytes_per_sec = (double)size * reps * nclients / wall / 1e6;
+        t.jain = jain(t.per_client);
+        return t;
+    }
+
+    TransferResult transfers(size_t size) {
+        // Enough repetitions that small files still move a measurable amount
+        size_t target = quick ? (8u << 20) : (64u << 20);
+        size_t per_rep = size * nclients;
+        int reps = (int)std::max<size_t>(1, std::min<size_t>(quick ? 50 : 200, target / per_rep));
+        TransferResult r = { size, reps, {}, {} };
+        r.stor = transfer(size, reps, true);
+        r.retr = transfer(size, reps, false);
+        return r;
+    }
+
+    ListingResult listing(int entries) {
+        ListingResult r = {};
+        r.entries = entries;
+        FtpClient &c = clients[0];
+        char dir[32];
+        snprintf(dir, sizeof(dir), "list_%d", entries);
+        c.command("MKD %s", dir);
+        r.ok = c.command("CWD %s", dir) == 250;
+
+        double t0 = nowSec();
+        for (int i = 0; i < entries && r.ok; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "f%05d.txt", i);
+            r.ok = c.stor(name, "", 0);
+        }
+        r.setup_files_per_sec = entries / (nowSec() - t0);
+
+        // The STORs invalidated the cached listing, so the first one renders from the directory
+        std::vector<double> warm;
+        for (const char *verb : { "LIST", "MLSD" }) {
+            warm.clear();
+            for (int k = 0; k < (quick ? 5 : 20) + 1 && r.ok; k++) {
+                uint64_t bytes = 0;
+                t0 = nowSec();
+                r.ok = c.list(verb, &bytes);
+                double sec = nowSec() - t0;
+                if (k == 0) {
+                    (verb[0] == 'L' ? r.list_cold_ms : r.mlsd_cold_ms) = sec * 1e3;
+                    if (verb[0] == 'L') r.list_bytes = bytes;
+                } else {
+                    warm.push_back(sec);
+                }
+            }
+            (verb[0] == 'L' ? r.list_warm : r.mlsd_warm) = Latency::of(warm);
+        }
+        c.command("CWD ..");
+        return r;
+    }
+
+    SmallFilesResult smallFiles(FtpServer *server, int files, bool pool) {
+        // One data connection per file, as a client mirroring a log directory
+        // does. On a server we own the passive port pool can be turned off,
+        // which gives every EPSV the socket, bind and listen of a fresh
+        // listener and closes it after the transfer.
+        SmallFilesResult r = {};
+        r.files = files;
+        r.pool = pool;
+        if (server) server->setPassivePool(pool);
+        FtpClient &c = clients[0];
+        char dir[32];
+        snprintf(dir, sizeof(dir), "list_%d", files);
+        r.ok = c.command("CWD %s", dir) == 250;
+
+        std::vector<double> epsv;
+        double t0 = nowSec();
+        for (int i = 0; i < files && r.ok; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "f%05d.txt", i);
+            uint64_t bytes;
+            double sec = 0;
+            r.ok = c.retr(name, &bytes, &sec);
+            epsv.push_back(sec);
+        }
+        double total = nowSec() - t0;
+        r.total_ms = total * 1e3;
+        r.per_file_us = total * 1e6 / files;
+        r.epsv = Latency::of(epsv);
+        c.command("CWD ..");
+        if (server) server->setPassivePool(FTP_PASV_POOL);
+        return r;
+    }
+
+    ResumeResult resume(const char *kind, size_t size) {
+        // A large transfer cut halfway by a reset data connection, then
+        // finished from where the server (SIZE) or the client says it got
+        // to. The reset throws away whatever still sat in the socket buffers
+        // in between, and that is what goes over the link twice.
+        ResumeResult r = {};
+        r.kind = kind;
+        r.size = size;
+        r.cut = size / 2;
+        FtpClient &c = clients[0];
+        char name[32];
+        snprintf(name, sizeof(name), "resume_%.4s_%.4s.bin", kind, kind + 5);
+        bool upload = kind[0] == 'S';
+        bool append = strcmp(kind + 5, "APPE") == 0;
+        const char *data = payload.data();
+        r.ok = size <= payload.size() && (upload || c.stor(name, data, size));
+
+        std::vector<char> got;
+        double t0 = nowSec();
+        if (upload) {
+            // The server replies 426, or 226 if the reset came after the last byte was read
+            int code = c.upload("STOR", name, data, size, r.cut);
+            r.ok = r.ok && (code == 426 || code == 226) && c.command("SIZE %s", name) == 213;
+            r.kept = strtoull(c.reply() + 4, nullptr, 10);
+            r.ok = r.ok && r.kept <= r.cut;
+            if (r.ok && !append) r.ok = c.command("REST %llu", (unsigned long long)r.kept) == 350;
+            r.ok = r.ok && c.upload(append ? "APPE" : "STOR", name, data + r.kept, size - r.kept, SIZE_MAX) == 226;
+        } else {
+            int code = c.download(name, got, r.cut);
+            r.kept = got.size();
+            r.ok = r.ok && (code == 426 || code == 226) && r.kept == r.cut;
+            r.ok = r.ok && c.command("REST %llu", (unsigned long long)r.kept) == 350 && c.download(name, got) == 226;
+        }
+        r.ms = (nowSec() - t0) * 1e3;
+        r.resent = r.cut - r.kept;
+
+        if (upload) r.ok = r.ok && c.download(name, got) == 226;
+        r.ok = r.ok && got.size() == size && memcmp(got.data(), data, size) == 0;
+        c.command("DELE %s", name);
+        return r;
+    }
+
+    AlloResult allo(CountingFileSystem *fs, size_t size, int reps, bool allo) {
+        // One client uploading fresh files back to back, announcing each
+        // size first or not; the filesystem calls are counted in-process
+        AlloResult r = {};
+        r.allo = allo;
+        r.size = size;
+        r.reps = reps;
+        r.ok = size <= payload.size();
+        FtpClient &c = clients[0];
+        uint64_t writes = fs ? fs->writes.load() : 0;
+        uint64_t truncates = fs ? fs->truncates.load() : 0;
+        double busy = 0;
+        for (int k = 0; k < reps && r.ok; k++) {
+            char name[32];
+            snprintf(name, sizeof(name), "allo_%d.bin", k);
+            c.command("DELE %s", name);
+            double t0 = nowSec();
+            r.ok = (!allo || c.command("ALLO %zu", size) == 200) && c.stor(name, payload.data(), size);
+            busy += nowSec() - t0;
+        }
+        r.mbytes_per_sec = (double)size * reps / 1e6 / busy;
+        if (fs) {
+            r.writes = (double)(fs->writes - writes) / reps;
+            r.truncates = (double)(fs->truncates - truncates) / reps;
+        }
+        return r;
+    }
+
+    FairnessResult fairness(FtpServer &server, uint32_t global_bps, uint32_t session_bps, bool upload) {
+        // Everybody transfers at once under caps the link could easily beat,
+        // for long enough that the initial burst is a small part of it
+        FairnessResult r = {};
+        r.global_bps = global_bps;
+        r.session_bps = session_bps;
+        r.upload = upload;
+        uint64_t sessions = (uint64_t)session_bps * nclients;
+        r.cap_bytes_per_sec = (uint32_t)(global_bps && (!sessions || global_bps < sessions) ? global_bps : sessions);
+        size_t size = (size_t)r.cap_bytes_per_sec * 10 / nclients;
+        std::vector<char> data(size);
+        for (size_t k = 0; k < size; k++) data[k] = payload[k % payload.size()];
+        for (int i = 0; i < nclients && !upload; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "fair_%d.bin", i);
+            clients[i].stor(name, data.data(), size);
+        }
+
+        server.setRateLimits(global_bps, session_bps);
+        std::vector<double> busy(nclients);
+        std::vector<char> failed(nclients);
+        double wall = parallel([&](int i) {
+            char name[32];
+            snprintf(name, sizeof(name), "fair_%d.bin", i);
+            uint64_t got = 0;
+            double t0 = nowSec();
+            failed[i] = upload ? !clients[i].stor(name, data.data(), size)
+                               : !clients[i].retr(name, &got) || got != size;
+            busy[i] = nowSec() - t0;
+        });
+        server.setRateLimits(0, 0);
+
+        r.xfer.ok = true;
+        for (int i = 0; i < nclients; i++) {
+            r.xfer.per_client.push_back(size / busy[i] / 1e6);
+            r.xfer.ok = r.xfer.ok && !failed[i];
+        }
+        r.seconds = wall;
+        r.aggregate_bytes_per_sec = size * nclients / wall;
+        // Buckets start full, FTP_RATE_BURST_MS worth of bytes go out unmetered
+        double burst = (double)r.cap_bytes_per_sec * FTP_RATE_BURST_MS / 1000;
+        r.steady_bytes_per_sec = (size * nclients - burst) / wall;
+        r.cap_error = r.steady_bytes_per_sec / r.cap_bytes_per_sec - 1;
+        r.xfer.mbytes_per_sec = r.aggregate_bytes_per_sec / 1e6;
+        r.xfer.jain = jain(r.xfer.per_client);
+        return r;
+    }
+
+    RetrBackendResult retrBackend(FtpServer &server, size_t size, bool zero_copy) {
+        // One client downloads an existing file back to back with either RETR backend
+        RetrBackendResult r = {};
+        r.zero_copy = zero_copy;
+        r.size = size;
+        r.reps = (int)std::max<size_t>(1, (quick ? (16u << 20) : (128u << 20)) / size);
+        char name[64];
+        snprintf(name, sizeof(name), "bench_%zu_0.bin", size);
+
+        server.setZeroCopy(zero_copy);
+        r.ok = true;
+        double t0 = nowSec();
+        double cpu = serverCpu([&]() {
+            for (int k = 0; k < r.reps && r.ok; k++) {
+                uint64_t got = 0;
+                r.ok = clients[0].retr(name, &got) && got == size;
+            }
+        });
+        double sec = nowSec() - t0;
+        server.setZeroCopy(FTP_RETR_ZERO_COPY);
+
+        double mbytes = (double)size * r.reps / 1e6;
+        r.mbytes_per_sec = mbytes / sec;
+        r.cpu_ms_per_mbyte = cpu * 1e3 / mbytes;
+        return r;
+    }
+
+    LoopResult serverLoop(FtpServer &server, const char *driver, double seconds, int noops) {
+        // Every client logged in while the server is driven one of the ways an
+        // application can: "task" is its own task from start(). Otherwise a
+        // thread of ours stops it and calls tick() instead: blocking in
+        // tick(-1) like the task ("poll"), tick(0) back to back like the loop
+        // before the reactor ("spin"), or tick(0) every APP_TICK_MS like an app
+        // loop with other work to do ("period"). First all clients stay
+        // silent, then one sends NOOPs after random pauses, so they land
+        // anywhere in an app loop's period.
+        LoopResult r = {};
+        r.driver = driver;
+        r.clients = nclients;
+        r.seconds = seconds;
+        bool task = strcmp(driver, "task") == 0;
+        bool block = strcmp(driver, "poll") == 0;
+        bool period = strcmp(driver, "period") == 0;
+        std::atomic<bool> quit{false};
+        std::atomic<uint64_t> ticks{0};
+        std::thread t;
+        if (!task) {
+            server.stop();
+            t = std::thread([&]() {
+                while (!quit) {
+                    server.tick(block ? -1 : 0);
+                    ticks++;
+                    if (period) usleep(APP_TICK_MS * 1000);
+                }
+            });
+        }
+
+        // Clock granularity can take a sleeping server below zero
+        r.idle_cpu_ms = std::max(0.0, serverCpu([&]() { usleep((useconds_t)(seconds * 1e6)); }) * 1e3);
+        r.ticks = ticks;
+        r.ok = true;
+        std::vector<double> samples;
+        for (int k = 0; k < noops && r.ok; k++) {
+            usleep(rand() % (APP_TICK_MS * 1000));
+            double t0 = nowSec();
+            r.ok = clients[0].command("NOOP") == 200;
+            samples.push_back(nowSec() - t0);
+        }
+        r.noop = Latency::of(samples);
+
+        // A connection wakes a tick(-1) so the thread sees it should stop. If
+        // the thread was already on its way out, the restarted task gets it.
+        if (!task) {
+            quit = true;
+            int nudge = socket(AF_INET, SOCK_STREAM, 0);
+            connect(nudge, (const sockaddr *)&addr, sizeof(addr));
+            t.join();
+            close(nudge);
+            r.ok = server.start() && clients[0].command("NOOP") == 200 && r.ok;
+        }
+        return r;
+    }
+
+    // Server CPU over fn(): the whole process minus this (client) thread
+    template <typename FUNC>
+    static double serverCpu(FUNC fn) {
+        double process = clockSec(CLOCK_PROCESS_CPUTIME_ID);
+        double self = clockSec(CLOCK_THREAD_CPUTIME_ID);
+        fn();
+        return (clockSec(CLOCK_PROCESS_CPUTIME_ID) - process) - (clockSec(CLOCK_THREAD_CPUTIME_ID) - self);
+    }
+
+    CompressionResult compression(FtpServer *server, const char *kind, const std::vector<char> &data, bool mode_z) {
+        // One client, STOR then RETR of the same file. In MODE Z the upload is
+        // compressed before the clock starts and the download inflated as it arrives.
+        CompressionResult r = {};
+        r.data = kind;
+        r.mode_z = mode_z;
+        r.bytes = data.size();
+        FtpClient &c = clients[0];
+        std::vector<char> upload = mode_z ? deflateAll(data) : data;
+        char name[32];
+        snprintf(name, sizeof(name), "mode_%s.dat", kind);
+        r.ok = c.command("MODE %c", mode_z ? 'Z' : 'S') == 200;
+
+        if (server) server->resetStats();
+        double t0 = nowSec();
+        r.stor_cpu_ms = serverCpu([&]() { r.ok = r.ok && c.stor(name, upload.data(), upload.size()); }) * 1e3;
+        r.stor_ms = (nowSec() - t0) * 1e3;
+        r.stor_wire = upload.size();
+        if (server) r.stor_peak = server->getMemoryStats().buffers_peak;
+
+        if (server) server->resetStats();
+        uint64_t got = 0;
+        t0 = nowSec();
+        r.retr_cpu_ms = serverCpu([&]() {
+            r.ok = r.ok && (mode_z ? c.retrCompressed(name, &r.retr_wire, &got) : c.retr(name, &got));
+        }) * 1e3;
+        r.retr_ms = (nowSec() - t0) * 1e3;
+        if (!mode_z) r.retr_wire = got;
+        if (server) r.retr_peak = server->getMemoryStats().buffers_peak;
+        r.ok = r.ok && got == data.size();
+        if (mode_z) {
+            r.wire_bound = deflateBound(data.size());
+            r.ok = r.ok && r.stor_wire <= r.wire_bound && r.retr_wire <= r.wire_bound;
+        }
+        c.command("MODE S");
+        return r;
+    }
+
+    // Largest zlib stream the Deflater may make of this many bytes: header and
+    // trailer, and a stored header of 5 bytes plus padding per block. A block
+    // ends after FTP_DEFLATE_BLOCK_SYMBOLS symbols of at least a byte each, or
+    // early at most once per window slide.
+    static uint64_t deflateBound(size_t bytes) {
+        uint64_t blocks = bytes / FTP_DEFLATE_BLOCK_SYMBOLS + bytes / (1u << FTP_DEFLATE_WINDOW_BITS) + 2;
+        return bytes + 6 + 6 * blocks;
+    }
+
+    static std::vector<char> deflateAll(const std::vector<char> &data) {
+        std::vector<char> out;
+        Deflater *z = Deflater::create();
+        MappedBackend source(data.data(), data.size());
+        while (!z->finished()) {
+            z->fill(source);
+            out.insert(out.end(), z->data(), z->data() + z->pending());
+            z->consume(z->pending());
+        }
+        Deflater::destroy(z);
+        return out;
+    }
+
+    DispatchResult dispatch(size_t entries) {
+        // Verb lookups in a shuffled order: the first verbs of the real table,
+        // padded with verbs findCommand doesn't know, which take its miss path.
+        // The hash does the same work whatever the size of the table.
+        DispatchResult r = {};
+        r.entries = entries;
+        std::vector<std::string> verbs;
+        for (size_t i = 0; i < entries; i++) {
+            char pad[8];
+            snprintf(pad, sizeof(pad), "Q%03zu", i);
+            verbs.push_back(i < FtpServer::commandCount() ? FtpServer::commandName(i) : pad);
+        }
+        std::vector<const std::string *> queries;
+        for (int k = 0; k < 4096; k++) queries.push_back(&verbs[rand() % entries]);
+
+        auto linear = [&](const char *cmd) -> long {
+            for (size_t i = 0; i < verbs.size(); i++) {
+                if (strcasecmp(verbs[i].c_str(), cmd) == 0) return (long)i;
+            }
+            return -1;
+        };
+        auto hashed = [&](const char *cmd, size_t len) -> long { return FtpServer::commandIndex(cmd, len); };
+
+        r.ok = true;
+        for (size_t i = 0; i < entries; i++) {
+            long expect = i < FtpServer::commandCount() ? (long)i : -1;
+            r.ok = r.ok && linear(verbs[i].c_str()) == (long)i && hashed(verbs[i].c_str(), verbs[i].size()) == expect;
+        }
+
+        int rounds = quick ? 200 : 2000;
+        volatile long sink = 0;
+        double t0 = nowSec();
+        for (int n = 0; n < rounds; n++) {
+            for (const std::string *q : queries) sink = sink + linear(q->c_str());
+        }
+        r.linear_ns = (nowSec() - t0) * 1e9 / (rounds * queries.size());
+        t0 = nowSec();
+        for (int n = 0; n < rounds; n++) {
+            for (const std::string *q : queries) sink = sink + hashed(q->c_str(), q->size());
+        }
+        r.hash_ns = (nowSec() - t0) * 1e9 / (rounds * queries.size());
+        return r;
+    }
+
+    HashResult hash(size_t size) {
+        // Cold digests the file, warm should come from the server's cache
+        HashResult r = {};
+        r.bytes = size;
+        char cmd[64];
+        snprintf(cmd, sizeof(cmd), "XSHA256 bench_%zu_0.bin", size);
+        double t0 = nowSec();
+        r.ok = clients[0].command("%s", cmd) == 250;
+        r.cold_ms = (nowSec() - t0) * 1e3;
+        t0 = nowSec();
+        r.ok = r.ok && clients[0].command("%s", cmd) == 250;
+        r.warm_ms = (nowSec() - t0) * 1e3;
+        return r;
+    }
+};
+
+// Device log lines: timestamps, tags and numbers that repeat with variations
+static std::vector<char> logText(size_t size) {
+    static const char *const tags[] = { "wifi", "ftp_server", "espnow", "display", "nvs" };
+    std::vector<char> text;
+    text.reserve(size + 256);
+    char line[256];
+    for (unsigned i = 0; text.size() < size; i++) {
+        int n = snprintf(line, sizeof(line),
+                         "2026-10-17T12:%02u:%02u.%03u I (%u) %s: rssi=%d chan=%d heap=%u bssid=aa:bb:cc:%02x:%02x:%02x\n",
+                         i / 3600 % 60, i / 60 % 60, i % 1000, i * 13, tags[rand() % 5], -30 - rand() % 60,
+                         1 + rand() % 13, 150000 + rand() % 20000, rand() & 0xFF, rand() & 0xFF, rand() & 0xFF);
+        text.insert(text.end(), line, line + n);
+    }
+    text.resize(size);
+    return text;
+}
+
+/* ==== Output ==== */
+class FileStream : public Stream {
+    FILE *file;
+
+public:
+    explicit FileStream(FILE *file) : file(file) {}
+    size_t write(const void *data, size_t len) override { return fwrite(data, 1, len, file); }
+    size_t read(void *buffer, size_t len) override { return fread(buffer, 1, len, file); }
+    void flush() override { fflush(file); }
+};
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *) {
+    return remove(path);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--clients N] [--out FILE] [--quick] [--keep] [--verbose] [--connect IP:PORT]\n"
+            "  --clients N        concurrent sessions (default 4)\n"
+            "  --out FILE         JSON results (default ftp_bench.json)\n"
+            "  --quick            smaller files and fewer repetitions\n"
+            "  --keep             leave the scratch directory behind\n"
+            "  --connect IP:PORT  benchmark another server instead of an in-process one\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    Bench bench;
+    const char *out_path = "ftp_bench.json";
+    const char *remote = nullptr;
+    bool keep = false;
+    hostLogLevel() = HOST_LOG_WARN;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--clients") && i + 1 < argc) {
+            bench.nclients = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (!strcmp(argv[i], "--connect") && i + 1 < argc) {
+            remote = argv[++i];
+        } else if (!strcmp(argv[i], "--quick")) {
+            bench.quick = true;
+        } else if (!strcmp(argv[i], "--keep")) {
+            keep = true;
+        } else if (!strcmp(argv[i], "--verbose")) {
+            hostLogLevel() = HOST_LOG_INFO;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (bench.nclients < 1) bench.nclients = 1;
+    signal(SIGPIPE, SIG_IGN);
+
+    // In-process server: scratch root, one session more than the benchmark clients
+    // so a stray connection can't turn into a rejection
+    FtpServer *server = nullptr;
+    static CountingFileSystem rootFs;
+    char root[] = "/tmp/ftp_bench.XXXXXX";
+    bench.addr.sin_family = AF_INET;
+    if (remote) {
+        char host[64];
+        snprintf(host, sizeof(host), "%s", remote);
+        char *colon = strrchr(host, ':');
+        bench.addr.sin_port = htons(colon ? atoi(colon + 1) : 21);
+        if (colon) *colon = 0;
+        if (inet_pton(AF_INET, host, &bench.addr.sin_addr) != 1) {
+            fprintf(stderr, "Bad address %s\n", remote);
+            return 2;
+        }
+    } else {
+        if (!mkdtemp(root)) {
+            perror("mkdtemp");
+            return 1;
+        }
+        rootFs.setRoot(root);
+        server = new FtpServer(rootFs);
+        server->setMaxClients(bench.nclients + 1);
+        server->setPassivePorts(FTP_PASV_PORT_MIN, FTP_PASV_PORT_MIN + bench.nclients);
+        if (!server->init() || !server->start()) {
+            fprintf(stderr, "Server failed to start on port %d\n", FTP_CTRL_PORT);
+            return 1;
+        }
+        bench.addr.sin_port = htons(FTP_CTRL_PORT);
+        inet_pton(AF_INET, "127.0.0.1", &bench.addr.sin_addr);
+    }
+
+    if (!bench.connectAll()) {
+        fprintf(stderr, "Could not log %d clients in\n", bench.nclients);
+        return 1;
+    }
+
+    std::vector<size_t> sizes = { 4u << 10, 64u << 10, 1u << 20, 16u << 20 };
+    if (bench.quick) sizes.pop_back();
+    bench.payload.resize(sizes.back());
+    srand(1);
+    for (char &b : bench.payload) b = (char)rand();
+    int list_entries = 1000;
+
+    printf("%d clients, %s\n", bench.nclients, remote ? remote : "in-process server");
+    Latency rtt = bench.rtt(bench.quick ? 500 : 2000, false);
+    printf("NOOP round trip         p50 %7.1f us  p99 %7.1f us\n", rtt.p50, rtt.p99);
+    Latency rtt_all = bench.rtt(bench.quick ? 200 : 1000, true);
+    printf("NOOP, all clients       p50 %7.1f us  p99 %7.1f us\n", rtt_all.p50, rtt_all.p99);
+
+    // Command dispatch is host CPU work, only meaningful for the server in this process
+    std::vector<DispatchResult> dispatch;
+    if (server) {
+        for (size_t entries : { 20, 60 }) {
+            dispatch.push_back(bench.dispatch(entries));
+            const DispatchResult &d = dispatch.back();
+            printf("Verb lookup, %2zu verbs   strcasecmp %6.1f ns  perfect hash %6.1f ns%s\n", d.entries,
+                   d.linear_ns, d.hash_ns, d.ok ? "" : "  FAILED");
+        }
+    }
+
+    // The server's own loop is only in reach in this process
+    std::vector<LoopResult> loops;
+    if (server) {
+        for (const char *driver : { "task", "poll", "spin", "period" }) {
+            loops.push_back(bench.serverLoop(*server, driver, bench.quick ? 1 : 3, bench.quick ? 100 : 300));
+            const LoopResult &r = loops.back();
+            char ticks[24] = "-";
+            if (strcmp(r.driver, "task") != 0) snprintf(ticks, sizeof(ticks), "%llu", (unsigned long long)r.ticks);
+            printf("Loop %-6s idle %d clients %.0f s cpu %7.1f ms (%6.2f %%) ticks %8s  NOOP p50 %7.1f us  p99 %7.1f us%s\n",
+                   r.driver, r.clients, r.seconds, r.idle_cpu_ms, r.cpuPercent(), ticks, r.noop.p50, r.noop.p99,
+                   r.ok ? "" : "  FAILED");
+        }
+    }
+
+    std::vector<TransferResult> transfers;
+    for (size_t size : sizes) {
+        transfers.push_back(bench.transfers(size));
+        const TransferResult &t = transfers.back();
+        printf("%8zu B x %3d  STOR %8.2f MB/s (Jain %.3f)  RETR %8.2f MB/s (Jain %.3f)%s\n", size, t.reps,
+               t.stor.mbytes_per_sec, t.stor.jain, t.retr.mbytes_per_sec, t.retr.jain,
+               t.stor.ok && t.retr.ok ? "" : "  FAILED");
+    }
+
+    // Backends can only be switched on a server we own
+    std::vector<RetrBackendResult> backends;
+    if (server) {
+        for (bool zero_copy : { true, false }) {
+            backends.push_back(bench.retrBackend(*server, sizes.back(), zero_copy));
+            const RetrBackendResult &b = backends.back();
+            printf("RETR %-9s %8zu B x %3d  %8.2f MB/s  server cpu %6.3f ms/MB%s\n",
+                   b.zero_copy ? "zero-copy" : "copy-loop", b.size, b.reps, b.mbytes_per_sec, b.cpu_ms_per_mbyte,
+                   b.ok ? "" : "  FAILED");
+        }
+    }
+
+    ListingResult listing = bench.listing(list_entries);
+    printf("LIST %d entries        cold %7.2f ms  warm p50 %7.2f ms   MLSD cold %7.2f ms  warm p50 %7.2f ms%s\n",
+           listing.entries, listing.list_cold_ms, listing.list_warm.p50 / 1e3, listing.mlsd_cold_ms,
+           listing.mlsd_warm.p50 / 1e3, listing.ok ? "" : "  FAILED");
+
+    // Only a server we own can go without its passive port pool
+    std::vector<SmallFilesResult> small;
+    for (bool pool : { true, false }) {
+        if (!pool && !server) break;
+        small.push_back(bench.smallFiles(server, list_entries, pool));
+        const SmallFilesResult &r = small.back();
+        printf("RETR %d small files, %-13s %7.1f ms total, %6.1f us per file, EPSV p50 %6.1f us  p99 %6.1f us%s\n",
+               r.files, r.pool ? "port pool" : "fresh listener", r.total_ms, r.per_file_us, r.epsv.p50, r.epsv.p99,
+               r.ok ? "" : "  FAILED");
+    }
+
+    std::vector<ResumeResult> resumes;
+    for (const char *kind : { "STOR+REST", "STOR+APPE", "RETR+REST" }) {
+        resumes.push_back(bench.resume(kind, sizes.back()));
+        const ResumeResult &r = resumes.back();
+        printf("%s %8zu B cut at %8llu B, resumed at %8llu B, %7llu B resent (%5.2f %%) in %7.1f ms%s\n", r.kind,
+               r.size, (unsigned long long)r.cut, (unsigned long long)r.kept, (unsigned long long)r.resent,
+               100.0 * r.resent / r.size, r.ms, r.ok ? "" : "  FAILED");
+    }
+
+    std::vector<AlloResult> allos;
+    for (bool allo : { false, true }) {
+        allos.push_back(bench.allo(server ? &rootFs : nullptr, sizes.back(), bench.quick ? 4 : 8, allo));
+        const AlloResult &a = allos.back();
+        printf("STOR %-10s %8zu B x %d  %8.2f MB/s", a.allo ? "after ALLO" : "plain", a.size, a.reps,
+               a.mbytes_per_sec);
+        if (server) printf("  %6.1f writes %4.1f truncates per file", a.writes, a.truncates);
+        printf("%s\n", a.ok ? "" : "  FAILED");
+    }
+
+    std::vector<CompressionResult> compression;
+    size_t compress_size = bench.quick ? (4u << 20) : (16u << 20);
+    std::vector<char> text = logText(compress_size);
+    std::vector<char> noise(bench.payload.begin(), bench.payload.begin() + std::min(compress_size, bench.payload.size()));
+    for (const std::vector<char> *data : { &text, &noise }) {
+        for (bool mode_z : { false, true }) {
+            const char *kind = data == &text ? "log" : "random";
+            compression.push_back(bench.compression(server, kind, *data, mode_z));
+            const CompressionResult &c = compression.back();
+            printf("MODE %c %-6s %8zu B  STOR %7.1f ms wire %9llu B cpu %6.1f ms peak %6zu B"
+                   "  RETR %7.1f ms wire %9llu B (%5.2fx) cpu %6.1f ms peak %6zu B%s\n",
+                   c.mode_z ? 'Z' : 'S', c.data, c.bytes, c.stor_ms, (unsigned long long)c.stor_wire,
+                   c.stor_cpu_ms, c.stor_peak, c.retr_ms, (unsigned long long)c.retr_wire, c.retrRatio(),
+                   c.retr_cpu_ms, c.retr_peak, c.ok ? "" : "  FAILED");
+            if (c.mode_z && c.retr_wire > c.bytes) {
+                printf("MODE Z %-6s grows %llu B over the file, bound %llu B\n", c.data,
+                       (unsigned long long)(c.retr_wire - c.bytes), (unsigned long long)(c.wire_bound - c.bytes));
+            }
+        }
+    }
+
+    HashResult hash = bench.hash(sizes.back());
+    printf("XSHA256 %zu B         cold %7.2f ms  warm %7.3f ms%s\n", hash.bytes, hash.cold_ms, hash.warm_ms,
+           hash.ok ? "" : "  FAILED");
+
+    // Rate limits can only be set on a server we own
+    std::vector<FairnessResult> fairness;
+    if (server) {
+        static const struct {
+            uint32_t global_bps;
+            uint32_t session_bps;
+            bool upload;
+        } caps[] = {
+            { 1u << 20, 0, false },
+            { 1u << 20, 0, true },
+            { 0, 128u << 10, true },
+            { 256u << 10, 128u << 10, true },
+        };
+        for (const auto &cap : caps) {
+            fairness.push_back(bench.fairness(*server, cap.global_bps, cap.session_bps, cap.upload));
+            const FairnessResult &f = fairness.back();
+            printf("%s cap %7u B/s global %7u B/s session  %8.0f B/s over %.1f s, %8.0f B/s after the burst,"
+                   " cap error %+.2f %%, Jain %.3f%s\n", f.upload ? "STOR" : "RETR", f.global_bps, f.session_bps,
+                   f.aggregate_bytes_per_sec, f.seconds, f.steady_bytes_per_sec, f.cap_error * 100, f.xfer.jain,
+                   f.xfer.ok ? "" : "  FAILED");
+        }
+    }
+
+    FILE *file = fopen(out_path, "w");
+    if (!file) {
+        perror(out_path);
+        return 1;
+    }
+    FileStream stream(file);
+    JsonObjectWriter::create(stream, [&](JsonObjectWriter &root) {
+        root.withObject("config", [&](JsonObjectWriter &o) {
+            o.field("clients", (int64_t)bench.nclients);
+            o.field("quick", bench.quick);
+            o.field("server", remote ? remote : "in-process");
+        });
+        root.withObject("rtt", [&](JsonObjectWriter &o) { rtt.write(o); });
+        root.withObject("rtt_all_clients", [&](JsonObjectWriter &o) { rtt_all.write(o); });
+        if (server) {
+            root.withArray("dispatch", [&](JsonArrayWriter &a) {
+                for (const DispatchResult &d : dispatch) {
+                    a.withObject([&](JsonObjectWriter &o) {
+                        o.field("entries", (uint64_t)d.entries);
+                        o.field("ok", d.ok);
+                        o.field("strcasecmp_ns", d.linear_ns);
+                        o.field("perfect_hash_ns", d.hash_ns);
+                    });
+                }
+            });
+        }
+        if (server) {
+            root.withArray("server_loop", [&](JsonArrayWriter &a) {
+                for (const LoopResult &r : loops) {
+                    a.withObject([&](JsonObjectWriter &o) {
+                        o.field("driver", r.driver);
+                        o.field("clients", (int64_t)r.clients);
+                        o.field("seconds", r.seconds);
+                        o.field("ok", r.ok);
+                        o.field("idle_cpu_ms", r.idle_cpu_ms);
+                        o.field("ticks", r.ticks);
+                        o.withObject("noop", [&](JsonObjectWriter &l) { r.noop.write(l); });
+                    });
+                }
+            });
+        }
+        root.withArray("transfers", [&](JsonArrayWriter &a) {
+            for (const TransferResult &t : transfers) {
+                a.withObject([&](JsonObjectWriter &o) {
+                    o.field("size", (uint64_t)t.size);
+                    o.field("reps", (int64_t)t.reps);
+                    o.withObject("stor", [&](JsonObjectWriter &s) { t.stor.write(s); });
+                    o.withObject("retr", [&](JsonObjectWriter &s) { t.retr.write(s); });
+                });
+            }
+        });
+        if (server) {
+            root.withArray("retr_backends", [&](JsonArrayWriter &a) {
+                for (const RetrBackendResult &b : backends) {
+                    a.withObject([&](JsonObjectWriter &o) {
+                        o.field("backend", b.zero_copy ? "zero-copy" : "copy-loop");
+                        o.field("size", (uint64_t)b.size);
+                        o.field("reps", (int64_t)b.reps);
+                        o.field("ok", b.ok);
+                        o.field("mbytes_per_sec", b.mbytes_per_sec);
+                        o.field("server_cpu_ms_per_mbyte", b.cpu_ms_per_mbyte);
+                    });
+                }
+            });
+        }
+        root.withObject("listing", [&](JsonObjectWriter &o) {
+            o.field("entries", (int64_t)listing.entries);
+            o.field("ok", listing.ok);
+            o.field("setup_files_per_sec", listing.setup_files_per_sec);
+            o.field("list_bytes", listing.list_bytes);
+            o.field("list_cold_ms", listing.list_cold_ms);
+            o.withObject("list_warm", [&](JsonObjectWriter &l) { listing.list_warm.write(l); });
+            o.field("mlsd_cold_ms", listing.mlsd_cold_ms);
+            o.withObject("mlsd_warm", [&](JsonObjectWriter &l) { listing.mlsd_warm.write(l); });
+        });
+        root.withArray("small_files", [&](JsonArrayWriter &a) {
+            for (const SmallFilesResult &r : small) {
+                a.withObject([&](JsonObjectWriter &o) {
+                    o.field("files", (int64_t)r.files);
+                    o.field("passive_pool", r.pool);
+                    o.field("ok", r.ok);
+                    o.field("total_ms", r.total_ms);
+                    o.field("per_file_us", r.per_file_us);
+                    o.withObject("epsv", [&](JsonObjectWriter &l) { r.epsv.write(l); });
+                });
+            }
+        });
+        root.withArray("resume", [&](JsonArrayWriter &a) {
+            for (const ResumeResult &r : resumes) {
+                a.withObject([&](JsonObjectWriter &o) {
+                    o.field("kind", r.kind);
+                    o.field("size", (uint64_t)r.size);
+                    o.field("ok", r.ok);
+                    o.field("cut_bytes", r.cut);
+                    o.field("resumed_at", r.kept);
+                    o.field("resent_bytes", r.resent);
+                    o.field("ms", r.ms);
+                });
+            }
+        });
+        root.withArray("allo", [&](JsonArrayWriter &a) {
+            for (const AlloResult &r : allos) {
+                a.withObject([&](JsonObjectWriter &o) {
+                    o.field("allo", r.allo);
+                    o.field("size", (uint64_t)r.size);
+                    o.field("reps", (int64_t)r.reps);
+                    o.field("ok", r.ok);
+                    o.field("mbytes_per_sec", r.mbytes_per_sec);
+                    if (!server) return;
+                    o.field("fs_writes_per_file", r.writes);
+                    o.field("fs_truncates_per_file", r.truncates);
+                });
+            }
+        });
+        root.withArray("compression", [&](JsonArrayWriter &a) {
+            for (const CompressionResult &c : compression) {
+                a.withObject([&](JsonObjectWriter &o) {
+                    o.field("data", c.data);
+                    o.field("mode", c.mode_z ? "Z" : "S");
+                    o.field("bytes", (uint64_t)c.bytes);
+                    o.field("ok", c.ok);
+                    o.field("retr_ratio", c.retrRatio());
+                    if (c.mode_z) o.field("wire_bound", c.wire_bound);
+                    for (bool upload : { true, false }) {
+                        o.withObject(upload ? "stor" : "retr", [&](JsonObjectWriter &s) {
+                            s.field("ms", upload ? c.stor_ms : c.retr_ms);
+                            s.field("wire_bytes", upload ? c.stor_wire : c.retr_wire);
+                            if (!server) return;
+                            s.field("server_cpu_ms", upload ? c.stor_cpu_ms : c.retr_cpu_ms);
+                            s.field("server_buffers_peak", (uint64_t)(upload ? c.stor_peak : c.retr_peak));
+                        });
+                    }
+                });
+            }
+        });
+        root.withObject("hash", [&](JsonObjectWriter &o) {
+            o.field("bytes", (uint64_t)hash.bytes);
+            o.field("ok", hash.ok);
+            o.field("cold_ms", hash.cold_ms);
+            o.field("warm_ms", hash.warm_ms);
+        });
+        if (server) {
+            root.withArray("fairness", [&](JsonArrayWriter &a) {
+                for (const FairnessResult &f : fairness) {
+                    a.withObject([&](JsonObjectWriter &o) {
+                        o.field("direction", f.upload ? "stor" : "retr");
+                        o.field("global_bps", (uint64_t)f.global_bps);
+                        o.field("session_bps", (uint64_t)f.session_bps);
+                        o.field("cap_bytes_per_sec", (uint64_t)f.cap_bytes_per_sec);
+                        o.field("seconds", f.seconds);
+                        o.field("aggregate_bytes_per_sec", f.aggregate_bytes_per_sec);
+                        o.field("steady_bytes_per_sec", f.steady_bytes_per_sec);
+                        o.field("cap_error", f.cap_error);
+                        o.withObject("xfer", [&](JsonObjectWriter &s) { f.xfer.write(s); });
+                    });
+                }
+            });
+            FtpServer::MemoryStats mem = server->getMemoryStats();
+            root.withObject("server_memory", [&](JsonObjectWriter &o) {
+                o.field("fixed", (uint64_t)mem.fixed);
+                o.field("session_bytes", (uint64_t)mem.session_bytes);
+                o.field("sessions_peak", (uint64_t)mem.sessions_peak);
+                o.field("buffers_peak", (uint64_t)mem.buffers_peak);
+                o.field("listing_cache", (uint64_t)mem.listing_cache);
+            });
+        }
+    });
+    stream.write("\n", 1);
+    fclose(file);
+    printf("Results written to %s\n", out_path);
+
+    bench.clients.clear();
+    if (server) {
+        server->stop();
+        delete server;
+        if (!keep) nftw(root, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    return 0;
+}
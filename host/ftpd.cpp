@@ -0,0 +1,46 @@
+// Serves a directory with the firmware's FtpServer, for trying clients
+// against it on a PC: ftpd <root> [max clients]. A RAM filesystem with a
+// status file is mounted at /ram, like firmware would publish live data, and
+// the packed assets at /assets.
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "FtpServer.h"
+#include "RamFileSystem.h"
+#include "AssetFileSystem.h"
+
+static volatile sig_atomic_t quit = 0;
+
+static void onSignal(int) {
+    quit = 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <root> [max clients]\n", argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    FtpServer server(argv[1]);
+    RamFileSystem ram(256 * 1024);
+    const char status[] = "ftpd running\n";
+    ram.writeFile("/status.txt", status, sizeof(status) - 1);
+    server.mount("/ram", ram);
+    AssetImage assets;
+    AssetFileSystem assetFs(assets);
+    if (assets.mapFile(FTP_HOST_ASSET_IMAGE)) server.mount("/assets", assetFs);
+    if (argc > 2) {
+        int clients = atoi(argv[2]);
+        server.setMaxClients(clients);
+        server.setPassivePorts(FTP_PASV_PORT_MIN, FTP_PASV_PORT_MIN + clients - 1);
+    }
+    if (!server.init() || !server.start()) return 1;
+
+    while (!quit) pause();
+    server.stop();
+    return 0;
+}
@@ -0,0 +1,1035 @@
+// Benchmark for the JSON writers and the streams below them. Serializes a
+// status-like document of about 10 KB over and over and reports throughput
+// and how many write() calls reach the sink, with and without a
+// BufferedStream in between. Number formatting is timed against snprintf
+// and checked to read back exactly, string escaping against a bytewise
+// escaper, Base64 encoding against a bytewise encoder and decoding for
+// round trips, and JsonReader against a DOM parser reading the document back. Results also go to a JSON file:
+//
+//   json_bench [--out FILE] [--quick]
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <new>
+#include <string>
+#include <vector>
+#include "BufferedStream.h"
+#include "json.h"
+
+static double nowSec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ==== Sinks ==== */
+// Counts the write() calls that reach it; the bytes go to memory, or to a
+// file descriptor when one is given so every call is a system call
+class SinkStream : public Stream {
+    int fd;
+
+public:
+    std::vector<char> data;
+    size_t writes = 0;
+
+    explicit SinkStream(int fd = -1) : fd(fd) { data.reserve(64 << 10); }
+
+    size_t write(const void *buf, size_t len) override {
+        ++writes;
+        if (fd >= 0) return ::write(fd, buf, len) < 0 ? 0 : len;
+        const char *p = static_cast<const char *>(buf);
+        data.insert(data.end(), p, p + len);
+        return len;
+    }
+    size_t read(void *, size_t) override { return 0; }
+    void flush() override {}
+
+    void reset() {
+        data.clear();
+        writes = 0;
+    }
+};
+
+class FileStream : public Stream {
+    FILE *file;
+
+public:
+    explicit FileStream(FILE *file) : file(file) {}
+    size_t write(const void *data, size_t len) override { return fwrite(data, 1, len, file); }
+    size_t read(void *buffer, size_t len) override { return fread(buffer, 1, len, file); }
+    void flush() override { fflush(file); }
+};
+
+/* ==== Document ==== */
+// Directory listing with transfer counters: names with characters to
+// escape, integers, fractions, flags and a short binary digest per file
+struct FileRecord {
+    char name[48];
+    uint64_t size;
+    int64_t mtime;
+    double ratio;
+    bool dir;
+    uint8_t digest[12];
+};
+
+static std::vector<FileRecord> makeRecords(size_t count) {
+    std::vector<FileRecord> records(count);
+    srand(7);
+    for (size_t i = 0; i < count; i++) {
+        FileRecord &r = records[i];
+        snprintf(r.name, sizeof(r.name), i % 5 ? "log_%04zu.txt" : "dir \"%zu\"\\sub\t", i);
+        r.size = (uint64_t)rand() * 37 % 50000000;
+        r.mtime = 1760000000 + rand() % 1000000;
+        r.ratio = rand() / (double)RAND_MAX;
+        r.dir = i % 5 == 0;
+        for (uint8_t &b : r.digest) b = (uint8_t)rand();
+    }
+    return records;
+}
+
+static void writeDocument(Stream &out, const std::vector<FileRecord> &records) {
+    JsonObjectWriter::create(out, [&](JsonObjectWriter &root) {
+        root.field("path", "/sdcard/logs");
+        root.field("count", (uint64_t)records.size());
+        root.withArray("entries", [&](JsonArrayWriter &arr) {
+            for (const FileRecord &r : records) {
+                arr.withObject([&](JsonObjectWriter &o) {
+                    o.field("name", r.name);
+                    o.field("size", r.size);
+                    o.field("mtime", r.mtime);
+                    o.field("ratio", r.ratio);
+                    o.field("dir", r.dir);
+                    o.fieldData("digest", r.digest, sizeof(r.digest));
+                });
+            }
+        });
+    });
+}
+
+/* ==== Scenarios ==== */
+struct BufferResult {
+    const char *sink;
+    size_t buffer;          // 0: unbuffered
+    size_t doc_bytes;
+    double writes_per_doc;
+    double mbytes_per_sec;
+    double speedup;         // Over the unbuffered run on the same sink
+    bool ok;
+};
+
+// Serializes the document reps times and keeps the fastest of three rounds
+static BufferResult serialize(const char *sink_name, int fd, size_t buffer, int reps,
+                              const std::vector<FileRecord> &records, const std::vector<char> &reference) {
+    BufferResult r = {};
+    r.sink = sink_name;
+    r.buffer = buffer;
+    SinkStream sink(fd);
+    std::vector<char> storage(buffer);
+    double best = 0;
+    for (int round = 0; round < 3; round++) {
+        double t0 = nowSec();
+        size_t writes = 0;
+        for (int i = 0; i < reps; i++) {
+            sink.reset();
+            if (buffer) {
+                BufferedStream buffered(sink, storage.data(), buffer);
+                writeDocument(buffered, records);
+            } else {
+                writeDocument(sink, records);
+            }
+            writes += sink.writes;
+        }
+        double sec = nowSec() - t0;
+        if (round == 0 || sec < best) best = sec;
+        r.writes_per_doc = writes / (double)reps;
+    }
+    r.doc_bytes = reference.size();
+    r.mbytes_per_sec = reference.size() * reps / best / 1e6;
+    r.ok = fd >= 0 || sink.data == reference;
+    return r;
+}
+
+// A downstream stream that fills up after limit bytes, under a counter of
+// what BufferedStream reports taken: every such byte has to have reached
+// the sink or still be buffered, and the sink holds a prefix of the document
+class FullSink : public Stream {
+    size_t limit;
+
+public:
+    std::vector<char> data;
+
+    explicit FullSink(size_t limit) : limit(limit) {}
+    size_t write(const void *buf, size_t len) override {
+        size_t n = std::min(len, limit - data.size());
+        const char *p = static_cast<const char *>(buf);
+        data.insert(data.end(), p, p + n);
+        return n;
+    }
+    size_t read(void *, size_t) override { return 0; }
+    void flush() override {}
+};
+
+class TakenCounter : public Stream {
+    Stream &inner;
+
+public:
+    size_t taken = 0;
+
+    explicit TakenCounter(Stream &inner) : inner(inner) {}
+    size_t write(const void *buf, size_t len) override {
+        size_t n = inner.write(buf, len);
+        taken += n;
+        return n;
+    }
+    size_t read(void *, size_t) override { return 0; }
+    void flush() override { inner.flush(); }
+};
+
+static bool shortWrites(const std::vector<FileRecord> &records, const std::vector<char> &reference) {
+    bool ok = true;
+    for (size_t buffer : { (size_t)64, (size_t)1024 }) {
+        FullSink sink(reference.size() / 2);
+        std::vector<char> storage(buffer);
+        BufferedStream buffered(sink, storage.data(), buffer);
+        TakenCounter counter(buffered);
+        writeDocument(counter, records);
+        buffered.flush();
+        ok = ok && buffered.failed() && counter.taken == sink.data.size() + buffered.buffered() &&
+             std::equal(sink.data.begin(), sink.data.end(), reference.begin());
+    }
+    return ok;
+}
+
+// Random 64-bit patterns for the number scenarios
+static uint64_t nextRandom(uint64_t &state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+struct NumberResult {
+    const char *kind;
+    const char *method;
+    double mnumbers_per_sec;
+};
+
+// Formats every value of values reps times; the lengths are summed so the
+// work can't be optimized away
+template <typename T, typename FUNC>
+static NumberResult formatRate(const char *kind, const char *method, const std::vector<T> &values, int reps, FUNC format) {
+    char buf[64];
+    volatile size_t total = 0;
+    double t0 = nowSec();
+    for (int r = 0; r < reps; r++) {
+        for (T v : values) total = total + format(v, buf);
+    }
+    return { kind, method, values.size() * (double)reps / (nowSec() - t0) / 1e6 };
+}
+
+// Significant digits of a formatted number
+static int significantDigits(const char *s, size_t len) {
+    int first = -1, last = -1, n = 0;
+    for (size_t i = 0; i < len && s[i] != 'e'; i++) {
+        if (s[i] < '0' || s[i] > '9') continue;
+        if (s[i] != '0') {
+            if (first < 0) first = n;
+            last = n;
+        }
+        n++;
+    }
+    return first < 0 ? 1 : last - first + 1;
+}
+
+struct RoundTripResult {
+    const char *kind;
+    size_t values;
+    size_t failures;
+    size_t shortest;        // As few digits as the shortest %.Ng that reads back
+};
+
+// Every output has to parse back to the exact same bits
+template <typename T>
+static RoundTripResult roundTrip(const char *kind, const std::vector<T> &values) {
+    RoundTripResult r = { kind, values.size(), 0, 0 };
+    for (T v : values) {
+        char buf[JsonNumber::MaxLength + 1];
+        size_t len = sizeof(T) == 4 ? JsonNumber::formatFloat(v, buf) : JsonNumber::formatDouble(v, buf);
+        buf[len] = 0;
+        T back = sizeof(T) == 4 ? strtof(buf, nullptr) : strtod(buf, nullptr);
+        if (memcmp(&back, &v, sizeof(v)) != 0) {
+            if (r.failures++ < 5) printf("  %s %.17g formatted as %s\n", kind, (double)v, buf);
+            continue;
+        }
+        for (int digits = 1; digits <= 17; digits++) {
+            char ref[40];
+            snprintf(ref, sizeof(ref), "%.*e", digits - 1, (double)v);
+            T ref_back = sizeof(T) == 4 ? strtof(ref, nullptr) : strtod(ref, nullptr);
+            if (ref_back != v) continue;
+            r.shortest += significantDigits(buf, len) <= digits;
+            break;
+        }
+    }
+    return r;
+}
+
+template <typename T>
+static std::vector<T> randomReals(size_t count, uint64_t &state) {
+    using Bits = typename std::conditional<sizeof(T) == 4, uint32_t, uint64_t>::type;
+    // Edge cases first: zeros, subnormals, powers of two, extremes
+    std::vector<T> values = { (T)0.0, (T)-0.0, (T)0.1, (T)1.0 / 3, (T)1e23, (T)5e-324, (T)9007199254740993.0,
+                              std::numeric_limits<T>::min(), std::numeric_limits<T>::max(),
+                              std::numeric_limits<T>::denorm_min(), std::numeric_limits<T>::lowest(),
+                              std::numeric_limits<T>::epsilon() };
+    for (int e = -60; e <= 60; e++) values.push_back(std::ldexp((T)1, e));
+    while (values.size() < count) {
+        Bits bits = (Bits)nextRandom(state);
+        T v;
+        memcpy(&v, &bits, sizeof(v));
+        if (std::isfinite(v)) values.push_back(v);
+    }
+    // Plus values in the range of real measurements
+    for (size_t i = 0; i < count / 4; i++) values[values.size() - 1 - i] = (T)((nextRandom(state) % 2000000) / 1000.0);
+    return values;
+}
+
+// The escaper as it was: one switch and one downstream write per byte
+class BytewiseEscapedStream : public Stream {
+    Stream &out;
+
+public:
+    explicit BytewiseEscapedStream(Stream &s) : out(s) {}
+
+    size_t write(const void *data, size_t len) override {
+        const char *p = static_cast<const char *>(data);
+        for (size_t i = 0; i < len; ++i) {
+            char c = p[i];
+            switch (c) {
+                case '\"': out.write("\\\"", 2); break;
+                case '\\': out.write("\\\\", 2); break;
+                case '\b': out.write("\\b", 2); break;
+                case '\f': out.write("\\f", 2); break;
+                case '\n': out.write("\\n", 2); break;
+                case '\r': out.write("\\r", 2); break;
+                case '\t': out.write("\\t", 2); break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        char buf[7];
+                        snprintf(buf, sizeof(buf), "\\u%04X", c);
+                        out.write(buf, 6);
+                    } else {
+                        out.write(&c, 1);
+                    }
+                    break;
+            }
+        }
+        return len;
+    }
+    size_t read(void *, size_t) override { return 0; }
+    void flush() override { out.flush(); }
+};
+
+struct EscapeResult {
+    const char *input;
+    const char *method;
+    double writes_per_string;
+    double mbytes_per_sec;  // Of input
+    bool ok;                // Same output as the bytewise escaper
+};
+
+template <typename ESCAPER>
+static EscapeResult escapeRate(const char *input, const char *method, const std::vector<std::string> &strings,
+                               int reps, std::vector<char> *output) {
+    SinkStream sink;
+    size_t bytes = 0, writes = 0;
+    double t0 = nowSec();
+    for (int r = 0; r < reps; r++) {
+        for (const std::string &s : strings) {
+            sink.reset();
+            ESCAPER esc(sink);
+            esc.write(s.data(), s.size());
+            bytes += s.size();
+            writes += sink.writes;
+            if (r == 0) output->insert(output->end(), sink.data.begin(), sink.data.end());
+        }
+    }
+    double sec = nowSec() - t0;
+    return { input, method, writes / (double)(strings.size() * reps), bytes / sec / 1e6, true };
+}
+
+// Typical strings are names and paths with nothing to escape, the worst
+// case escapes every byte
+static std::vector<std::string> escapeInput(const char *kind, size_t count, uint64_t &state) {
+    static const char *const words[] = { "sdcard", "logs", "firefly", "dino_", "ap_config", "assets", "help.txt" };
+    std::vector<std::string> strings;
+    for (size_t i = 0; i < count; i++) {
+        std::string s;
+        if (!strcmp(kind, "paths")) {
+            for (int n = 2 + nextRandom(state) % 4; n > 0; n--) {
+                s += '/';
+                s += words[nextRandom(state) % 7];
+            }
+        } else if (!strcmp(kind, "text")) {
+            // A log message: long, a line break or quote now and then
+            while (s.size() < 1000) {
+                s += words[nextRandom(state) % 7];
+                uint64_t r = nextRandom(state) % 40;
+                s += r == 0 ? '\n' : r == 1 ? '"' : ' ';
+            }
+        } else {
+            static const char worst[] = { '"', '\\', '\n', '\t', '\x01', '\x1f' };
+            for (int n = 0; n < 64; n++) s += worst[nextRandom(state) % 6];
+        }
+        strings.push_back(s);
+    }
+    return strings;
+}
+
+// The encoder as it was: bytes staged one at a time, a write per group
+class BytewiseBase64Stream : public Stream {
+    Stream &out;
+    uint8_t buf[3];
+    size_t bufLen = 0;
+
+    void encodeBlock(const uint8_t *block, size_t len) {
+        static const char *table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        uint32_t triple = (block[0] << 16) | ((len > 1 ? block[1] : 0) << 8) | (len > 2 ? block[2] : 0);
+        char outbuf[4] = { table[(triple >> 18) & 0x3F], table[(triple >> 12) & 0x3F],
+                           len > 1 ? table[(triple >> 6) & 0x3F] : '=', len > 2 ? table[triple & 0x3F] : '=' };
+        out.write(outbuf, 4);
+    }
+
+public:
+    explicit BytewiseBase64Stream(Stream &s) : out(s) {}
+    size_t write(const void *data, size_t len) override {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        for (size_t i = 0; i < len; ++i) {
+            buf[bufLen++] = bytes[i];
+            if (bufLen == 3) {
+                encodeBlock(buf, 3);
+                bufLen = 0;
+            }
+        }
+        return len;
+    }
+    size_t read(void *, size_t) override { return 0; }
+    void finish() {
+        if (bufLen > 0) encodeBlock(buf, bufLen);
+        bufLen = 0;
+    }
+    void flush() override { finish(); }
+};
+
+// Hands out text in pieces of random size, as a socket would
+class ChunkedSource : public Stream {
+    const std::vector<char> &text;
+    size_t pos = 0;
+    uint64_t *state;
+
+public:
+    ChunkedSource(const std::vector<char> &text, uint64_t *state) : text(text), state(state) {}
+    size_t write(const void *, size_t) override { return 0; }
+    size_t read(void *buffer, size_t len) override {
+        size_t n = state ? 1 + nextRandom(*state) % 97 : len;
+        if (n > len) n = len;
+        if (n > text.size() - pos) n = text.size() - pos;
+        if (n > 0) memcpy(buffer, text.data() + pos, n);
+        pos += n;
+        return n;
+    }
+    void flush() override {}
+};
+
+struct Base64Result {
+    const char *method;
+    size_t bytes;
+    double writes;          // Per blob, encoders only
+    double mbytes_per_sec;  // Of binary data
+    bool ok;
+};
+
+template <typename ENCODER>
+static Base64Result encodeRate(const char *method, const std::vector<uint8_t> &blob, int reps,
+                               std::vector<char> *text) {
+    SinkStream sink;
+    double t0 = nowSec();
+    for (int r = 0; r < reps; r++) {
+        sink.reset();
+        ENCODER b64(sink);
+        b64.write(blob.data(), blob.size());
+        b64.finish();
+    }
+    double sec = nowSec() - t0;
+    *text = sink.data;
+    return { method, blob.size(), (double)sink.writes, blob.size() * reps / sec / 1e6, true };
+}
+
+// Decodes with random read sizes from a source that returns random pieces;
+// state null reads everything in large calls for the timing
+static bool decodeAll(const std::vector<char> &text, uint64_t *state, std::vector<uint8_t> *out) {
+    ChunkedSource source(text, state);
+    Base64Stream b64(source);
+    out->clear();
+    uint8_t buf[4096];
+    for (;;) {
+        size_t want = state ? 1 + nextRandom(*state) % 100 : sizeof(buf);
+        size_t n = b64.read(buf, want);
+        if (n == 0) break;
+        out->insert(out->end(), buf, buf + n);
+    }
+    return !b64.failed();
+}
+
+static std::vector<char> withLineBreaks(const std::vector<char> &text) {
+    std::vector<char> wrapped;
+    for (size_t i = 0; i < text.size(); i++) {
+        if (i && i % 76 == 0) wrapped.insert(wrapped.end(), { '\r', '\n' });
+        wrapped.push_back(text[i]);
+    }
+    return wrapped;
+}
+
+static std::vector<Base64Result> base64(bool quick, const std::vector<uint8_t> &blob) {
+    std::vector<Base64Result> results;
+    int reps = quick ? 2000 : 20000;
+
+    std::vector<char> expected, text;
+    results.push_back(encodeRate<BytewiseBase64Stream>("encode bytewise", blob, reps, &expected));
+    results.push_back(encodeRate<Base64Stream>("encode blocks", blob, reps, &text));
+    results.back().ok = text == expected;
+
+    std::vector<uint8_t> decoded;
+    double t0 = nowSec();
+    bool ok = true;
+    for (int r = 0; r < reps; r++) ok = decodeAll(text, nullptr, &decoded) && ok;
+    results.push_back({ "decode", blob.size(), 0, blob.size() * reps / (nowSec() - t0) / 1e6, ok && decoded == blob });
+    return results;
+}
+
+struct Base64Check {
+    size_t lengths;         // Prefixes of the blob, each padded, unpadded and wrapped
+    size_t malformed;       // Inputs the decoder has to reject
+    size_t failures;
+};
+
+// Every length and tail, padded, unpadded and wrapped, in random pieces
+static Base64Check base64RoundTrip(const std::vector<uint8_t> &blob, uint64_t &state) {
+    Base64Check r = { 300, 0, 0 };
+    std::vector<uint8_t> decoded;
+    for (size_t len = 0; len < r.lengths; len++) {
+        std::vector<uint8_t> part(blob.begin(), blob.begin() + len);
+        SinkStream sink;
+        {
+            Base64Stream b64(sink);
+            // In odd pieces, so groups straddle write() calls
+            for (size_t pos = 0; pos < len;) {
+                size_t n = std::min<size_t>(1 + nextRandom(state) % 7, len - pos);
+                b64.write(part.data() + pos, n);
+                pos += n;
+            }
+            b64.finish();
+        }
+        std::vector<char> unpadded = sink.data;
+        while (!unpadded.empty() && unpadded.back() == '=') unpadded.pop_back();
+        bool ok = true;
+        for (const std::vector<char> &t : { sink.data, unpadded, withLineBreaks(sink.data) }) {
+            ok = ok && decodeAll(t, &state, &decoded) && decoded == part;
+        }
+        if (!ok && r.failures++ < 5) printf("  base64 round trip of %zu bytes failed\n", len);
+    }
+    // Malformed input has to be reported, not skipped
+    for (const char *bad : { "QUJD*RUY=", "QUJDR", "QU=JD", "QUJD====QUJD" }) {
+        std::vector<char> t(bad, bad + strlen(bad));
+        r.malformed++;
+        if (decodeAll(t, &state, &decoded) && r.failures++ < 5) printf("  base64 accepted %s\n", bad);
+    }
+    return r;
+}
+
+/* ==== Parsing ==== */
+// Heap use of the C++ allocations in a scope, to compare the parsers
+static struct {
+    bool on;
+    size_t count;
+    size_t live;
+    size_t peak;
+} heap;
+
+void *operator new(size_t size) {
+    // The size goes in front so delete can account for it
+    size_t *p = static_cast<size_t *>(malloc(size + 16));
+    if (!p) throw std::bad_alloc();
+    *p = size;
+    if (heap.on) {
+        heap.count++;
+        heap.live += size;
+        heap.peak = std::max(heap.peak, heap.live);
+    }
+    return reinterpret_cast<char *>(p) + 16;
+}
+
+void operator delete(void *ptr) noexcept {
+    if (!ptr) return;
+    size_t *p = reinterpret_cast<size_t *>(static_cast<char *>(ptr) - 16);
+    if (heap.on) heap.live -= std::min(*p, heap.live);
+    free(p);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+
+// The usual alternative: read the whole text, build a tree, look values up
+struct DomValue {
+    enum Type { Null, Bool, Number, String, Array, Object } type = Null;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<DomValue> items;
+    std::vector<std::pair<std::string, DomValue>> members;
+
+    const DomValue *find(const char *key) const {
+        for (const auto &m : members) {
+            if (m.first == key) return &m.second;
+        }
+        return nullptr;
+    }
+};
+
+class DomParser {
+    const char *p;
+    const char *end;
+
+    void space() {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) p++;
+    }
+
+    bool string(std::string &out) {
+        if (p == end || *p++ != '"') return false;
+        while (p < end && *p != '"') {
+            char c = *p++;
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (p == end) return false;
+            c = *p++;
+            if (c == 'u') {
+                if (end - p < 4) return false;
+                unsigned cp = strtoul(std::string(p, 4).c_str(), nullptr, 16);
+                p += 4;
+                if (cp < 0x80) {
+                    out += (char)cp;
+                } else if (cp < 0x800) {
+                    out += (char)(0xC0 | cp >> 6);
+                    out += (char)(0x80 | (cp & 0x3F));
+                } else {
+                    out += (char)(0xE0 | cp >> 12);
+                    out += (char)(0x80 | (cp >> 6 & 0x3F));
+                    out += (char)(0x80 | (cp & 0x3F));
+                }
+                continue;
+            }
+            const char *from = "\"\\/bfnrt", *to = "\"\\/\b\f\n\r\t";
+            const char *hit = strchr(from, c);
+            if (!hit) return false;
+            out += to[hit - from];
+        }
+        return p++ < end;
+    }
+
+public:
+    bool parse(const char *text, size_t len, DomValue &v) {
+        p = text;
+        end = text + len;
+        bool ok = value(v);
+        space();
+        return ok && p == end;
+    }
+
+    bool value(DomValue &v) {
+        space();
+        if (p == end) return false;
+        if (*p == '{') {
+            v.type = DomValue::Object;
+            p++;
+            space();
+            if (p < end && *p == '}') return p++, true;
+            for (;;) {
+                v.members.emplace_back();
+                space();
+                if (!string(v.members.back().first)) return false;
+                space();
+                if (p == end || *p++ != ':' || !value(v.members.back().second)) return false;
+                space();
+                if (p < end && *p == ',') p++;
+                else return p < end && *p++ == '}';
+            }
+        }
+        if (*p == '[') {
+            v.type = DomValue::Array;
+            p++;
+            space();
+            if (p < end && *p == ']') return p++, true;
+            for (;;) {
+                v.items.emplace_back();
+                if (!value(v.items.back())) return false;
+                space();
+                if (p < end && *p == ',') p++;
+                else return p < end && *p++ == ']';
+            }
+        }
+        if (*p == '"') {
+            v.type = DomValue::String;
+            return string(v.string);
+        }
+        for (const char *lit : { "true", "false", "null" }) {
+            size_t n = strlen(lit);
+            if ((size_t)(end - p) >= n && !memcmp(p, lit, n)) {
+                v.type = *lit == 'n' ? DomValue::Null : DomValue::Bool;
+                v.boolean = *lit == 't';
+                p += n;
+                return true;
+            }
+        }
+        char *after;
+        v.type = DomValue::Number;
+        v.number = strtod(p, &after);
+        if (after == p) return false;
+        p = after;
+        return true;
+    }
+};
+
+struct ParseResult {
+    const char *method;
+    size_t doc_bytes;
+    double mbytes_per_sec;
+    size_t allocations;     // Per parse
+    size_t heap_peak;
+    size_t state_bytes;     // Parser object and buffers
+    bool ok;                // Every record read back as written
+};
+
+static bool sameRecords(const std::vector<FileRecord> &a, const std::vector<FileRecord> &b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (strcmp(a[i].name, b[i].name) || a[i].size != b[i].size || a[i].mtime != b[i].mtime ||
+            a[i].ratio != b[i].ratio || a[i].dir != b[i].dir || memcmp(a[i].digest, b[i].digest, sizeof(a[i].digest))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Straight into the records, pulling from the stream
+static bool readerParse(const std::vector<char> &text, std::vector<FileRecord> &records) {
+    ChunkedSource source(text, nullptr);
+    JsonReader reader(source);
+    size_t count = 0;
+    bool ok = reader.readObject([&](JsonReader &r, const char *key) {
+        if (strcmp(key, "entries")) return;
+        r.readArray([&](JsonReader &r, size_t i) {
+            if (i >= records.size()) return;
+            FileRecord &rec = records[i];
+            count = i + 1;
+            r.readObject([&](JsonReader &r, const char *key) {
+                size_t len;
+                if (!strcmp(key, "name")) r.read(rec.name, sizeof(rec.name));
+                else if (!strcmp(key, "size")) r.read(rec.size);
+                else if (!strcmp(key, "mtime")) r.read(rec.mtime);
+                else if (!strcmp(key, "ratio")) r.read(rec.ratio);
+                else if (!strcmp(key, "dir")) r.read(rec.dir);
+                else if (!strcmp(key, "digest")) r.readData(rec.digest, sizeof(rec.digest), &len);
+            });
+        });
+    });
+    return ok && reader.next() == JsonToken::End && count == records.size();
+}
+
+// Whole text in memory, then a tree, then the records
+static bool domParse(const std::vector<char> &text, std::vector<FileRecord> &records) {
+    std::string copy(text.begin(), text.end());
+    DomValue root;
+    if (!DomParser().parse(copy.data(), copy.size(), root)) return false;
+    const DomValue *entries = root.find("entries");
+    if (!entries || entries->items.size() != records.size()) return false;
+    for (size_t i = 0; i < records.size(); i++) {
+        const DomValue &o = entries->items[i];
+        FileRecord &rec = records[i];
+        const DomValue *v;
+        if ((v = o.find("name"))) snprintf(rec.name, sizeof(rec.name), "%s", v->string.c_str());
+        if ((v = o.find("size"))) rec.size = (uint64_t)v->number;
+        if ((v = o.find("mtime"))) rec.mtime = (int64_t)v->number;
+        if ((v = o.find("ratio"))) rec.ratio = v->number;
+        if ((v = o.find("dir"))) rec.dir = v->boolean;
+        if ((v = o.find("digest"))) {
+            std::vector<char> b64(v->string.begin(), v->string.end());
+            ChunkedSource source(b64, nullptr);
+            Base64Stream decoder(source);
+            decoder.read(rec.digest, sizeof(rec.digest));
+        }
+    }
+    return true;
+}
+
+template <typename FUNC>
+static ParseResult parseRate(const char *method, size_t state_bytes, const std::vector<char> &text,
+                             const std::vector<FileRecord> &expected, int reps, FUNC parse) {
+    ParseResult r = { method, text.size(), 0, 0, 0, state_bytes, true };
+    std::vector<FileRecord> records(expected.size());
+    double t0 = nowSec();
+    for (int i = 0; i < reps; i++) {
+        bool first = i == 0;
+        heap = {};
+        heap.on = first;
+        if (first) memset(records.data(), 0, records.size() * sizeof(FileRecord));
+        r.ok = parse(text, records) && r.ok;
+        heap.on = false;
+        if (first) {
+            r.allocations = heap.count;
+            r.heap_peak = heap.peak;
+            r.ok = r.ok && sameRecords(records, expected);
+        }
+    }
+    r.mbytes_per_sec = text.size() * (double)reps / (nowSec() - t0) / 1e6;
+    return r;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--out FILE] [--quick]\n"
+            "  --out FILE  JSON results (default json_bench.json)\n"
+            "  --quick     fewer repetitions\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    const char *out_path = "json_bench.json";
+    bool quick = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (!strcmp(argv[i], "--quick")) {
+            quick = true;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    // About 10 KB of JSON
+    std::vector<FileRecord> records = makeRecords(90);
+    SinkStream reference_sink;
+    writeDocument(reference_sink, records);
+    std::vector<char> reference = reference_sink.data;
+    printf("Document: %zu bytes, %zu writes unbuffered\n", reference.size(), reference_sink.writes);
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd < 0) {
+        perror("/dev/null");
+        return 1;
+    }
+    std::vector<BufferResult> buffering;
+    int reps = quick ? 200 : 2000;
+    for (int fd : { -1, null_fd }) {
+        const char *sink = fd < 0 ? "memory" : "fd";
+        double base = 0;
+        for (size_t buffer : { (size_t)0, (size_t)64, (size_t)256, (size_t)1024, (size_t)4096 }) {
+            // A system call per write is slow enough to need fewer repetitions
+            buffering.push_back(serialize(sink, fd, buffer, fd < 0 ? reps : reps / 10, records, reference));
+            BufferResult &b = buffering.back();
+            if (buffer == 0) base = b.mbytes_per_sec;
+            b.speedup = b.mbytes_per_sec / base;
+            printf("%-6s buffer %5zu B  %8.1f writes/doc  %8.2f MB/s  x%5.2f%s\n", b.sink, b.buffer,
+                   b.writes_per_doc, b.mbytes_per_sec, b.speedup, b.ok ? "" : "  FAILED");
+        }
+    }
+    close(null_fd);
+    bool short_ok = shortWrites(records, reference);
+    printf("short downstream writes  %s\n", short_ok ? "kept or reported" : "FAILED");
+
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    size_t count = quick ? 20000 : 200000;
+    std::vector<double> doubles = randomReals<double>(count, state);
+    std::vector<float> floats = randomReals<float>(count, state);
+    std::vector<int64_t> ints(count);
+    for (size_t i = 0; i < count; i++) {
+        // All magnitudes, not just 19-digit ones
+        int64_t v = (int64_t)nextRandom(state);
+        ints[i] = v >> (nextRandom(state) % 64);
+    }
+
+    std::vector<RoundTripResult> round_trips = { roundTrip("double", doubles), roundTrip("float", floats) };
+    RoundTripResult int_trip = { "int64", ints.size(), 0, ints.size() };
+    for (int64_t v : ints) {
+        char buf[JsonNumber::MaxLength + 1];
+        buf[JsonNumber::formatInt(v, buf)] = 0;
+        int_trip.failures += strtoll(buf, nullptr, 10) != v;
+    }
+    round_trips.push_back(int_trip);
+    for (const RoundTripResult &r : round_trips) {
+        printf("round trip %-6s %7zu values  %zu failures  %.3f%% shortest\n", r.kind, r.values, r.failures,
+               100.0 * r.shortest / r.values);
+    }
+
+    int number_reps = quick ? 2 : 5;
+    std::vector<NumberResult> numbers = {
+        formatRate("int64", "snprintf %lld", ints, number_reps,
+                   [](int64_t v, char *buf) { return (size_t)snprintf(buf, 64, "%lld", (long long)v); }),
+        formatRate("int64", "JsonNumber", ints, number_reps,
+                   [](int64_t v, char *buf) { return JsonNumber::formatInt(v, buf); }),
+        formatRate("double", "snprintf %g", doubles, number_reps,
+                   [](double v, char *buf) { return (size_t)snprintf(buf, 64, "%g", v); }),
+        formatRate("double", "snprintf %.17g", doubles, number_reps,
+                   [](double v, char *buf) { return (size_t)snprintf(buf, 64, "%.17g", v); }),
+        formatRate("double", "JsonNumber", doubles, number_reps,
+                   [](double v, char *buf) { return JsonNumber::formatDouble(v, buf); }),
+        formatRate("float", "snprintf %.9g", floats, number_reps,
+                   [](float v, char *buf) { return (size_t)snprintf(buf, 64, "%.9g", (double)v); }),
+        formatRate("float", "JsonNumber", floats, number_reps,
+                   [](float v, char *buf) { return JsonNumber::formatFloat(v, buf); }),
+    };
+    std::vector<EscapeResult> escapes;
+    for (const char *kind : { "paths", "text", "worst" }) {
+        std::vector<std::string> strings = escapeInput(kind, 1000, state);
+        std::vector<char> expected, got;
+        escapes.push_back(escapeRate<BytewiseEscapedStream>(kind, "bytewise", strings, quick ? 20 : 200, &expected));
+        escapes.push_back(escapeRate<JsonEscapedStream>(kind, "JsonEscapedStream", strings, quick ? 20 : 200, &got));
+        escapes.back().ok = got == expected;
+    }
+    for (const EscapeResult &e : escapes) {
+        printf("escape %-5s %-17s %7.1f writes/string  %8.1f MB/s%s\n", e.input, e.method, e.writes_per_string,
+               e.mbytes_per_sec, e.ok ? "" : "  FAILED");
+    }
+
+    std::vector<uint8_t> blob(4096);
+    for (uint8_t &b : blob) b = (uint8_t)nextRandom(state);
+    Base64Check base64_trip = base64RoundTrip(blob, state);
+    printf("round trip base64 %7zu lengths  %zu failures  %zu malformed inputs\n", base64_trip.lengths,
+           base64_trip.failures, base64_trip.malformed);
+    std::vector<Base64Result> base64_results = base64(quick, blob);
+    for (const Base64Result &b : base64_results) {
+        printf("base64 %-15s %5zu B  %6.0f writes  %8.1f MB/s%s\n", b.method, b.bytes, b.writes, b.mbytes_per_sec,
+               b.ok ? "" : "  FAILED");
+    }
+
+    int parse_reps = quick ? 200 : 2000;
+    std::vector<ParseResult> parsing = {
+        parseRate("JsonReader", sizeof(JsonReader), reference, records, parse_reps, readerParse),
+        parseRate("DOM", sizeof(DomParser), reference, records, parse_reps, domParse),
+    };
+    for (const ParseResult &p : parsing) {
+        printf("parse  %-10s %6zu B  %8.1f MB/s  %5zu allocations  heap peak %6zu B  state %4zu B%s\n", p.method,
+               p.doc_bytes, p.mbytes_per_sec, p.allocations, p.heap_peak, p.state_bytes, p.ok ? "" : "  FAILED");
+    }
+
+    for (const NumberResult &n : numbers) printf("%-6s %-15s %8.2f M numbers/s\n", n.kind, n.method, n.mnumbers_per_sec);
+
+    FILE *file = fopen(out_path, "w");
+    if (!file) {
+        perror(out_path);
+        return 1;
+    }
+    FileStream stream(file);
+    {
+        FixedBufferedStream<512> buffered(stream);
+        JsonObjectWriter::create(buffered, [&](JsonObjectWriter &root) {
+            root.withObject("config", [&](JsonObjectWriter &o) {
+                o.field("quick", quick);
+                o.field("doc_bytes", (uint64_t)reference.size());
+            });
+            root.withArray("buffering", [&](JsonArrayWriter &a) {
+                for (const BufferResult &b : buffering) {
+                    a.withObject([&](JsonObjectWriter &o) {
+                        o.field("sink", b.sink);
+                        o.field("buffer", (uint64_t)b.buffer);
+                        o.field("ok", b.ok);
+                        o.field("writes_per_doc", b.writes_per_doc);
+                        o.field("mbytes_per_sec", b.mbytes_per_sec);
+                        o.field("speedup", b.speedup);
+                    });
+                }
+            });
+            root.field("short_writes_ok", short_ok);
+            root.withArray("round_trip", [&](JsonArrayWriter &a) {
+                for (const RoundTripResult &r : round_trips) {
+                    a.withObject([&](JsonObjectWriter &o) {
+                        o.field("kind", r.kind);
+                        o.field("values", (uint64_t)r.values);
+                        o.field("failures", (uint64_t)r.failures);
+                        o.field("shortest", (uint64_t)r.shortest);
+                    });
+                }
+            });
+            root.withArray("escape", [&](JsonArrayWriter &a) {
+                for (const EscapeResult &e : escapes) {
+                    a.withObject([&](JsonObjectWriter &o) {
+                        o.field("input", e.input);
+                        o.field("method", e.method);
+                        o.field("ok", e.ok);
+                        o.field("writes_per_string", e.writes_per_string);
+                        o.field("mbytes_per_sec", e.mbytes_per_sec);
+                    });
+                }
+            });
+            root.withObject("base64_round_trip", [&](JsonObjectWriter &o) {
+                o.field("lengths", (uint64_t)base64_trip.lengths);
+                o.field("malformed", (uint64_t)base64_trip.malformed);
+                o.field("failures", (uint64_t)base64_trip.failures);
+            });
+            root.withArray("base64", [&](JsonArrayWriter &a) {
+                for (const Base64Result &b : base64_results) {
+                    a.withObject([&](JsonObjectWriter &o) {
+                        o.field("method", b.method);
+                        o.field("bytes", (uint64_t)b.bytes);
+                        o.field("ok", b.ok);
+                        o.field("writes", b.writes);
+                        o.field("mbytes_per_sec", b.mbytes_per_sec);
+                    });
+                }
+            });
+            root.withArray("parse", [&](JsonArrayWriter &a) {
+                for (const ParseResult &p : parsing) {
+                    a.withObject([&](JsonObjectWriter &o) {
+                        o.field("method", p.method);
+                        o.field("doc_bytes", (uint64_t)p.doc_bytes);
+                        o.field("ok", p.ok);
+                        o.field("mbytes_per_sec", p.mbytes_per_sec);
+                        o.field("allocations", (uint64_t)p.allocations);
+                        o.field("heap_peak", (uint64_t)p.heap_peak);
+                        o.field("state_bytes", (uint64_t)p.state_bytes);
+                    });
+                }
+            });
+            root.withArray("numbers", [&](JsonArrayWriter &a) {
+                for (const NumberResult &n : numbers) {
+                    a.withObject([&](JsonObjectWriter &o) {
+                        o.field("kind", n.kind);
+                        o.field("method", n.method);
+                        o.field("mnumbers_per_sec", n.mnumbers_per_sec);
+                    });
+                }
+            });
+        });
+        buffered.write("\n", 1);
+    }
+    fclose(file);
+    printf("Results written to %s\n", out_path);
+
+    bool ok = true;
+    for (const BufferResult &b : buffering) ok = ok && b.ok;
+    ok = ok && short_ok;
+    for (const RoundTripResult &r : round_trips) ok = ok && r.failures == 0;
+    for (const EscapeResult &e : escapes) ok = ok && e.ok;
+    ok = ok && base64_trip.failures == 0;
+    for (const Base64Result &b : base64_results) ok = ok && b.ok;
+    for (const ParseResult &p : parsing) ok = ok && p.ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+// Equal-sized blocks carved out of one allocation made up front. allocate()
+// and release() are O(1) through an intrusive free list, so a long-running
+// server never fragments the heap with its per-session objects.
+class FixedBlockPool {
+public:
+    FixedBlockPool() = default;
+    ~FixedBlockPool() { destroy(); }
+
+    FixedBlockPool(const FixedBlockPool&) = delete;
+    FixedBlockPool& operator=(const FixedBlockPool&) = delete;
+
+    bool create(size_t blockSize, size_t blockCount) {
+        destroy();
+        // Every block must be able to hold the free list link and keep any type aligned
+        const size_t align = alignof(std::max_align_t);
+        if (blockSize < sizeof(FreeBlock)) blockSize = sizeof(FreeBlock);
+        blockSize = (blockSize + align - 1) / align * align;
+
+        arena = static_cast<uint8_t*>(malloc(blockSize * blockCount));
+        if (!arena && blockCount > 0) return false;
+
+        block_size = blockSize;
+        count = blockCount;
+        for (size_t i = count; i-- > 0;) {
+            FreeBlock* block = reinterpret_cast<FreeBlock*>(arena + i * block_size);
+            block->next = free_list;
+            free_list = block;
+        }
+        return true;
+    }
+
+    void destroy() {
+        assert(in_use == 0 && "FixedBlockPool destroyed with blocks in use");
+        free(arena);
+        arena = nullptr;
+        free_list = nullptr;
+        block_size = count = in_use = peak_use = 0;
+    }
+
+    // nullptr once every block is handed out
+    void* allocate() {
+        FreeBlock* block = free_list;
+        if (!block) return nullptr;
+        free_list = block->next;
+        if (++in_use > peak_use) peak_use = in_use;
+        return block;
+    }
+
+    void release(void* ptr) {
+        if (!ptr) return;
+        assert(contains(ptr) && "Block does not belong to this pool");
+        FreeBlock* block = static_cast<FreeBlock*>(ptr);
+        block->next = free_list;
+        free_list = block;
+        in_use--;
+    }
+
+    bool contains(const void* ptr) const {
+        const uint8_t* p = static_cast<const uint8_t*>(ptr);
+        return arena && p >= arena && p < arena + block_size * count &&
+               (size_t)(p - arena) % block_size == 0;
+    }
+
+    size_t blockSize() const { return block_size; }
+    size_t capacity() const { return count; }
+    size_t used() const { return in_use; }
+    size_t peak() const { return peak_use; }
+    size_t bytes() const { return block_size * count; }
+
+private:
+    struct FreeBlock { FreeBlock* next; };
+
+    uint8_t* arena = nullptr;
+    FreeBlock* free_list = nullptr;
+    size_t block_size = 0;
+    size_t count = 0;
+    size_t in_use = 0;
+    size_t peak_use = 0;
+};
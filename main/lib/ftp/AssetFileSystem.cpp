@@ -0,0 +1,217 @@
+#include "AssetFileSystem.h"
+#include <errno.h>
+#include <string.h>
+
+AssetFileSystem::File *AssetFileSystem::file(int fd) {
+    if (fd < 0 || fd >= FTP_ASSET_FILES || !files[fd].used) {
+        errno = EBADF;
+        return nullptr;
+    }
+    return &files[fd];
+}
+
+bool AssetFileSystem::isDir(const char *path) const {
+    if (strcmp(path, "/") == 0) return true;
+
+    // A directory exists as long as some file lies below it
+    char key[FTP_PATH_MAX + 1];
+    size_t len = strlen(path);
+    if (len + 2 > sizeof(key)) return false;
+    memcpy(key, path, len);
+    key[len++] = '/';
+    key[len] = 0;
+    size_t i = image.lowerBound(key);
+    return i < image.count() && strncmp(image.path(i), key, len) == 0;
+}
+
+void AssetFileSystem::fileStat(size_t index, struct stat *st) const {
+    AssetImage::View v = image.view(index);
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_size = v.size;
+    st->st_mtime = v.mtime;
+}
+
+void AssetFileSystem::dirStat(struct stat *st) const {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFDIR | 0555;
+    st->st_nlink = 1;
+    st->st_mtime = image.buildTime();
+}
+
+int AssetFileSystem::open(const char *path, int flags) {
+    if ((flags & O_ACCMODE) != O_RDONLY) {
+        errno = EROFS;
+        return -1;
+    }
+    size_t i = image.lowerBound(path);
+    if (i == image.count() || strcmp(image.path(i), path) != 0) {
+        errno = isDir(path) ? EISDIR : ENOENT;
+        return -1;
+    }
+    for (int fd = 0; fd < FTP_ASSET_FILES; fd++) {
+        if (files[fd].used) continue;
+        files[fd] = { true, i, 0 };
+        return fd;
+    }
+    errno = EMFILE;
+    return -1;
+}
+
+int AssetFileSystem::close(int fd) {
+    File *f = file(fd);
+    if (!f) return -1;
+    *f = {};
+    return 0;
+}
+
+ssize_t AssetFileSystem::read(int fd, void *buf, size_t len) {
+    File *f = file(fd);
+    if (!f) return -1;
+    AssetImage::View v = image.view(f->index);
+    size_t n = f->pos < v.size ? v.size - f->pos : 0;
+    if (n > len) n = len;
+    memcpy(buf, v.data + f->pos, n);
+    f->pos += n;
+    return n;
+}
+
+ssize_t AssetFileSystem::write(int fd, const void *buf, size_t len) {
+    if (file(fd)) errno = EBADF;     // Never open for writing
+    return -1;
+}
+
+off_t AssetFileSystem::lseek(int fd, off_t offset, int whence) {
+    File *f = file(fd);
+    if (!f) return -1;
+    off_t base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? (off_t)f->pos : (off_t)image.view(f->index).size;
+    if (base + offset < 0 || (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END)) {
+        errno = EINVAL;
+        return -1;
+    }
+    f->pos = base + offset;
+    return f->pos;
+}
+
+int AssetFileSystem::ftruncate(int fd, off_t length) {
+    if (file(fd)) errno = EINVAL;
+    return -1;
+}
+
+int AssetFileSystem::fstat(int fd, struct stat *st) {
+    File *f = file(fd);
+    if (!f) return -1;
+    fileStat(f->index, st);
+    return 0;
+}
+
+int AssetFileSystem::stat(const char *path, struct stat *st) {
+    size_t i = image.lowerBound(path);
+    if (i < image.count() && strcmp(image.path(i), path) == 0) {
+        fileStat(i, st);
+        return 0;
+    }
+    if (isDir(path)) {
+        dirStat(st);
+        return 0;
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+int AssetFileSystem::unlink(const char *path) {
+    errno = EROFS;
+    return -1;
+}
+
+int AssetFileSystem::mkdir(const char *path) {
+    errno = EROFS;
+    return -1;
+}
+
+int AssetFileSystem::rmdir(const char *path) {
+    errno = EROFS;
+    return -1;
+}
+
+int AssetFileSystem::rename(const char *from, const char *to) {
+    errno = EROFS;
+    return -1;
+}
+
+int AssetFileSystem::opendir(const char *path) {
+    if (!isDir(path)) {
+        size_t i = image.lowerBound(path);
+        errno = i < image.count() && strcmp(image.path(i), path) == 0 ? ENOTDIR : ENOENT;
+        return -1;
+    }
+    for (int i = 0; i < FTP_ASSET_DIRS; i++) {
+        Dir &d = dirs[i];
+        if (d.used) continue;
+        d.used = true;
+        d.len = strlen(path);
+        memcpy(d.prefix, path, d.len);
+        if (d.len > 1) d.prefix[d.len++] = '/';
+        d.prefix[d.len] = 0;
+        d.next = image.lowerBound(d.prefix);
+        d.last_len = 0;
+        return i;
+    }
+    errno = EMFILE;
+    return -1;
+}
+
+int AssetFileSystem::readdir(int dir, DirEntry *entry) {
+    if (dir < 0 || dir >= FTP_ASSET_DIRS || !dirs[dir].used) {
+        errno = EBADF;
+        return -1;
+    }
+
+    // Everything below the directory is one run of the sorted image, and so
+    // is everything below each subdirectory: a subdirectory is reported when
+    // its run starts and skipped for the rest of it
+    Dir &d = dirs[dir];
+    while (d.next < image.count()) {
+        size_t i = d.next++;
+        const char *path = image.path(i);
+        if (strncmp(path, d.prefix, d.len) != 0) {
+            d.next = image.count();
+            break;
+        }
+        const char *name = path + d.len;
+        const char *slash = strchr(name, '/');
+        size_t len = slash ? (size_t)(slash - name) : strlen(name);
+        if (slash) {
+            if (len == d.last_len && strncmp(image.path(d.last) + d.len, name, len) == 0) continue;
+            d.last = i;
+            d.last_len = len;
+            dirStat(&entry->st);
+        } else {
+            fileStat(i, &entry->st);
+        }
+        memcpy(entry->name, name, len);
+        entry->name[len] = 0;
+        entry->is_dir = slash != nullptr;
+        entry->has_stat = true;
+        return 1;
+    }
+    return 0;
+}
+
+int AssetFileSystem::closedir(int dir) {
+    if (dir < 0 || dir >= FTP_ASSET_DIRS || !dirs[dir].used) {
+        errno = EBADF;
+        return -1;
+    }
+    dirs[dir] = {};
+    return 0;
+}
+
+const void *AssetFileSystem::map(int fd, size_t *size) {
+    File *f = file(fd);
+    if (!f) return nullptr;
+    AssetImage::View v = image.view(f->index);
+    *size = v.size;
+    return v.data;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "FileSystem.h"
+#include "AssetImage.h"
+
+#define FTP_ASSET_FILES 8       // Files open at once
+#define FTP_ASSET_DIRS 4        // Listings open at once
+
+// An AssetImage as a read-only filesystem for FtpServer::mount(). Directories
+// are the path prefixes of the packed files. RETR sends straight from the
+// mapped image, so serving an asset costs no flash reads through FatFs.
+class AssetFileSystem : public IFileSystem {
+public:
+    explicit AssetFileSystem(const AssetImage &image) : image(image) {}
+
+    int open(const char *path, int flags) override;
+    int close(int fd) override;
+    ssize_t read(int fd, void *buf, size_t len) override;
+    ssize_t write(int fd, const void *buf, size_t len) override;
+    off_t lseek(int fd, off_t offset, int whence) override;
+    int ftruncate(int fd, off_t length) override;
+    int fstat(int fd, struct stat *st) override;
+    int stat(const char *path, struct stat *st) override;
+    int unlink(const char *path) override;
+    int mkdir(const char *path) override;
+    int rmdir(const char *path) override;
+    int rename(const char *from, const char *to) override;
+    int opendir(const char *path) override;
+    int readdir(int dir, DirEntry *entry) override;
+    int closedir(int dir) override;
+    const void *map(int fd, size_t *size) override;
+
+private:
+    struct File {
+        bool used;
+        size_t index;
+        size_t pos;
+    };
+    struct Dir {
+        bool used;
+        char prefix[FTP_PATH_MAX + 1];  // "/dir/", or "/" for the root
+        size_t len;
+        size_t next;        // Image index to look at next
+        size_t last;        // Image index that produced the last subdirectory
+        size_t last_len;    // Its name length, 0 before the first one
+    };
+
+    const AssetImage &image;
+    File files[FTP_ASSET_FILES] = {};
+    Dir dirs[FTP_ASSET_DIRS] = {};
+
+    File *file(int fd);
+    bool isDir(const char *path) const;
+    void fileStat(size_t index, struct stat *st) const;
+    void dirStat(struct stat *st) const;
+};
@@ -0,0 +1,132 @@
+#include "AssetImage.h"
+#include <string.h>
+#include "esp_log.h"
+#if !defined(ESP_PLATFORM)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static const char *TAG_ASSETS = "assets";
+
+AssetImage::~AssetImage() {
+    unmap();
+}
+
+#if defined(ESP_PLATFORM)
+bool AssetImage::mapPartition(const char *label) {
+    unmap();
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (!part) {
+        ESP_LOGE(TAG_ASSETS, "No partition \"%s\"", label);
+        return false;
+    }
+
+    // The flash cache serves reads from here on, no esp_partition_read() per access
+    const void *ptr;
+    esp_err_t err = esp_partition_mmap(part, 0, part->size, ESP_PARTITION_MMAP_DATA, &ptr, &mmap_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG_ASSETS, "Failed to map partition \"%s\" (%s)", label, esp_err_to_name(err));
+        return false;
+    }
+    partition_mapped = true;
+    if (!attach(ptr, part->size)) {
+        unmap();
+        return false;
+    }
+    return true;
+}
+#else
+bool AssetImage::mapFile(const char *path) {
+    unmap();
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        ESP_LOGE(TAG_ASSETS, "Can't open asset image %s", path);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        ESP_LOGE(TAG_ASSETS, "Can't map asset image %s", path);
+        return false;
+    }
+    file_mapped = true;
+    if (!attach(ptr, st.st_size)) {
+        munmap(ptr, st.st_size);
+        file_mapped = false;
+        return false;
+    }
+    return true;
+}
+#endif
+
+bool AssetImage::attach(const void *image, size_t image_size) {
+    // Checked once here so that lookups can trust every offset
+    const uint8_t *p = static_cast<const uint8_t *>(image);
+    const Header *h = reinterpret_cast<const Header *>(p);
+    if (image_size < sizeof(Header) || memcmp(h->magic, "AIMG", 4) != 0 || h->version != 1 ||
+        h->size > image_size || sizeof(Header) + (size_t)h->count * sizeof(Entry) > h->size) {
+        ESP_LOGE(TAG_ASSETS, "Not a valid asset image");
+        return false;
+    }
+    const Entry *e = reinterpret_cast<const Entry *>(p + sizeof(Header));
+    const char *prev = nullptr;
+    for (size_t i = 0; i < h->count; i++) {
+        const char *name = reinterpret_cast<const char *>(p + e[i].path);
+        if (e[i].path >= h->size || name[0] != '/' || !memchr(name, 0, h->size - e[i].path) ||
+            e[i].data > h->size || e[i].size > h->size - e[i].data || (prev && strcmp(prev, name) >= 0)) {
+            ESP_LOGE(TAG_ASSETS, "Asset image entry %u is corrupt", (unsigned)i);
+            return false;
+        }
+        prev = name;
+    }
+
+    base = p;
+    size = h->size;
+    entries = h->count;
+    built = h->built;
+    ESP_LOGI(TAG_ASSETS, "%u files, %u bytes", (unsigned)entries, (unsigned)size);
+    return true;
+}
+
+void AssetImage::unmap() {
+#if defined(ESP_PLATFORM)
+    if (partition_mapped) esp_partition_munmap(mmap_handle);
+    partition_mapped = false;
+#else
+    if (file_mapped) munmap(const_cast<uint8_t *>(base), size);
+    file_mapped = false;
+#endif
+    base = nullptr;
+    size = 0;
+    entries = 0;
+}
+
+size_t AssetImage::lowerBound(const char *key) const {
+    size_t lo = 0, hi = entries;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (strcmp(path(mid), key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+bool AssetImage::find(const char *key, View *out) const {
+    size_t i = lowerBound(key);
+    if (i == entries || strcmp(path(i), key) != 0) return false;
+    *out = view(i);
+    return true;
+}
+
+const char *AssetImage::path(size_t i) const {
+    return reinterpret_cast<const char *>(base + entry(i).path);
+}
+
+AssetImage::View AssetImage::view(size_t i) const {
+    const Entry &e = entry(i);
+    return { base + e.data, e.size, (time_t)e.mtime };
+}
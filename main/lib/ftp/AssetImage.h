@@ -0,0 +1,77 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(ESP_PLATFORM)
+#include "esp_partition.h"
+#endif
+
+#define FTP_ASSET_PARTITION "assets"    // Partition label in partitions.csv
+
+// Read-only files packed by mkassets.py into one image, used in place: on the
+// target the image is a flash partition mapped into the address space, on the
+// host a file mapped with mmap(). Lookups return views into the image, nothing
+// is read or copied, and the views stay valid until unmap().
+class AssetImage {
+public:
+    struct View {
+        const uint8_t *data;
+        size_t size;
+        time_t mtime;
+    };
+
+    AssetImage() = default;
+    ~AssetImage();
+
+    AssetImage(const AssetImage&) = delete;
+    AssetImage& operator=(const AssetImage&) = delete;
+
+#if defined(ESP_PLATFORM)
+    bool mapPartition(const char *label = FTP_ASSET_PARTITION);
+#else
+    bool mapFile(const char *path);
+#endif
+    // An image that is already addressable, such as one linked into the firmware
+    bool attach(const void *base, size_t size);
+    void unmap();
+    bool isMapped() const { return base != nullptr; }
+
+    // path is "/dir/name", as packed
+    bool find(const char *path, View *out) const;
+    // Files in path order; i < count()
+    size_t count() const { return entries; }
+    const char *path(size_t i) const;
+    View view(size_t i) const;
+    // Index of the first file whose path sorts at or after key
+    size_t lowerBound(const char *key) const;
+    // Newest file in the image, for directories, which have no time of their own
+    time_t buildTime() const { return built; }
+
+private:
+    struct Header {
+        char magic[4];
+        uint16_t version;
+        uint16_t count;
+        uint32_t size;
+        uint32_t built;
+    };
+    struct Entry {
+        uint32_t path;
+        uint32_t data;
+        uint32_t size;
+        uint32_t mtime;
+    };
+
+    const uint8_t *base = nullptr;
+    size_t size = 0;
+    size_t entries = 0;
+    time_t built = 0;
+#if defined(ESP_PLATFORM)
+    esp_partition_mmap_handle_t mmap_handle = 0;
+    bool partition_mapped = false;
+#else
+    bool file_mapped = false;
+#endif
+
+    const Entry &entry(size_t i) const { return reinterpret_cast<const Entry *>(base + sizeof(Header))[i]; }
+};
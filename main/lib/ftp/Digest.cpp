@@ -0,0 +1,230 @@
+#include "Digest.h"
+#include <string.h>
+#include <strings.h>
+#if defined(ESP_PLATFORM)
+#include "esp_rom_crc.h"
+#endif
+
+static const char *const digestNames[Digest::ALGORITHM_COUNT] = { "CRC32", "MD5", "SHA-1", "SHA-256" };
+
+const char *Digest::name(Algorithm algo) {
+    return algo < ALGORITHM_COUNT ? digestNames[algo] : "";
+}
+
+bool Digest::parse(const char *name, Algorithm *algo) {
+    for (int i = 0; i < ALGORITHM_COUNT; i++) {
+        if (strcasecmp(name, digestNames[i]) == 0) {
+            *algo = (Algorithm)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Digest::available(Algorithm algo) {
+    // Without mbedtls only the portable implementations below exist
+    return algo == CRC32 || algo == SHA256 || (FTP_DIGEST_MBEDTLS && algo < ALGORITHM_COUNT);
+}
+
+static void toHex(const uint8_t *bytes, size_t len, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        hex[i * 2] = digits[bytes[i] >> 4];
+        hex[i * 2 + 1] = digits[bytes[i] & 0x0F];
+    }
+    hex[len * 2] = 0;
+}
+
+#if !defined(ESP_PLATFORM)
+// Reflected CRC-32 (zlib polynomial); the ROM provides the same on the target
+static constexpr struct CrcTable {
+    uint32_t v[256];
+    constexpr CrcTable() : v() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            v[i] = c;
+        }
+    }
+} crcTable;
+
+static uint32_t crc32Update(uint32_t crc, const uint8_t *p, size_t len) {
+    crc = ~crc;
+    while (len--) crc = crcTable.v[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+#else
+static uint32_t crc32Update(uint32_t crc, const uint8_t *p, size_t len) {
+    return esp_rom_crc32_le(crc, p, len);
+}
+#endif
+
+#if !FTP_DIGEST_MBEDTLS
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t ror(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+void Digest::sha256Block(Sha256State &s, const uint8_t *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = s.h[0], b = s.h[1], c = s.h[2], d = s.h[3];
+    uint32_t e = s.h[4], f = s.h[5], g = s.h[6], h = s.h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+        uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    s.h[0] += a; s.h[1] += b; s.h[2] += c; s.h[3] += d;
+    s.h[4] += e; s.h[5] += f; s.h[6] += g; s.h[7] += h;
+}
+#endif
+
+void Digest::begin(Algorithm algo) {
+    this->algo = algo;
+    switch (algo) {
+    case CRC32:
+        ctx.crc = 0;
+        break;
+#if FTP_DIGEST_MBEDTLS
+    case MD5:
+        mbedtls_md5_init(&ctx.md5);
+        mbedtls_md5_starts(&ctx.md5);
+        break;
+    case SHA1:
+        mbedtls_sha1_init(&ctx.sha1);
+        mbedtls_sha1_starts(&ctx.sha1);
+        break;
+    case SHA256:
+        mbedtls_sha256_init(&ctx.sha256);
+        mbedtls_sha256_starts(&ctx.sha256, 0);
+        break;
+#else
+    case SHA256: {
+        static const uint32_t init[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+        };
+        memcpy(ctx.sha256.h, init, sizeof(init));
+        ctx.sha256.total = 0;
+        ctx.sha256.used = 0;
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+}
+
+void Digest::update(const void *data, size_t len) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    switch (algo) {
+    case CRC32:
+        ctx.crc = crc32Update(ctx.crc, p, len);
+        break;
+#if FTP_DIGEST_MBEDTLS
+    case MD5:
+        mbedtls_md5_update(&ctx.md5, p, len);
+        break;
+    case SHA1:
+        mbedtls_sha1_update(&ctx.sha1, p, len);
+        break;
+    case SHA256:
+        mbedtls_sha256_update(&ctx.sha256, p, len);
+        break;
+#else
+    case SHA256: {
+        Sha256State &s = ctx.sha256;
+        s.total += len;
+        if (s.used) {
+            size_t take = 64 - s.used < len ? 64 - s.used : len;
+            memcpy(s.block + s.used, p, take);
+            s.used += take;
+            p += take;
+            len -= take;
+            if (s.used < 64) return;
+            sha256Block(s, s.block);
+            s.used = 0;
+        }
+        // Whole blocks straight from the caller's buffer, no copy
+        for (; len >= 64; p += 64, len -= 64) sha256Block(s, p);
+        memcpy(s.block, p, len);
+        s.used = len;
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+}
+
+int Digest::finish(char *hex) {
+    uint8_t out[32];
+    size_t len = 0;
+    switch (algo) {
+    case CRC32:
+        out[0] = ctx.crc >> 24;
+        out[1] = ctx.crc >> 16;
+        out[2] = ctx.crc >> 8;
+        out[3] = ctx.crc;
+        len = 4;
+        break;
+#if FTP_DIGEST_MBEDTLS
+    case MD5:
+        mbedtls_md5_finish(&ctx.md5, out);
+        mbedtls_md5_free(&ctx.md5);
+        len = 16;
+        break;
+    case SHA1:
+        mbedtls_sha1_finish(&ctx.sha1, out);
+        mbedtls_sha1_free(&ctx.sha1);
+        len = 20;
+        break;
+    case SHA256:
+        mbedtls_sha256_finish(&ctx.sha256, out);
+        mbedtls_sha256_free(&ctx.sha256);
+        len = 32;
+        break;
+#else
+    case SHA256: {
+        Sha256State &s = ctx.sha256;
+        uint64_t bits = s.total * 8;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (s.used != 56) update(&pad, 1);
+        uint8_t length[8];
+        for (int i = 0; i < 8; i++) length[i] = bits >> (56 - 8 * i);
+        update(length, 8);
+        for (int i = 0; i < 8; i++) {
+            out[i * 4] = s.h[i] >> 24;
+            out[i * 4 + 1] = s.h[i] >> 16;
+            out[i * 4 + 2] = s.h[i] >> 8;
+            out[i * 4 + 3] = s.h[i];
+        }
+        len = 32;
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+    toHex(out, len, hex);
+    return (int)len * 2;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(ESP_PLATFORM)
+#include "mbedtls/md5.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/sha256.h"
+#define FTP_DIGEST_MBEDTLS 1    // SHA runs on the hardware accelerator through mbedtls
+#else
+#define FTP_DIGEST_MBEDTLS 0
+#endif
+
+#define FTP_DIGEST_HEX_MAX 65   // SHA-256 in hex plus terminator
+
+// Incremental file digest for HASH/XCRC/XSHA*. One algorithm per begin().
+class Digest {
+public:
+    enum Algorithm : uint8_t { CRC32, MD5, SHA1, SHA256, ALGORITHM_COUNT };
+
+    static const char *name(Algorithm algo);
+    static bool parse(const char *name, Algorithm *algo);
+    static bool available(Algorithm algo);
+
+    void begin(Algorithm algo);
+    void update(const void *data, size_t len);
+    // Writes the digest as lower case hex, returns its length
+    int finish(char *hex);
+    Algorithm algorithm() const { return algo; }
+
+private:
+    struct Sha256State {
+        uint32_t h[8];
+        uint64_t total;
+        uint8_t block[64];
+        size_t used;
+    };
+
+    Algorithm algo = SHA256;
+    union {
+        uint32_t crc;
+#if FTP_DIGEST_MBEDTLS
+        mbedtls_md5_context md5;
+        mbedtls_sha1_context sha1;
+        mbedtls_sha256_context sha256;
+#else
+        Sha256State sha256;
+#endif
+    } ctx;
+
+#if !FTP_DIGEST_MBEDTLS
+    static void sha256Block(Sha256State &s, const uint8_t *block);
+#endif
+};
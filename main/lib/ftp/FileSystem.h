@@ -0,0 +1,52 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define FTP_PATH_MAX 256    // Normalized path as clients see it, terminator included
+
+// Storage FtpServer serves files from. Paths are absolute in the filesystem's
+// own namespace and already normalized by the server: "/" or "/logs/a.txt",
+// never ".", "..", "//" or a trailing '/'. Open files and directories are
+// small integer handles private to the filesystem; failures return -1 with
+// errno set, like their POSIX namesakes.
+class IFileSystem {
+public:
+    struct DirEntry {
+        char name[256];
+        bool is_dir;
+        bool has_stat;      // st is valid; otherwise directories need nothing more and files a stat()
+        struct stat st;
+    };
+
+    virtual ~IFileSystem() = default;
+
+    // O_RDONLY, or O_WRONLY with O_CREAT, O_TRUNC and O_APPEND as needed
+    virtual int open(const char *path, int flags) = 0;
+    virtual int close(int fd) = 0;
+    virtual ssize_t read(int fd, void *buf, size_t len) = 0;
+    virtual ssize_t write(int fd, const void *buf, size_t len) = 0;
+    virtual off_t lseek(int fd, off_t offset, int whence) = 0;
+    virtual int ftruncate(int fd, off_t length) = 0;
+    virtual int fstat(int fd, struct stat *st) = 0;
+
+    virtual int stat(const char *path, struct stat *st) = 0;
+    virtual int unlink(const char *path) = 0;
+    virtual int mkdir(const char *path) = 0;
+    virtual int rmdir(const char *path) = 0;
+    // Replaces an existing file at to; EXDEV never happens, both are in this filesystem
+    virtual int rename(const char *from, const char *to) = 0;
+
+    virtual int opendir(const char *path) = 0;
+    // 1 with the next entry, 0 at the end
+    virtual int readdir(int dir, DirEntry *entry) = 0;
+    virtual int closedir(int dir) = 0;
+
+    // A read-only file's whole content when it already sits in addressable
+    // memory, for zero-copy RETR; stays valid until close(). Else nullptr.
+    virtual const void *map(int fd, size_t *size) { return nullptr; }
+    // Kernel descriptor behind fd for sendfile(), or -1
+    virtual int nativeFd(int fd) { return -1; }
+};
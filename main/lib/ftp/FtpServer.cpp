@@ -5,21 +5,69 @@
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <arpa/inet.h>
+#include <time.h>
+#include <new>
 #include "esp_netif.h"
 #include "esp_log.h"
+#if defined(ESP_PLATFORM)
+#include "esp_vfs_eventfd.h"
+#else
+#include <sys/eventfd.h>
+#endif
+#include "BufferedStream.h"
+#include "ContextLock.h"
 
 static const char *TAG_FTP = "ftp_server";
 
-/* ==== Data connection helpers ==== */
-int FtpServer::openDataConnection(Client &c) {
-    if (c.pasv_listen_sock <= 0) return -1;
+static long long monotonicUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long long monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Stream onto a connected socket. write() keeps sending until the socket has
+// taken everything or fails, and returns how much it took.
+class SocketSink : public Stream {
+    int sock;
+
+public:
+    explicit SocketSink(int sock) : sock(sock) {}
+
+    size_t write(const void *data, size_t len) override {
+        const char *p = static_cast<const char *>(data);
+        size_t sent = 0;
+        while (sent < len) {
+            ssize_t n = send(sock, p + sent, len - sent, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            sent += n;
+        }
+        return sent;
+    }
+
+    size_t read(void *buffer, size_t len) override {
+        ssize_t n = recv(sock, buffer, len, 0);
+        return n > 0 ? (size_t)n : 0;
+    }
+
+    void flush() override {}
+};
 
+/* ==== Data connection helpers ==== */
+int FtpServer::acceptDataConnection(Client &c) {
     struct sockaddr_in6 source_addr;
     socklen_t addr_len = sizeof(source_addr);
 
@@ -29,22 +77,911 @@ int FtpServer::openDataConnection(Client &c) {
             return 0; // try again later
         }
         ESP_LOGE(TAG_FTP, "Failed to accept PASV data connection (errno=%d)", errno);
+        stats.socket_errors++;
         return -1;
     }
 
     c.pasv_data_sock = sock;
+    c.data_pending = false;
+    if (c.xfer.state == Transfer::WAIT_CONNECT) {
+        c.xfer.state = c.xfer.upload ? Transfer::RECEIVING : Transfer::SENDING;
+    }
     return sock;
 }
 
 void FtpServer::closeDataConnection(Client &c) {
-    if (c.pasv_data_sock > 0) {
+    if (c.pasv_data_sock >= 0) {
         close(c.pasv_data_sock);
         c.pasv_data_sock = -1;
     }
-    if (c.pasv_listen_sock > 0) {
-        close(c.pasv_listen_sock);
+    if (c.pasv_listen_sock >= 0) {
+        // Pooled listeners stay bound, they only go back to the pool
+        for (int i = 0; i < max_clients; i++) {
+            PassivePort &p = pasvPool[i];
+            if (p.sock != c.pasv_listen_sock) continue;
+            if (pasv_pool) {
+                drainPassive(p.sock);
+            } else {
+                close(p.sock);
+                p.sock = -1;
+            }
+            p.leased = false;
+        }
         c.pasv_listen_sock = -1;
     }
+    c.data_pending = false;
+}
+
+static int bindPassive(uint16_t port) {
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (sock < 0) return -1;
+
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 1) < 0) {
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    return sock;
+}
+
+void FtpServer::openPassivePool() {
+    // Ports that are busy now are skipped; a slot without a socket retries its port on lease
+    uint16_t port = pasv_port_min;
+    for (int i = 0; i < max_clients; i++) {
+        PassivePort &p = pasvPool[i];
+        p.sock = -1;
+        p.port = 0;
+        p.leased = false;
+        while (p.sock < 0 && port != 0 && port <= pasv_port_max) {
+            p.port = port++;
+            p.sock = bindPassive(p.port);
+        }
+        if (p.sock < 0 && p.port) {
+            ESP_LOGW(TAG_FTP, "Passive port %u unavailable", p.port);
+        }
+    }
+}
+
+int FtpServer::leasePassivePort(Client &c) {
+    for (int i = 0; i < max_clients; i++) {
+        PassivePort &p = pasvPool[i];
+        if (p.leased || p.port == 0) continue;
+        if (!pasv_pool && p.sock >= 0) {
+            close(p.sock);
+            p.sock = -1;
+        }
+        if (p.sock < 0) p.sock = bindPassive(p.port);
+        if (p.sock < 0) continue;
+
+        // Connections left over from the previous lease must not pass as ours
+        drainPassive(p.sock);
+        p.leased = true;
+        c.pasv_listen_sock = p.sock;
+        return p.port;
+    }
+    return -1;
+}
+
+void FtpServer::drainPassive(int sock) {
+    int pending;
+    while ((pending = accept(sock, nullptr, nullptr)) >= 0) {
+        close(pending);
+    }
+}
+
+/* ==== Paths ==== */
+// Joins arg to cwd (unless it is absolute) and folds ".", ".." and repeated
+// or trailing '/' into "/a/b". ".." stops at the root. False if it doesn't fit.
+static bool normalizePath(const char *cwd, const char *arg, char *out, size_t size) {
+    size_t len = 0;
+    const char *parts[2] = { arg[0] == '/' ? "" : cwd, arg };
+    for (const char *p : parts) {
+        while (*p) {
+            while (*p == '/') p++;
+            const char *end = p;
+            while (*end && *end != '/') end++;
+            size_t n = end - p;
+            if (n == 1 && p[0] == '.') {
+                // Stays where it is
+            } else if (n == 2 && p[0] == '.' && p[1] == '.') {
+                while (len > 0 && out[len - 1] != '/') len--;
+                if (len > 0) len--;
+            } else if (n > 0) {
+                if (len + 1 + n >= size) return false;
+                out[len++] = '/';
+                memcpy(out + len, p, n);
+                len += n;
+            }
+            p = end;
+        }
+    }
+    if (len == 0) out[len++] = '/';
+    out[len] = 0;
+    return true;
+}
+
+// The one place a command's path argument is interpreted: path gets the
+// normalized path as clients see it (what the caches are keyed on), fs_path
+// the same file inside the returned filesystem. nullptr if it is too long.
+IFileSystem *FtpServer::resolve(const Client &c, const char *arg, char *path, const char **fs_path) {
+    if (!normalizePath(c.cwd, arg, path, FTP_PATH_MAX)) return nullptr;
+
+    // Longest mount point that is path itself or one of its parents
+    const Mount *best = &mounts[0];
+    for (int i = 1; i < mount_count; i++) {
+        const Mount &m = mounts[i];
+        if (m.len > best->len && strncmp(path, m.path, m.len) == 0 &&
+            (path[m.len] == 0 || path[m.len] == '/')) {
+            best = &m;
+        }
+    }
+    *fs_path = path[best->len] ? path + best->len : "/";
+    return best->fs;
+}
+
+/* ==== Transfer state machine ==== */
+bool FtpServer::beginTransfer(Client &c, IFileSystem &fs, int fd, bool upload, long start) {
+    Transfer &x = c.xfer;
+    x.buf[0] = x.buf[1] = nullptr;
+    x.zip = nullptr;
+    x.unzip = nullptr;
+    x.buf_bytes = 0;
+    x.cache_handle = -1;
+    if (start > 0 && fs.lseek(fd, start, SEEK_SET) != start) return false;
+
+    if (upload) {
+        // Two sector-sized buffers so the socket can keep filling one
+        // while the other is written to FatFs in whole sectors.
+        x.buf[0] = allocBuffer(x, FTP_STOR_BUFFER_SIZE);
+        x.buf[1] = allocBuffer(x, FTP_STOR_BUFFER_SIZE);
+    } else {
+        size_t size = 0;
+        const void *data = zero_copy ? fs.map(fd, &size) : nullptr;
+        if (data) {
+            // RAM-resident content goes to the socket as it is, nothing is read or copied
+            x.source.Emplace<MappedBackend>(static_cast<const char *>(data) + start, size - start);
+#if defined(__linux__)
+        } else if (zero_copy && fs.nativeFd(fd) >= 0) {
+            x.source.Emplace<SendfileBackend>(fs.nativeFd(fd), start);
+#endif
+        } else {
+            // In MODE Z the compressor reads the file into its own window instead
+            if (!c.mode_z) x.buf[0] = allocBuffer(x, FTP_TRANSFER_CHUNK);
+            if (x.buf[0] || c.mode_z) x.source.Emplace<CopyBackend>(fs, fd, x.buf[0], FTP_TRANSFER_CHUNK);
+        }
+    }
+    if ((upload ? (!x.buf[0] || !x.buf[1]) : !x.source.IsSet()) || !attachCodec(c, upload)) {
+        ESP_LOGE(TAG_FTP, "No memory for transfer buffer");
+        freeBuffers(x);
+        return false;
+    }
+
+    armTransfer(c, fd, upload);
+    x.fs = &fs;
+    x.start_offset = start;
+    // A resumed upload starts mid-sector: cut the first buffer short so every
+    // later write lands on a sector boundary again
+    x.buf_limit = FTP_STOR_BUFFER_SIZE - start % FTP_STOR_BUFFER_SIZE;
+    return true;
+}
+
+bool FtpServer::beginListing(Client &c, const char *args, ListingBackend::Format format) {
+    Transfer &x = c.xfer;
+
+    // LIST options such as "-la" are accepted and ignored
+    const char *fs_path;
+    IFileSystem *fs = resolve(c, args[0] == '-' ? "" : args, x.path, &fs_path);
+    if (!fs) return false;
+
+    // Warm cache: send the stored rendering straight from RAM, no FatFs access at all
+    const char *data;
+    size_t len;
+    x.buf[0] = x.buf[1] = nullptr;
+    x.zip = nullptr;
+    x.unzip = nullptr;
+    x.buf_bytes = 0;
+    if (!attachCodec(c, false)) return false;
+    x.cache_handle = listingCache.acquire(x.path, format, monotonicMs(), &data, &len);
+    if (x.cache_handle >= 0) {
+        x.source.Emplace<MappedBackend>(data, len);
+        armTransfer(c, -1, false);
+        return true;
+    }
+
+    int dir = fs->opendir(fs_path);
+    if (dir < 0) {
+        freeBuffers(x);
+        return false;
+    }
+
+    x.buf[0] = allocBuffer(x, FTP_LIST_BUFFER_SIZE);
+    if (!x.buf[0]) {
+        ESP_LOGE(TAG_FTP, "No memory for listing buffer");
+        fs->closedir(dir);
+        freeBuffers(x);
+        return false;
+    }
+    x.list_gen = listingCache.generation();
+    x.source.Emplace<ListingBackend>(*fs, dir, fs_path, format, x.buf[0], FTP_LIST_BUFFER_SIZE,
+                                     FTP_LIST_CACHE_BYTES);
+    armTransfer(c, -1, false);
+    return true;
+}
+
+void FtpServer::cacheListing(Client &c) {
+    Transfer &x = c.xfer;
+    if (!x.source.IsType<ListingBackend>()) return;
+
+    ListingBackend &listing = x.source.GetAs<ListingBackend>();
+    size_t len;
+    char *data = listing.takeCapture(&len);
+    if (data) {
+        listingCache.store(x.path, listing.getFormat(), data, len, x.list_gen, monotonicMs());
+    }
+}
+
+char *FtpServer::allocBuffer(Transfer &x, size_t size) {
+    char *buf = (char *)malloc(size);
+    if (buf) countBuffer(x, size);
+    return buf;
+}
+
+void FtpServer::countBuffer(Transfer &x, size_t size) {
+    x.buf_bytes += size;
+    buffer_bytes += size;
+    if (buffer_bytes > buffer_peak) buffer_peak = buffer_bytes;
+}
+
+// MODE Z: the data connection carries a zlib stream of the file or listing.
+// The codec's memory is fixed up front and counted with the transfer buffers.
+bool FtpServer::attachCodec(Client &c, bool upload) {
+    Transfer &x = c.xfer;
+    if (!c.mode_z) return true;
+    if (upload) {
+        x.unzip = Inflater::create();
+        if (x.unzip) countBuffer(x, Inflater::bytes());
+    } else {
+        x.zip = Deflater::create();
+        if (x.zip) countBuffer(x, Deflater::bytes());
+    }
+    if (!x.zip && !x.unzip) ESP_LOGE(TAG_FTP, "No memory for MODE Z %s", upload ? "inflater" : "deflater");
+    return x.zip || x.unzip;
+}
+
+void FtpServer::freeBuffers(Transfer &x) {
+    free(x.buf[0]);
+    free(x.buf[1]);
+    x.buf[0] = x.buf[1] = nullptr;
+    Deflater::destroy(x.zip);
+    Inflater::destroy(x.unzip);
+    x.zip = nullptr;
+    x.unzip = nullptr;
+    buffer_bytes -= x.buf_bytes;
+    x.buf_bytes = 0;
+}
+
+void FtpServer::invalidateListing(const char *path) {
+    LOCK(mutex);
+    listingCache.invalidate(path);
+}
+
+void FtpServer::armTransfer(Client &c, int fd, bool upload) {
+    Transfer &x = c.xfer;
+    x.upload = upload;
+    x.fd = fd;
+    x.offset = 0;
+    x.wire = 0;
+    x.start_offset = 0;
+    x.trim = false;
+    x.buf_len[0] = 0;
+    x.buf_len[1] = 0;
+    x.buf_limit = FTP_STOR_BUFFER_SIZE;
+    x.fill = 0;
+    x.flush_pending = false;
+    x.writes = 0;
+    x.ready = false;
+    x.deficit = 0;
+    x.start_ms = monotonicMs();
+    x.deadline_ms = x.start_ms + FTP_DATA_ACCEPT_TIMEOUT_MS;
+    x.state = Transfer::WAIT_CONNECT;
+    if (c.pasv_data_sock >= 0) {
+        x.state = upload ? Transfer::RECEIVING : Transfer::SENDING;
+    }
+}
+
+ssize_t FtpServer::pumpTransfer(Client &c, size_t max) {
+    if (c.xfer.state == Transfer::SENDING) return pumpSend(c, max);
+    if (c.xfer.state == Transfer::RECEIVING) return pumpReceive(c, max);
+    return 0;
+}
+
+// Both pumps return the data bytes moved, 0 when nothing moved or the transfer ended
+ssize_t FtpServer::pumpSend(Client &c, size_t max) {
+    Transfer &x = c.xfer;
+
+    ssize_t sent = x.zip ? sendCompressed(c, max) : x.source.Get().pump(c.pasv_data_sock, max);
+    if (sent == 0) {
+        if (x.fd >= 0) {
+            long long ms = monotonicMs() - x.start_ms;
+            ESP_LOGI(TAG_FTP, "RETR %ld bytes from offset %ld in %lld ms (%lld KB/s)",
+                     x.offset, x.start_offset, ms, ms > 0 ? (long long)x.offset / ms : 0LL);
+            if (x.zip) ESP_LOGI(TAG_FTP, "MODE Z sent %ld bytes for %ld", x.wire, x.offset);
+        }
+        cacheListing(c);
+        endTransfer(c, "226 Transfer complete\r\n");
+        return 0;
+    }
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        ESP_LOGW(TAG_FTP, "Outgoing transfer failed (errno=%d)", errno);
+        stats.socket_errors++;
+        endTransfer(c, "426 Connection closed; transfer aborted\r\n");
+        return 0;
+    }
+    if (!x.zip) x.offset += sent;
+    x.wire += sent;
+    return sent;
+}
+
+ssize_t FtpServer::sendCompressed(Client &c, size_t max) {
+    Transfer &x = c.xfer;
+    Deflater &z = *x.zip;
+
+    // Compress the next piece only once the last one is on the wire, like CopyBackend
+    if (z.pending() == 0) {
+        if (!z.fill(x.source.Get())) return -1;
+        x.offset = (long)z.totalIn();
+        if (z.pending() == 0) return 0;
+    }
+
+    size_t n = z.pending() < max ? z.pending() : max;
+    ssize_t sent = send(c.pasv_data_sock, z.data(), n, MSG_DONTWAIT);
+    if (sent > 0) z.consume(sent);
+    return sent;
+}
+
+ssize_t FtpServer::pumpReceive(Client &c, size_t max) {
+    Transfer &x = c.xfer;
+    if (x.unzip) return receiveCompressed(c, max);
+
+    char *buf = x.buf[x.fill];
+    size_t &len = x.buf_len[x.fill];
+
+    size_t space = x.buf_limit - len;
+    ssize_t n = recv(c.pasv_data_sock, buf + len, space < max ? space : max, MSG_DONTWAIT);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        ESP_LOGW(TAG_FTP, "STOR recv failed (errno=%d)", errno);
+        stats.socket_errors++;
+        endTransfer(c, "426 Connection closed; transfer aborted\r\n");
+        return 0;
+    }
+
+    if (n == 0) {
+        completeUpload(c);
+        return 0;
+    }
+
+    len += n;
+    x.offset += n;
+    x.wire += n;
+    if (len == x.buf_limit && !x.flush_pending) {
+        // Hand the full buffer to the flusher and keep receiving into the other one
+        x.flush_pending = true;
+        x.fill ^= 1;
+        x.buf_limit = FTP_STOR_BUFFER_SIZE;
+    }
+    return n;
+}
+
+// MODE Z upload: the socket feeds the inflater's input, which decodes into
+// the same pair of sector buffers a plain upload receives into
+ssize_t FtpServer::receiveCompressed(Client &c, size_t max) {
+    Transfer &x = c.xfer;
+    Inflater &z = *x.unzip;
+
+    // Input still staged from last time is decoded even when nothing new fits
+    size_t space;
+    uint8_t *in = z.input(&space);
+    ssize_t n = 0;
+    bool eof = false;
+    if (space > 0) {
+        n = recv(c.pasv_data_sock, in, space < max ? space : max, MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ESP_LOGW(TAG_FTP, "STOR recv failed (errno=%d)", errno);
+                stats.socket_errors++;
+                endTransfer(c, "426 Connection closed; transfer aborted\r\n");
+                return 0;
+            }
+            n = 0;
+        } else if (n == 0) {
+            eof = true;
+        } else {
+            z.commitInput(n);
+            x.wire += n;
+        }
+    }
+
+    for (;;) {
+        size_t &len = x.buf_len[x.fill];
+        size_t produced;
+        Inflater::Status st = z.run((uint8_t *)x.buf[x.fill] + len, x.buf_limit - len, &produced);
+        len += produced;
+        x.offset += produced;
+        if (st == Inflater::FAILED) {
+            ESP_LOGW(TAG_FTP, "MODE Z upload rejected: %s", z.error());
+            endTransfer(c, "451 Invalid compressed data; transfer aborted\r\n");
+            return 0;
+        }
+        if (len < x.buf_limit) break;
+        // Both buffers full: the rest stays staged until the flusher catches up
+        if (x.flush_pending) return n;
+        x.flush_pending = true;
+        x.fill ^= 1;
+        x.buf_limit = FTP_STOR_BUFFER_SIZE;
+    }
+
+    if (eof) {
+        if (!z.finished()) {
+            ESP_LOGW(TAG_FTP, "MODE Z upload ended mid-stream");
+            endTransfer(c, "451 Compressed data truncated; transfer aborted\r\n");
+            return 0;
+        }
+        completeUpload(c);
+    }
+    return n;
+}
+
+void FtpServer::completeUpload(Client &c) {
+    Transfer &x = c.xfer;
+
+    // Client closed the data connection: write whatever is left, tail last
+    if (x.flush_pending && !flushUpload(c, x.fill ^ 1)) return;
+    x.flush_pending = false;
+    if (!flushUpload(c, x.fill)) return;
+
+    long long ms = monotonicMs() - x.start_ms;
+    ESP_LOGI(TAG_FTP, "STOR %ld bytes from offset %ld in %lld ms (%lld KB/s), %d writes%s",
+             x.offset, x.start_offset, ms, ms > 0 ? (long long)x.offset / ms : 0LL, x.writes,
+             x.trim ? ", trimmed" : "");
+    if (x.unzip) ESP_LOGI(TAG_FTP, "MODE Z received %ld bytes for %ld", x.wire, x.offset);
+    endTransfer(c, "226 Transfer complete\r\n");
+}
+
+bool FtpServer::isThrottled(const Client &c) const {
+    return c.bucket.available() < FTP_RATE_MIN_GRANT || globalBucket.available() < FTP_RATE_MIN_GRANT;
+}
+
+void FtpServer::scheduleTransfers() {
+    // Deficit round robin: every ready transfer earns one chunk of credit per
+    // round and spends it as far as the token buckets allow. The next round
+    // starts after the last transfer served, so when the global budget runs
+    // out mid-round the ones that missed out go first next time.
+    long long now = monotonicMs();
+    globalBucket.refill(now);
+
+    int last_served = -1;
+    for (int k = 0; k < max_clients; k++) {
+        int i = (rr_next + k) % max_clients;
+        if (!clients[i]) continue;
+        Client &c = *clients[i];
+        Transfer &x = c.xfer;
+        if (!x.ready) continue;
+        x.ready = false;
+
+        c.bucket.refill(now);
+        x.deficit += FTP_TRANSFER_CHUNK;
+        if (x.deficit > 2 * FTP_TRANSFER_CHUNK) x.deficit = 2 * FTP_TRANSFER_CHUNK;
+
+        size_t grant = x.deficit;
+        if (c.bucket.available() < grant) grant = c.bucket.available();
+        if (globalBucket.available() < grant) grant = globalBucket.available();
+        if (grant == 0) continue;
+
+        ssize_t moved = pumpTransfer(c, grant);
+        if (moved > 0) {
+            c.bucket.consume(moved);
+            globalBucket.consume(moved);
+            x.deficit -= moved;
+            last_served = i;
+        }
+        // A transfer that could not use its grant has no backlog to carry credit for
+        if (moved < (ssize_t)grant) x.deficit = 0;
+    }
+    if (last_served >= 0) rr_next = (last_served + 1) % max_clients;
+}
+
+void FtpServer::setRateLimits(uint32_t global_bps, uint32_t session_bps) {
+    LOCK(mutex);
+    long long now = monotonicMs();
+    globalBucket.setRate(global_bps, FTP_TRANSFER_CHUNK, now);
+    this->session_bps = session_bps;
+    for (int i = 0; clients && i < max_clients; i++) {
+        if (clients[i]) clients[i]->bucket.setRate(session_bps, FTP_TRANSFER_CHUNK, now);
+    }
+}
+
+bool FtpServer::flushUpload(Client &c) {
+    Transfer &x = c.xfer;
+    if (!flushUpload(c, x.fill ^ 1)) return false;
+    x.flush_pending = false;
+
+    // The socket may have filled the other buffer while this one waited
+    if (x.buf_len[x.fill] == FTP_STOR_BUFFER_SIZE) {
+        x.flush_pending = true;
+        x.fill ^= 1;
+    }
+    return true;
+}
+
+bool FtpServer::flushUpload(Client &c, int index) {
+    Transfer &x = c.xfer;
+    size_t len = x.buf_len[index];
+    if (len == 0) return true;
+
+    ssize_t n = x.fs->write(x.fd, x.buf[index], len);
+    x.writes++;
+    if (n != (ssize_t)len) {
+        ESP_LOGE(TAG_FTP, "STOR write failed (errno=%d)", errno);
+        stats.file_errors++;
+        // Nothing left in the buffers is going to make it to the file
+        x.offset -= (long)(x.buf_len[0] + x.buf_len[1]);
+        x.buf_len[0] = x.buf_len[1] = 0;
+        endTransfer(c, "452 Write error, transfer aborted\r\n");
+        return false;
+    }
+    x.buf_len[index] = 0;
+    return true;
+}
+
+void FtpServer::endTransfer(Client &c, const char *reply) {
+    Transfer &x = c.xfer;
+    if (x.upload && x.fd >= 0 && x.state == Transfer::RECEIVING) {
+        // Keep every byte that arrived, so REST after a dropped link resumes right there
+        int order[2] = { x.fill ^ 1, x.fill };
+        for (int i : order) {
+            if (x.buf_len[i] && x.fs->write(x.fd, x.buf[i], x.buf_len[i]) == (ssize_t)x.buf_len[i]) x.buf_len[i] = 0;
+        }
+        long end = x.start_offset + x.offset - (long)(x.buf_len[0] + x.buf_len[1]);
+        if (x.trim && x.fs->ftruncate(x.fd, end) != 0) {
+            ESP_LOGW(TAG_FTP, "STOR could not trim file to %ld (errno=%d)", end, errno);
+        }
+    }
+    if (x.fd >= 0) {
+        x.fs->close(x.fd);
+        x.fd = -1;
+    }
+
+    // Aborted transfers count their bytes, only completed ones feed the histograms
+    FtpTransferStats &t = x.upload ? stats.in : stats.out;
+    t.bytes += x.offset;
+    (x.upload ? c.stats.bytes_in : c.stats.bytes_out) += x.offset;
+    c.stats.transfers++;
+    if (reply && reply[0] == '2') {
+        long long ms = monotonicMs() - x.start_ms;
+        t.completed++;
+        t.duration_ms.record((uint32_t)ms);
+        t.kbytes_per_sec.record((uint32_t)(x.offset / (ms > 0 ? ms : 1)));
+    } else {
+        t.aborted++;
+    }
+
+    x.source.Clear();
+    if (x.cache_handle >= 0) {
+        listingCache.release(x.cache_handle);
+        x.cache_handle = -1;
+    }
+    if (x.upload) {
+        listingCache.invalidateParent(x.path);
+        hashCache.invalidate(x.path);
+    }
+    freeBuffers(x);
+    x.flush_pending = false;
+    x.ready = false;
+    x.state = Transfer::IDLE;
+    c.last_activity_ms = monotonicMs();
+    closeDataConnection(c);
+
+    if (reply && c.client_sock >= 0) {
+        send(c.client_sock, reply, strlen(reply), 0);
+    }
+}
+
+
+/* ==== File digests ==== */
+// Strips "<start> [<end>]" off the end of an XCRC/XMD5/XSHA* argument and the
+// quotes some clients put around names with spaces
+static void parseHashArgs(char *name, long *start, long *end) {
+    long nums[2];
+    int count = 0;
+    while (count < 2) {
+        char *sp = strrchr(name, ' ');
+        if (!sp || !sp[1]) break;
+        char *e;
+        long v = strtol(sp + 1, &e, 10);
+        if (*e || v < 0) break;
+        nums[count++] = v;
+        *sp = 0;
+    }
+    *start = count == 2 ? nums[1] : count == 1 ? nums[0] : 0;
+    *end = count == 2 ? nums[0] : -1;
+
+    size_t len = strlen(name);
+    if (len >= 2 && name[0] == '"' && name[len - 1] == '"') {
+        memmove(name, name + 1, len - 2);
+        name[len - 2] = 0;
+    }
+}
+
+void FtpServer::startHash(Client &c, const char *args, Digest::Algorithm algo, bool x_reply) {
+    if (!Digest::available(algo)) {
+        const char *resp = "504 Hash algorithm not available\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    // HASH takes its range from a preceding RANG, the X commands from their arguments
+    char name[sizeof(HashJob::name)];
+    snprintf(name, sizeof(name), "%s", args);
+    long start = 0, end = -1;
+    if (x_reply) {
+        parseHashArgs(name, &start, &end);
+    } else if (c.rang_set) {
+        start = c.rang_start;
+        end = c.rang_end + 1;
+        c.rang_set = false;
+    }
+    if (!name[0]) {
+        const char *resp = "501 No filename given\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    char path[FTP_PATH_MAX];
+    const char *fs_path;
+    IFileSystem *fs = resolve(c, name, path, &fs_path);
+    struct stat st;
+    if (!fs || fs->stat(fs_path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        const char *resp = "550 File not found\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+    if (end < 0 || end > st.st_size) end = st.st_size;
+    if (start > end) {
+        const char *resp = "501 Invalid range\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    HashCache::Key key = { HashCache::pathKey(path), algo, start, end, st.st_mtime, st.st_size };
+    char hex[FTP_DIGEST_HEX_MAX];
+    if (hashCache.lookup(key, monotonicMs(), hex)) {
+        sendHashReply(c, key, x_reply, name, hex);
+        return;
+    }
+
+    int fd = fs->open(fs_path, O_RDONLY);
+    if (fd < 0 || (start > 0 && fs->lseek(fd, start, SEEK_SET) != start)) {
+        const char *resp = "550 Failed to open file\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        if (fd >= 0) fs->close(fd);
+        return;
+    }
+
+    void *mem = malloc(sizeof(HashJob));
+    if (!mem) {
+        ESP_LOGE(TAG_FTP, "No memory for hash buffer");
+        const char *resp = "451 Local error in processing\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        fs->close(fd);
+        return;
+    }
+    buffer_bytes += sizeof(HashJob);
+    if (buffer_bytes > buffer_peak) buffer_peak = buffer_bytes;
+
+    // tick() reads and digests chunks for FTP_JOB_SLICE_MS per pass until the range is done
+    HashJob &job = *new (mem) HashJob();
+    job.fs = fs;
+    job.fd = fd;
+    job.pos = start;
+    job.key = key;
+    job.digest.begin(algo);
+    job.x_reply = x_reply;
+    job.start_ms = monotonicMs();
+    snprintf(job.name, sizeof(job.name), "%s", name);
+    c.hash = &job;
+}
+
+void FtpServer::serviceHash(Client &c) {
+    HashJob &job = *c.hash;
+    long left = job.key.end - job.pos;
+    if (left > 0) {
+        ssize_t n = job.fs->read(job.fd, job.buf, left < FTP_HASH_CHUNK ? left : FTP_HASH_CHUNK);
+        if (n <= 0) {
+            ESP_LOGE(TAG_FTP, "HASH read failed at %ld (errno=%d)", job.pos, errno);
+            stats.file_errors++;
+            endHash(c, "451 Read error\r\n");
+            return;
+        }
+        job.digest.update(job.buf, n);
+        job.pos += n;
+        if (job.pos < job.key.end) return;
+    }
+
+    char hex[FTP_DIGEST_HEX_MAX];
+    job.digest.finish(hex);
+    long long ms = monotonicMs() - job.start_ms;
+    long bytes = job.key.end - job.key.start;
+    ESP_LOGI(TAG_FTP, "%s of %ld bytes in %lld ms (%lld KB/s)", Digest::name(job.key.algo), bytes, ms,
+             ms > 0 ? (long long)bytes / ms : 0LL);
+    hashCache.store(job.key, hex, monotonicMs());
+    sendHashReply(c, job.key, job.x_reply, job.name, hex);
+    endHash(c, nullptr);
+}
+
+void FtpServer::endHash(Client &c, const char *reply) {
+    HashJob *job = c.hash;
+    job->fs->close(job->fd);
+    job->~HashJob();
+    free(job);
+    buffer_bytes -= sizeof(HashJob);
+    c.hash = nullptr;
+    c.last_activity_ms = monotonicMs();
+
+    if (reply && c.client_sock >= 0) {
+        send(c.client_sock, reply, strlen(reply), 0);
+    }
+}
+
+void FtpServer::sendHashReply(Client &c, const HashCache::Key &key, bool x_reply, const char *name,
+                              const char *hex) {
+    // HASH: "213 <algo> <start>-<end> <hex> <name>", end exclusive so a whole file reads 0-<size>
+    char resp[sizeof(HashJob::name) + FTP_DIGEST_HEX_MAX + 64];
+    if (x_reply) {
+        snprintf(resp, sizeof(resp), "250 %s\r\n", hex);
+    } else {
+        snprintf(resp, sizeof(resp), "213 %s %ld-%ld %s %s\r\n", Digest::name(key.algo), key.start, key.end,
+                 hex, name);
+    }
+    send(c.client_sock, resp, strlen(resp), 0);
+}
+
+
+/* ==== Server-side copy ==== */
+// One name of "SITE COPY <from> <to>", in double quotes if it has spaces
+static bool nextCopyName(const char *&p, char *out, size_t size) {
+    while (*p == ' ') p++;
+    char stop = ' ';
+    if (*p == '"') {
+        stop = '"';
+        p++;
+    }
+    const char *start = p;
+    while (*p && *p != stop) p++;
+    size_t len = p - start;
+    if (stop == '"' && *p++ != '"') return false;
+    if (len == 0 || len >= size) return false;
+    memcpy(out, start, len);
+    out[len] = 0;
+    return true;
+}
+
+void FtpServer::startCopy(Client &c, const char *args) {
+    char from_arg[FTP_PATH_MAX], to_arg[FTP_PATH_MAX];
+    const char *p = args;
+    if (!nextCopyName(p, from_arg, sizeof(from_arg)) || !nextCopyName(p, to_arg, sizeof(to_arg)) || *p) {
+        const char *resp = "501 Usage: SITE COPY <from> <to>\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    char from[FTP_PATH_MAX], to[FTP_PATH_MAX];
+    const char *src_path, *dst_path;
+    IFileSystem *src_fs = resolve(c, from_arg, from, &src_path);
+    IFileSystem *dst_fs = resolve(c, to_arg, to, &dst_path);
+    struct stat st;
+    if (!src_fs || src_fs->stat(src_path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        const char *resp = "550 File not found\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+    if (!dst_fs || strcmp(from, to) == 0) {
+        const char *resp = "553 Invalid target name\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    int src = src_fs->open(src_path, O_RDONLY);
+    int dst = src >= 0 ? dst_fs->open(dst_path, O_WRONLY | O_CREAT | O_TRUNC) : -1;
+    void *mem = dst >= 0 ? malloc(sizeof(CopyJob)) : nullptr;
+    if (!mem) {
+        if (dst < 0) ESP_LOGW(TAG_FTP, "SITE COPY can't open %s (errno=%d)", src < 0 ? from : to, errno);
+        else ESP_LOGE(TAG_FTP, "No memory for copy buffer");
+        const char *resp = src < 0 ? "550 Failed to open file\r\n" : dst < 0 ? "553 Failed to create file\r\n"
+                                                                    : "451 Local error in processing\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        if (dst >= 0) dst_fs->close(dst);
+        if (src >= 0) src_fs->close(src);
+        return;
+    }
+    buffer_bytes += sizeof(CopyJob);
+    if (buffer_bytes > buffer_peak) buffer_peak = buffer_bytes;
+
+    // tick() moves chunks for FTP_JOB_SLICE_MS per pass; a mapped source is written straight from its mapping
+    CopyJob &job = *new (mem) CopyJob();
+    job.src_fs = src_fs;
+    job.src = src;
+    job.src_data = static_cast<const uint8_t *>(src_fs->map(src, &job.src_size));
+    job.dst_fs = dst_fs;
+    job.dst = dst;
+    job.start_ms = monotonicMs();
+    memcpy(job.path, to, sizeof(job.path));
+    snprintf(job.dst_path, sizeof(job.dst_path), "%s", dst_path);
+    c.copy = &job;
+}
+
+void FtpServer::serviceCopy(Client &c) {
+    CopyJob &job = *c.copy;
+    const void *chunk = job.buf;
+    ssize_t n;
+    if (job.src_data) {
+        size_t left = job.src_size - job.pos;
+        n = left < FTP_COPY_CHUNK ? left : FTP_COPY_CHUNK;
+        chunk = job.src_data + job.pos;
+    } else {
+        n = job.src_fs->read(job.src, job.buf, FTP_COPY_CHUNK);
+    }
+    if (n < 0) {
+        ESP_LOGE(TAG_FTP, "SITE COPY read failed at %ld (errno=%d)", job.pos, errno);
+        stats.file_errors++;
+        endCopy(c, "451 Read error, copy aborted\r\n");
+        return;
+    }
+    if (n == 0) {
+        long long ms = monotonicMs() - job.start_ms;
+        ESP_LOGI(TAG_FTP, "SITE COPY %ld bytes in %lld ms (%lld KB/s)", job.pos, ms,
+                 ms > 0 ? (long long)job.pos / ms : 0LL);
+        char resp[64];
+        snprintf(resp, sizeof(resp), "250 Copied %ld bytes\r\n", job.pos);
+        endCopy(c, resp);
+        return;
+    }
+    if (job.dst_fs->write(job.dst, chunk, n) != n) {
+        ESP_LOGE(TAG_FTP, "SITE COPY write failed at %ld (errno=%d)", job.pos, errno);
+        stats.file_errors++;
+        endCopy(c, "452 Write error, copy aborted\r\n");
+        return;
+    }
+    job.pos += n;
+}
+
+void FtpServer::endCopy(Client &c, const char *reply) {
+    CopyJob *job = c.copy;
+    job->src_fs->close(job->src);
+    job->dst_fs->close(job->dst);
+    // A copy that didn't finish leaves nothing behind
+    if (!reply || reply[0] != '2') job->dst_fs->unlink(job->dst_path);
+    listingCache.invalidateParent(job->path);
+    hashCache.invalidate(job->path);
+    job->~CopyJob();
+    free(job);
+    buffer_bytes -= sizeof(CopyJob);
+    c.copy = nullptr;
+    c.last_activity_ms = monotonicMs();
+
+    if (reply && c.client_sock >= 0) {
+        send(c.client_sock, reply, strlen(reply), 0);
+    }
 }
 
 
@@ -72,62 +1009,98 @@ void FtpServer::ftp_cmd_quit(Client &c, const char *args) {
     (void)args;
     const char *resp = "221 Goodbye.\r\n";
     send(c.client_sock, resp, strlen(resp), 0);
-    close(c.client_sock);
-    c.client_sock = -1;
-    c.active = false;
+    closeClient(c);
 }
 
 void FtpServer::ftp_cmd_pwd(Client &c, const char *args) {
     (void)args;
-    char resp[256];
-    snprintf(resp, sizeof(resp), "257 \"%s\" is current directory\r\n",
-             c.cwd[0] ? c.cwd : "/");
+    char resp[FTP_PATH_MAX + 40];
+    snprintf(resp, sizeof(resp), "257 \"%s\" is current directory\r\n", c.cwd);
     send(c.client_sock, resp, strlen(resp), 0);
 }
 
 void FtpServer::ftp_cmd_list(Client &c, const char *args) {
-    (void)args;
+    if (c.pasv_data_sock < 0 && c.pasv_listen_sock < 0) {
+        const char *resp = "425 Use PASV or PORT first\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+    if (!beginListing(c, args, ListingBackend::LIST)) {
+        const char *resp = "550 Failed to open directory\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
     const char *start = "150 Here comes the directory listing\r\n";
     send(c.client_sock, start, strlen(start), 0);
+}
 
-    if (openDataConnection(c) < 0) {
-        const char *resp = "425 Can't open data connection\r\n";
+void FtpServer::ftp_cmd_mlsd(Client &c, const char *args) {
+    if (c.pasv_data_sock < 0 && c.pasv_listen_sock < 0) {
+        const char *resp = "425 Use PASV or PORT first\r\n";
         send(c.client_sock, resp, strlen(resp), 0);
         return;
     }
+    if (!beginListing(c, args, ListingBackend::MLSD)) {
+        const char *resp = "550 Failed to open directory\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+    const char *start = "150 Here comes the machine listing\r\n";
+    send(c.client_sock, start, strlen(start), 0);
+}
 
-    char fullbase[256];
-    snprintf(fullbase, sizeof(fullbase), "%s%s", root_path, c.cwd);
-
-    DIR *dir = opendir(fullbase);
-    if (dir) {
-        struct dirent *entry;
-        while ((entry = readdir(dir)) != NULL) {
-            char line[256];
-            char fullpath[256];
-            struct stat st;
+void FtpServer::ftp_cmd_mlst(Client &c, const char *args) {
+    const char *name = args[0] ? args : c.cwd;
 
-            snprintf(fullpath, sizeof(fullpath), "%s/%s", fullbase, entry->d_name);
-            if (stat(fullpath, &st) == 0) {
-                if (S_ISDIR(st.st_mode)) {
-                    snprintf(line, sizeof(line),
-                             "drwxr-xr-x 1 user group 0 Jan 1 00:00 %s\r\n",
-                             entry->d_name);
-                } else {
-                    snprintf(line, sizeof(line),
-                             "-rw-r--r-- 1 user group %ld Jan 1 00:00 %s\r\n",
-                             (long)st.st_size, entry->d_name);
-                }
-                send(c.pasv_data_sock, line, strlen(line), 0);
-            }
-        }
-        closedir(dir);
+    char path[FTP_PATH_MAX];
+    const char *fs_path;
+    IFileSystem *fs = resolve(c, args, path, &fs_path);
+    struct stat st;
+    if (!fs || fs->stat(fs_path, &st) != 0) {
+        const char *resp = "550 No such file or directory\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
     }
 
-    closeDataConnection(c);
+    // Single entry on the control channel: "250-", the facts line with a leading space, "250"
+    char resp[FTP_LIST_MAX_LINE + 64];
+    int n = snprintf(resp, sizeof(resp), "250-Listing %s\r\n ", name);
+    n += ListingBackend::formatEntry(resp + n, sizeof(resp) - n, ListingBackend::MLSD, name,
+                                     S_ISDIR(st.st_mode), &st, time(nullptr));
+    if (n < (int)sizeof(resp)) {
+        n += snprintf(resp + n, sizeof(resp) - n, "250 End\r\n");
+    }
+    send(c.client_sock, resp, strlen(resp), 0);
+}
 
-    const char *done = "226 Directory send OK.\r\n";
-    send(c.client_sock, done, strlen(done), 0);
+void FtpServer::ftp_cmd_feat(Client &c, const char *args) {
+    (void)args;
+    char resp[320];
+    int n = snprintf(resp, sizeof(resp),
+                     "211-Features:\r\n"
+                     " EPSV\r\n"
+                     " MDTM\r\n"
+                     " MODE Z\r\n"
+                     " REST STREAM\r\n"
+                     " SIZE\r\n"
+                     " MLST type*;size*;modify*;\r\n"
+                     " XCRC\r\n"
+                     " XSHA256\r\n"
+                     " HASH ");
+
+    // Only the algorithms this build has, the session's current one starred
+    bool first = true;
+    for (int i = Digest::ALGORITHM_COUNT; i-- > 0;) {
+        Digest::Algorithm algo = (Digest::Algorithm)i;
+        if (!Digest::available(algo)) continue;
+        n += snprintf(resp + n, sizeof(resp) - n, "%s%s%s", first ? "" : ";", Digest::name(algo),
+                      algo == c.hash_algo ? "*" : "");
+        first = false;
+    }
+    if (Digest::available(Digest::SHA1)) n += snprintf(resp + n, sizeof(resp) - n, "\r\n XSHA1");
+    if (Digest::available(Digest::MD5)) n += snprintf(resp + n, sizeof(resp) - n, "\r\n XMD5");
+    snprintf(resp + n, sizeof(resp) - n, "\r\n211 End\r\n");
+    send(c.client_sock, resp, strlen(resp), 0);
 }
 
 void FtpServer::ftp_cmd_type(Client &c, const char *args) {
@@ -136,6 +1109,20 @@ void FtpServer::ftp_cmd_type(Client &c, const char *args) {
     send(c.client_sock, resp, strlen(resp), 0);
 }
 
+void FtpServer::ftp_cmd_mode(Client &c, const char *args) {
+    const char *resp;
+    if (strcasecmp(args, "S") == 0) {
+        c.mode_z = false;
+        resp = "200 Mode set to S\r\n";
+    } else if (strcasecmp(args, "Z") == 0) {
+        c.mode_z = true;
+        resp = "200 Mode set to Z\r\n";
+    } else {
+        resp = "504 Mode not supported\r\n";
+    }
+    send(c.client_sock, resp, strlen(resp), 0);
+}
+
 void FtpServer::ftp_cmd_noop(Client &c, const char *args) {
     (void)args;
     const char *resp = "200 NOOP ok\r\n";
@@ -166,38 +1153,26 @@ void FtpServer::ftp_cmd_pasv(Client &c, const char *args) {
     (void)args;
     closeDataConnection(c);
 
-    c.pasv_listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-    if (c.pasv_listen_sock < 0) {
-        const char *resp = "421 Can't open passive socket\r\n";
+    if (c.epsv_all) {
+        const char *resp = "503 Only EPSV allowed after EPSV ALL\r\n";
         send(c.client_sock, resp, strlen(resp), 0);
         return;
     }
 
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = 0;
-
-    if (bind(c.pasv_listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
-        listen(c.pasv_listen_sock, 1) < 0) {
-        ESP_LOGE(TAG_FTP, "PASV setup failed");
-        close(c.pasv_listen_sock);
-        c.pasv_listen_sock = -1;
-        return;
-    }
-
-    struct sockaddr_in bound_addr;
-    socklen_t len = sizeof(bound_addr);
-    getsockname(c.pasv_listen_sock, (struct sockaddr *)&bound_addr, &len);
-    int port = ntohs(bound_addr.sin_port);
-
     struct sockaddr_in local_addr;
     socklen_t local_len = sizeof(local_addr);
     if (getsockname(c.client_sock, (struct sockaddr *)&local_addr, &local_len) < 0) {
         ESP_LOGE(TAG_FTP, "Failed to get local address for PASV");
-        close(c.pasv_listen_sock);
-        c.pasv_listen_sock = -1;
+        const char *resp = "425 Can't open passive connection\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    int port = leasePassivePort(c);
+    if (port < 0) {
+        ESP_LOGE(TAG_FTP, "No passive port free in %u-%u", pasv_port_min, pasv_port_max);
+        const char *resp = "425 Can't open passive connection\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
         return;
     }
 
@@ -215,6 +1190,34 @@ void FtpServer::ftp_cmd_pasv(Client &c, const char *args) {
     send(c.client_sock, resp, strlen(resp), 0);
 }
 
+void FtpServer::ftp_cmd_epsv(Client &c, const char *args) {
+    // RFC 2428: the reply carries only the port, the client reuses the control connection's address
+    if (strcasecmp(args, "ALL") == 0) {
+        c.epsv_all = true;
+        const char *resp = "200 EPSV ALL command successful\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+    if (args[0] && strcmp(args, "1") != 0) {
+        const char *resp = "522 Network protocol not supported, use (1)\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    closeDataConnection(c);
+    int port = leasePassivePort(c);
+    if (port < 0) {
+        ESP_LOGE(TAG_FTP, "No passive port free in %u-%u", pasv_port_min, pasv_port_max);
+        const char *resp = "425 Can't open passive connection\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    char resp[64];
+    snprintf(resp, sizeof(resp), "229 Entering Extended Passive Mode (|||%d|)\r\n", port);
+    send(c.client_sock, resp, strlen(resp), 0);
+}
+
 
 void FtpServer::ftp_cmd_port(Client &c, const char *args) {
     if (!args) {
@@ -230,6 +1233,12 @@ void FtpServer::ftp_cmd_port(Client &c, const char *args) {
         return;
     }
 
+    if (c.epsv_all) {
+        const char *resp = "503 Only EPSV allowed after EPSV ALL\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
     char ip[32];
     snprintf(ip, sizeof(ip), "%d.%d.%d.%d", h1, h2, h3, h4);
     int port = (p1 << 8) | p2;
@@ -251,6 +1260,7 @@ void FtpServer::ftp_cmd_port(Client &c, const char *args) {
 
     if (connect(c.pasv_data_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         ESP_LOGE(TAG_FTP, "Active connect failed to %s:%d", ip, port);
+        stats.socket_errors++;
         close(c.pasv_data_sock);
         c.pasv_data_sock = -1;
         const char *resp = "425 Can't connect to client\r\n";
@@ -268,33 +1278,14 @@ void FtpServer::ftp_cmd_cwd(Client &c, const char *args) {
         return;
     }
 
-    char newpath[256];
-    if (args[0] == '/') {
-        snprintf(newpath, sizeof(newpath), "%s%s", root_path, args);
-    } else {
-        snprintf(newpath, sizeof(newpath), "%s%s/%s", root_path,
-                 (c.cwd[0] ? c.cwd : ""), args);
-    }
-
+    char path[FTP_PATH_MAX];
+    const char *fs_path;
+    IFileSystem *fs = resolve(c, args, path, &fs_path);
     struct stat st;
-    if (stat(newpath, &st) == 0 && S_ISDIR(st.st_mode)) {
-        char newcwd[sizeof(c.cwd)];
+    if (fs && fs->stat(fs_path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        memcpy(c.cwd, path, sizeof(c.cwd));
 
-        if (args[0] == '/') {
-            snprintf(newcwd, sizeof(newcwd), "%s", args);
-        } else {
-            if (strcmp(c.cwd, "/") == 0) {
-                snprintf(newcwd, sizeof(newcwd), "/%s", args);
-            } else {
-                snprintf(newcwd, sizeof(newcwd), "%s/%s", c.cwd, args);
-            }
-        }
-
-        // ✅ Safe copy back into c.cwd
-        strncpy(c.cwd, newcwd, sizeof(c.cwd));
-        c.cwd[sizeof(c.cwd) - 1] = '\0';
-
-        char resp[256];
+        char resp[FTP_PATH_MAX + 48];
         snprintf(resp, sizeof(resp), "250 Directory successfully changed to %s\r\n", c.cwd);
         send(c.client_sock, resp, strlen(resp), 0);
     } else {
@@ -311,13 +1302,11 @@ void FtpServer::ftp_cmd_cdup(Client &c, const char *args) {
         send(c.client_sock, resp, strlen(resp), 0);
         return;
     }
-    char *slash = strrchr(c.cwd, '/');
-    if (!slash || slash == c.cwd) {
-        strcpy(c.cwd, "/");
-    } else {
-        *slash = '\0';
-    }
-    char resp[256];
+    char path[FTP_PATH_MAX];
+    normalizePath(c.cwd, "..", path, sizeof(path));
+    memcpy(c.cwd, path, sizeof(c.cwd));
+
+    char resp[FTP_PATH_MAX + 40];
     snprintf(resp, sizeof(resp), "250 Directory changed to %s\r\n", c.cwd);
     send(c.client_sock, resp, strlen(resp), 0);
 }
@@ -329,73 +1318,115 @@ void FtpServer::ftp_cmd_retr(Client &c, const char *args) {
         return;
     }
 
-    char fullpath[256];
-    snprintf(fullpath, sizeof(fullpath), "%s%s/%s", root_path,
-             c.cwd[0] ? c.cwd : "", args);
-    int fd = open(fullpath, O_RDONLY);
+    if (c.pasv_data_sock < 0 && c.pasv_listen_sock < 0) {
+        const char *resp = "425 Use PASV or PORT first\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    char path[FTP_PATH_MAX];
+    const char *fs_path;
+    IFileSystem *fs = resolve(c, args, path, &fs_path);
+    int fd = fs ? fs->open(fs_path, O_RDONLY) : -1;
     if (fd < 0) {
         const char *resp = "550 Failed to open file\r\n";
         send(c.client_sock, resp, strlen(resp), 0);
         return;
     }
 
-    const char *start = "150 Opening data connection\r\n";
-    send(c.client_sock, start, strlen(start), 0);
-    if (openDataConnection(c) < 0) {
-        const char *resp = "425 Can't open data connection\r\n";
+    // A REST marker applies to this transfer only
+    long rest = c.rest_offset;
+    c.rest_offset = 0;
+    struct stat st;
+    if (rest > 0 && (fs->fstat(fd, &st) != 0 || rest > st.st_size)) {
+        const char *resp = "554 Restart position beyond end of file\r\n";
         send(c.client_sock, resp, strlen(resp), 0);
-        close(fd);
+        fs->close(fd);
         return;
     }
 
-    char buf[512];
-    ssize_t n;
-    while ((n = read(fd, buf, sizeof(buf))) > 0) {
-        send(c.pasv_data_sock, buf, n, 0);
+    if (!beginTransfer(c, *fs, fd, false, rest)) {
+        const char *resp = "451 Local error in processing\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        fs->close(fd);
+        return;
     }
-    close(fd);
-    closeDataConnection(c);
 
-    const char *done = "226 Transfer complete\r\n";
-    send(c.client_sock, done, strlen(done), 0);
+    // The file is streamed by tick(), one chunk per data socket readiness event
+    const char *start = "150 Opening data connection\r\n";
+    send(c.client_sock, start, strlen(start), 0);
+}
+
+void FtpServer::ftp_cmd_stor(Client &c, const char *args) {
+    storeFile(c, args, false);
+}
+
+void FtpServer::ftp_cmd_appe(Client &c, const char *args) {
+    storeFile(c, args, true);
 }
 
-void FtpServer::ftp_cmd_stor(Client &c, const char *args) {
+void FtpServer::storeFile(Client &c, const char *args, bool append) {
     if (!args || strlen(args) == 0) {
         const char *resp = "550 File name required\r\n";
         send(c.client_sock, resp, strlen(resp), 0);
         return;
     }
 
-    char fullpath[256];
-    snprintf(fullpath, sizeof(fullpath), "%s%s/%s", root_path,
-             c.cwd[0] ? c.cwd : "", args);
-    int fd = open(fullpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (c.pasv_data_sock < 0 && c.pasv_listen_sock < 0) {
+        const char *resp = "425 Use PASV or PORT first\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    // REST and ALLO only apply to the transfer that follows them
+    long start = append ? 0 : c.rest_offset;
+    long alloc = c.alloc_size;
+    c.rest_offset = 0;
+    c.alloc_size = 0;
+
+    char path[FTP_PATH_MAX];
+    const char *fs_path;
+    IFileSystem *fs = resolve(c, args, path, &fs_path);
+    int flags = O_WRONLY | O_CREAT | (append || start > 0 ? 0 : O_TRUNC);
+    int fd = fs ? fs->open(fs_path, flags) : -1;
     if (fd < 0) {
         const char *resp = "550 Failed to create file\r\n";
         send(c.client_sock, resp, strlen(resp), 0);
         return;
     }
 
-    const char *start = "150 Opening data connection for upload\r\n";
-    send(c.client_sock, start, strlen(start), 0);
-    if (openDataConnection(c) < 0) {
-        const char *resp = "425 Can't open data connection\r\n";
+    struct stat st;
+    if (fs->fstat(fd, &st) != 0 || start > st.st_size) {
+        const char *resp = "554 Restart position beyond end of file\r\n";
         send(c.client_sock, resp, strlen(resp), 0);
-        close(fd);
+        fs->close(fd);
         return;
     }
+    if (append) start = st.st_size;
+
+    // Extending the file up front builds its FAT cluster chain once instead
+    // of growing it on every sector write. The unused tail is cut at the end.
+    bool preallocated = false;
+    if (alloc > st.st_size) {
+        preallocated = fs->ftruncate(fd, alloc) == 0;
+        if (!preallocated) ESP_LOGW(TAG_FTP, "ALLO %ld failed (errno=%d), writing without", alloc, errno);
+    }
 
-    char buf[512];
-    ssize_t n;
-    while ((n = recv(c.pasv_data_sock, buf, sizeof(buf), 0)) > 0) {
-        write(fd, buf, n);
+    listingCache.invalidateParent(path);
+    memcpy(c.xfer.path, path, sizeof(c.xfer.path));
+
+    if (!beginTransfer(c, *fs, fd, true, start)) {
+        const char *resp = "451 Local error in processing\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        fs->close(fd);
+        return;
     }
-    close(fd);
-    closeDataConnection(c);
+    // A restarted STOR overwrites in place and must not leave old bytes past its end
+    c.xfer.trim = preallocated || (!append && start > 0);
 
-    const char *done = "226 Transfer complete\r\n";
-    send(c.client_sock, done, strlen(done), 0);
+    // tick() receives into the upload buffers and writes them out sector by sector
+    const char *resp = "150 Opening data connection for upload\r\n";
+    send(c.client_sock, resp, strlen(resp), 0);
 }
 
 void FtpServer::ftp_cmd_dele(Client &c, const char *args) {
@@ -405,11 +1436,12 @@ void FtpServer::ftp_cmd_dele(Client &c, const char *args) {
         return;
     }
 
-    char fullpath[256];
-    snprintf(fullpath, sizeof(fullpath), "%s%s/%s", root_path,
-             c.cwd[0] ? c.cwd : "", args);
-
-    if (unlink(fullpath) == 0) {
+    char path[FTP_PATH_MAX];
+    const char *fs_path;
+    IFileSystem *fs = resolve(c, args, path, &fs_path);
+    if (fs && fs->unlink(fs_path) == 0) {
+        listingCache.invalidateParent(path);
+        hashCache.invalidate(path);
         char resp[256];
         snprintf(resp, sizeof(resp), "250 File deleted: %s\r\n", args);
         send(c.client_sock, resp, strlen(resp), 0);
@@ -426,11 +1458,13 @@ void FtpServer::ftp_cmd_rmd(Client &c, const char *args) {
         return;
     }
 
-    char fullpath[256];
-    snprintf(fullpath, sizeof(fullpath), "%s%s/%s", root_path,
-             c.cwd[0] ? c.cwd : "", args);
-
-    if (rmdir(fullpath) == 0) {
+    // The root of a filesystem, the served tree's or a mount's, stays
+    char path[FTP_PATH_MAX];
+    const char *fs_path;
+    IFileSystem *fs = resolve(c, args, path, &fs_path);
+    if (fs && strcmp(fs_path, "/") != 0 && fs->rmdir(fs_path) == 0) {
+        listingCache.invalidateParent(path);
+        listingCache.invalidate(path);
         char resp[256];
         snprintf(resp, sizeof(resp), "250 Directory removed: %s\r\n", args);
         send(c.client_sock, resp, strlen(resp), 0);
@@ -447,11 +1481,11 @@ void FtpServer::ftp_cmd_mkd(Client &c, const char *args) {
         return;
     }
 
-    char fullpath[256];
-    snprintf(fullpath, sizeof(fullpath), "%s%s/%s", root_path,
-             c.cwd[0] ? c.cwd : "", args);
-
-    if (mkdir(fullpath, 0755) == 0) {
+    char path[FTP_PATH_MAX];
+    const char *fs_path;
+    IFileSystem *fs = resolve(c, args, path, &fs_path);
+    if (fs && fs->mkdir(fs_path) == 0) {
+        listingCache.invalidateParent(path);
         char resp[256];
         snprintf(resp, sizeof(resp), "257 \"%s\" directory created\r\n", args);
         send(c.client_sock, resp, strlen(resp), 0);
@@ -468,12 +1502,11 @@ void FtpServer::ftp_cmd_size(Client &c, const char *args) {
         return;
     }
 
-    char fullpath[256];
-    snprintf(fullpath, sizeof(fullpath), "%s%s/%s", root_path,
-             c.cwd[0] ? c.cwd : "", args);
-
+    char path[FTP_PATH_MAX];
+    const char *fs_path;
+    IFileSystem *fs = resolve(c, args, path, &fs_path);
     struct stat st;
-    if (stat(fullpath, &st) == 0 && S_ISREG(st.st_mode)) {
+    if (fs && fs->stat(fs_path, &st) == 0 && S_ISREG(st.st_mode)) {
         char resp[64];
         snprintf(resp, sizeof(resp), "213 %ld\r\n", (long)st.st_size);
         send(c.client_sock, resp, strlen(resp), 0);
@@ -490,14 +1523,11 @@ void FtpServer::ftp_cmd_mdtm(Client &c, const char *args) {
         return;
     }
 
-    char fullpath[256];
-    snprintf(fullpath, sizeof(fullpath), "%s%s/%s",
-             root_path,
-             c.cwd[0] ? c.cwd : "",
-             args);
-
+    char path[FTP_PATH_MAX];
+    const char *fs_path;
+    IFileSystem *fs = resolve(c, args, path, &fs_path);
     struct stat st;
-    if (stat(fullpath, &st) == 0 && S_ISREG(st.st_mode)) {
+    if (fs && fs->stat(fs_path, &st) == 0 && S_ISREG(st.st_mode)) {
         struct tm *tm_info = gmtime(&st.st_mtime);
         char resp[64];
         strftime(resp, sizeof(resp), "213 %Y%m%d%H%M%S\r\n", tm_info);
@@ -508,47 +1538,320 @@ void FtpServer::ftp_cmd_mdtm(Client &c, const char *args) {
     }
 }
 
-const FtpServer::CommandEntry FtpServer::cmdTable[] = {
-    {"USER", &FtpServer::ftp_cmd_user},
-    {"PASS", &FtpServer::ftp_cmd_pass},
-    {"SYST", &FtpServer::ftp_cmd_syst},
-    {"QUIT", &FtpServer::ftp_cmd_quit},
-    {"PWD",  &FtpServer::ftp_cmd_pwd},
-    {"XPWD", &FtpServer::ftp_cmd_pwd},
-    {"TYPE", &FtpServer::ftp_cmd_type},
-    {"NOOP", &FtpServer::ftp_cmd_noop},
-    {"AUTH", &FtpServer::ftp_cmd_auth},
-    {"PASV", &FtpServer::ftp_cmd_pasv},
-    {"LIST", &FtpServer::ftp_cmd_list},
-    {"CWD",  &FtpServer::ftp_cmd_cwd},
-    {"CDUP", &FtpServer::ftp_cmd_cdup},
-    {"RETR", &FtpServer::ftp_cmd_retr},
-    {"STOR", &FtpServer::ftp_cmd_stor},
-    {"DELE", &FtpServer::ftp_cmd_dele},
-    {"RMD",  &FtpServer::ftp_cmd_rmd},
-    {"MKD",  &FtpServer::ftp_cmd_mkd},
-    {"SIZE", &FtpServer::ftp_cmd_size},
-    {"MDTM", &FtpServer::ftp_cmd_mdtm},
-    {"PORT", &FtpServer::ftp_cmd_port},
-    {NULL,   NULL}
+void FtpServer::ftp_cmd_rnfr(Client &c, const char *args) {
+    if (!args || strlen(args) == 0) {
+        const char *resp = "501 No filename given\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    char path[FTP_PATH_MAX];
+    const char *fs_path;
+    IFileSystem *fs = resolve(c, args, path, &fs_path);
+    struct stat st;
+    if (!fs || fs->stat(fs_path, &st) != 0) {
+        const char *resp = "550 File not found\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+    memcpy(c.rename_from, path, sizeof(c.rename_from));
+    const char *resp = "350 Ready for RNTO\r\n";
+    send(c.client_sock, resp, strlen(resp), 0);
+}
+
+void FtpServer::ftp_cmd_rnto(Client &c, const char *args) {
+    if (!c.rename_from[0]) {
+        const char *resp = "503 RNFR required first\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+    if (!args || strlen(args) == 0) {
+        c.rename_from[0] = 0;
+        const char *resp = "501 No filename given\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    char from[FTP_PATH_MAX], to[FTP_PATH_MAX];
+    const char *src_path, *dst_path;
+    IFileSystem *src_fs = resolve(c, c.rename_from, from, &src_path);
+    IFileSystem *dst_fs = resolve(c, args, to, &dst_path);
+    c.rename_from[0] = 0;
+    if (!dst_fs || src_fs != dst_fs) {
+        // Moving between mounts would be a copy; SITE COPY and DELE do that explicitly
+        const char *resp = dst_fs ? "553 Can't rename across filesystems\r\n" : "553 Invalid target name\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    struct stat st;
+    bool is_dir = src_fs->stat(src_path, &st) == 0 && S_ISDIR(st.st_mode);
+    if (strcmp(src_path, "/") == 0 || strcmp(dst_path, "/") == 0 || src_fs->rename(src_path, dst_path) != 0) {
+        const char *resp = "550 Rename failed\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    // Everything cached below a moved directory is stale, and only the caches know what that is
+    if (is_dir) {
+        listingCache.clear();
+        hashCache.clear();
+    } else {
+        listingCache.invalidateParent(from);
+        listingCache.invalidateParent(to);
+        hashCache.invalidate(from);
+        hashCache.invalidate(to);
+    }
+    const char *resp = "250 Rename successful\r\n";
+    send(c.client_sock, resp, strlen(resp), 0);
+}
+
+void FtpServer::ftp_cmd_abor(Client &c, const char *args) {
+    (void)args;
+    if (c.hash) endHash(c, "426 Hash aborted\r\n");
+    if (c.copy) endCopy(c, "426 Copy aborted\r\n");
+    if (c.xfer.state != Transfer::IDLE) {
+        endTransfer(c, "426 Transfer aborted\r\n");
+    } else {
+        closeDataConnection(c);
+    }
+    const char *resp = "226 ABOR command successful\r\n";
+    send(c.client_sock, resp, strlen(resp), 0);
+}
+
+void FtpServer::ftp_cmd_rest(Client &c, const char *args) {
+    char *end;
+    long offset = strtol(args, &end, 10);
+    if (!args[0] || *end || offset < 0) {
+        const char *resp = "501 Invalid restart position\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    c.rest_offset = offset;
+    char resp[96];
+    snprintf(resp, sizeof(resp), "350 Restarting at %ld. Send RETR or STOR to resume\r\n", offset);
+    send(c.client_sock, resp, strlen(resp), 0);
+}
+
+void FtpServer::ftp_cmd_allo(Client &c, const char *args) {
+    // "ALLO <size> [R <record size>]", records mean nothing to a byte stream
+    char *end;
+    long size = strtol(args, &end, 10);
+    if (!args[0] || (*end && *end != ' ') || size < 0) {
+        const char *resp = "501 Invalid allocation size\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    c.alloc_size = size;
+    const char *resp = "200 ALLO command successful\r\n";
+    send(c.client_sock, resp, strlen(resp), 0);
+}
+
+void FtpServer::ftp_cmd_site(Client &c, const char *args) {
+    if (strcasecmp(args, "STATS") == 0) {
+        // One JSON line inside a multi-line reply; it starts with '{' so it can't end the reply
+        SocketSink sink(c.client_sock);
+        FixedBufferedStream<256> out(sink);
+        const char *head = "211-FTP statistics\r\n";
+        out.write(head, strlen(head));
+        writeStats(out);
+        out.write("\r\n211 End\r\n", 11);
+        out.flush();
+        if (out.failed()) {
+            ESP_LOGW(TAG_FTP, "SITE STATS reply cut short (errno=%d)", errno);
+            stats.socket_errors++;
+        }
+        return;
+    }
+    if (strncasecmp(args, "COPY ", 5) == 0) {
+        startCopy(c, args + 5);
+        return;
+    }
+
+    const char *resp = "504 SITE command not implemented for that parameter\r\n";
+    send(c.client_sock, resp, strlen(resp), 0);
+}
+
+void FtpServer::ftp_cmd_opts(Client &c, const char *args) {
+    if (strncasecmp(args, "HASH", 4) == 0 && (args[4] == 0 || args[4] == ' ')) {
+        // "OPTS HASH" reports the session's algorithm, "OPTS HASH <name>" selects it
+        const char *name = args + 4;
+        while (*name == ' ') name++;
+        Digest::Algorithm algo = c.hash_algo;
+        if (name[0] && (!Digest::parse(name, &algo) || !Digest::available(algo))) {
+            const char *resp = "501 Unknown or unsupported hash algorithm\r\n";
+            send(c.client_sock, resp, strlen(resp), 0);
+            return;
+        }
+        c.hash_algo = algo;
+        char resp[32];
+        snprintf(resp, sizeof(resp), "200 %s\r\n", Digest::name(algo));
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    const char *resp = "501 Option not understood\r\n";
+    send(c.client_sock, resp, strlen(resp), 0);
+}
+
+void FtpServer::ftp_cmd_hash(Client &c, const char *args) {
+    startHash(c, args, c.hash_algo, false);
+}
+
+void FtpServer::ftp_cmd_rang(Client &c, const char *args) {
+    // "RANG <start> <end>", both inclusive; "RANG 1 0" clears it. Applies to the next HASH.
+    long start, end;
+    char tail;
+    if (sscanf(args, "%ld %ld%c", &start, &end, &tail) != 2 || start < 0 || end < 0) {
+        const char *resp = "501 Invalid range\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+    if (start == 1 && end == 0) {
+        c.rang_set = false;
+        const char *resp = "350 Restarting at 0. Ending byte is EOF\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+    if (start > end) {
+        const char *resp = "501 Invalid range\r\n";
+        send(c.client_sock, resp, strlen(resp), 0);
+        return;
+    }
+
+    c.rang_set = true;
+    c.rang_start = start;
+    c.rang_end = end;
+    char resp[96];
+    snprintf(resp, sizeof(resp), "350 Restarting at %ld. Ending byte is %ld\r\n", start, end);
+    send(c.client_sock, resp, strlen(resp), 0);
+}
+
+void FtpServer::ftp_cmd_xcrc(Client &c, const char *args) {
+    startHash(c, args, Digest::CRC32, true);
+}
+
+void FtpServer::ftp_cmd_xmd5(Client &c, const char *args) {
+    startHash(c, args, Digest::MD5, true);
+}
+
+void FtpServer::ftp_cmd_xsha1(Client &c, const char *args) {
+    startHash(c, args, Digest::SHA1, true);
+}
+
+void FtpServer::ftp_cmd_xsha256(Client &c, const char *args) {
+    startHash(c, args, Digest::SHA256, true);
+}
+
+constexpr FtpServer::CommandEntry FtpServer::cmdTable[] = {
+    {"USER", &FtpServer::ftp_cmd_user, CMD_NONE},
+    {"PASS", &FtpServer::ftp_cmd_pass, CMD_NONE},
+    {"SYST", &FtpServer::ftp_cmd_syst, CMD_NONE},
+    {"QUIT", &FtpServer::ftp_cmd_quit, CMD_NONE},
+    {"PWD",  &FtpServer::ftp_cmd_pwd,  CMD_NONE},
+    {"XPWD", &FtpServer::ftp_cmd_pwd,  CMD_NONE},
+    {"TYPE", &FtpServer::ftp_cmd_type, CMD_NONE},
+    {"MODE", &FtpServer::ftp_cmd_mode, CMD_NONE},
+    {"NOOP", &FtpServer::ftp_cmd_noop, CMD_NONE},
+    {"AUTH", &FtpServer::ftp_cmd_auth, CMD_NONE},
+    {"PASV", &FtpServer::ftp_cmd_pasv, CMD_DATA},
+    {"EPSV", &FtpServer::ftp_cmd_epsv, CMD_DATA},
+    {"LIST", &FtpServer::ftp_cmd_list, CMD_DATA},
+    {"CWD",  &FtpServer::ftp_cmd_cwd,  CMD_NONE},
+    {"CDUP", &FtpServer::ftp_cmd_cdup, CMD_NONE},
+    {"RETR", &FtpServer::ftp_cmd_retr, CMD_DATA},
+    {"STOR", &FtpServer::ftp_cmd_stor, CMD_DATA},
+    {"DELE", &FtpServer::ftp_cmd_dele, CMD_NONE},
+    {"RMD",  &FtpServer::ftp_cmd_rmd,  CMD_NONE},
+    {"MKD",  &FtpServer::ftp_cmd_mkd,  CMD_NONE},
+    {"SIZE", &FtpServer::ftp_cmd_size, CMD_NONE},
+    {"MDTM", &FtpServer::ftp_cmd_mdtm, CMD_NONE},
+    {"PORT", &FtpServer::ftp_cmd_port, CMD_DATA},
+    {"ABOR", &FtpServer::ftp_cmd_abor, CMD_NONE},
+    {"FEAT", &FtpServer::ftp_cmd_feat, CMD_NONE},
+    {"MLSD", &FtpServer::ftp_cmd_mlsd, CMD_DATA},
+    {"MLST", &FtpServer::ftp_cmd_mlst, CMD_NONE},
+    {"REST", &FtpServer::ftp_cmd_rest, CMD_NONE},
+    {"APPE", &FtpServer::ftp_cmd_appe, CMD_DATA},
+    {"ALLO", &FtpServer::ftp_cmd_allo, CMD_NONE},
+    {"SITE", &FtpServer::ftp_cmd_site, CMD_NONE},
+    {"OPTS", &FtpServer::ftp_cmd_opts, CMD_NONE},
+    {"HASH", &FtpServer::ftp_cmd_hash, CMD_NONE},
+    {"RANG", &FtpServer::ftp_cmd_rang, CMD_NONE},
+    {"XCRC", &FtpServer::ftp_cmd_xcrc, CMD_NONE},
+    {"XMD5", &FtpServer::ftp_cmd_xmd5, CMD_NONE},
+    {"XSHA1", &FtpServer::ftp_cmd_xsha1, CMD_NONE},
+    {"XSHA256", &FtpServer::ftp_cmd_xsha256, CMD_NONE},
+    {"RNFR", &FtpServer::ftp_cmd_rnfr, CMD_NONE},
+    {"RNTO", &FtpServer::ftp_cmd_rnto, CMD_NONE},
 };
 
+constexpr size_t FtpServer::cmdCount = sizeof(cmdTable) / sizeof(cmdTable[0]);
+
+constexpr FtpServer::CommandHash FtpServer::buildCommandHash() {
+    static_assert(cmdCount * 2 <= (1 << CMD_HASH_BITS),
+                  "Command table too dense for the dispatch hash, raise CMD_HASH_BITS");
+    static_assert(cmdCount <= FTP_STATS_VERBS, "Raise FTP_STATS_VERBS to cover the command table");
+
+    // Try odd multipliers from an LCG sequence until every verb lands in its own slot
+    for (uint64_t mult = 0x9E3779B97F4A7C15ull; ; mult = (mult * 6364136223846793005ull + 1442695040888963407ull) | 1) {
+        CommandHash h = {};
+        h.mult = mult;
+        for (size_t s = 0; s < (1 << CMD_HASH_BITS); s++) h.index[s] = CMD_HASH_EMPTY;
+
+        bool collision = false;
+        for (size_t i = 0; i < cmdCount && !collision; i++) {
+            uint64_t key = commandKey(cmdTable[i].cmd, __builtin_strlen(cmdTable[i].cmd));
+            uint32_t slot = (uint32_t)((key * mult) >> (64 - CMD_HASH_BITS));
+            collision = h.index[slot] != CMD_HASH_EMPTY;
+            h.keys[slot] = key;
+            h.index[slot] = (uint8_t)i;
+        }
+        if (!collision) return h;
+    }
+}
+
+constexpr FtpServer::CommandHash FtpServer::cmdHash = buildCommandHash();
+
 
 /* ==== Public methods ==== */
-FtpServer::FtpServer(const char *root) : listen_sock(-1) {
-    memset(root_path, 0, sizeof(root_path));
-    snprintf(root_path, sizeof(root_path), "%s", root);
+FtpServer::FtpServer(const char *root) : FtpServer(posixRoot) {
+    posixRoot.setRoot(root);
+}
 
-    for (int i = 0; i < FTP_MAX_CLIENTS; i++) {
-        clients[i].client_sock = -1;
-        clients[i].pasv_listen_sock = -1;
-        clients[i].pasv_data_sock = -1;
-        snprintf(clients[i].cwd, sizeof(clients[i].cwd), "/");
-        clients[i].active = false;
-    }
+FtpServer::FtpServer(IFileSystem &root)
+    : listen_sock(-1), mount_count(1), pasv_port_min(FTP_PASV_PORT_MIN), pasv_port_max(FTP_PASV_PORT_MAX),
+      max_clients(FTP_MAX_CLIENTS), clients(nullptr), pasvPool(nullptr), pollFds(nullptr),
+      pollSlots(nullptr), buffer_bytes(0), buffer_peak(0), session_bps(0),
+      zero_copy(FTP_RETR_ZERO_COPY), pasv_pool(FTP_PASV_POOL), rr_next(0), wake_fd(-1),
+      stopping(false), running(false) {
+    mounts[0] = {};
+    mounts[0].fs = &root;
+
+    // Sessions and their tables are allocated by init(), nothing per client is held before that
+    stats = {};
+    setRateLimits(FTP_RATE_GLOBAL_BPS, FTP_RATE_SESSION_BPS);
+}
+
+bool FtpServer::mount(const char *path, IFileSystem &fs) {
+    LOCK(mutex);
+    if (mount_count > FTP_VFS_MOUNTS) return false;
+
+    // Stored normalized so resolve() can compare it with command paths as is
+    Mount &m = mounts[mount_count];
+    if (!normalizePath("/", path, m.path, sizeof(m.path)) || strcmp(m.path, "/") == 0) return false;
+    m.len = strlen(m.path);
+    m.fs = &fs;
+    mount_count++;
+    ESP_LOGI(TAG_FTP, "Mounted filesystem at %s", m.path);
+    return true;
 }
 
 FtpServer::~FtpServer() {
+    stop();
+
     // Close listening socket
     if (listen_sock >= 0) {
         close(listen_sock);
@@ -556,27 +1859,139 @@ FtpServer::~FtpServer() {
     }
 
     // Close all client sockets and data connections
-    for (int i = 0; i < FTP_MAX_CLIENTS; i++) {
-        Client &c = clients[i];
-        if (c.client_sock >= 0) {
-            close(c.client_sock);
-            c.client_sock = -1;
-        }
-        if (c.pasv_listen_sock >= 0) {
-            close(c.pasv_listen_sock);
-            c.pasv_listen_sock = -1;
-        }
-        if (c.pasv_data_sock >= 0) {
-            close(c.pasv_data_sock);
-            c.pasv_data_sock = -1;
-        }
+    for (int i = 0; clients && i < max_clients; i++) {
+        if (clients[i]) closeClient(*clients[i]);
+    }
+    releaseClosedClients();
+
+    // Passive listeners belong to the pool, not to the clients that leased them
+    for (int i = 0; pasvPool && i < max_clients; i++) {
+        if (pasvPool[i].sock >= 0) close(pasvPool[i].sock);
     }
 
+    free(clients);
+    free(pasvPool);
+    free(pollFds);
+    free(pollSlots);
+    sessionPool.destroy();
+
     ESP_LOGI(TAG_FTP, "FTP server shut down");
 }
 
 
+void FtpServer::writeStats(Stream &out) const {
+    LOCK(mutex);
+    long long now = monotonicMs();
+    JsonObjectWriter::create(out, [&](JsonObjectWriter &root) {
+        root.field("sessions", (uint64_t)stats.sessions);
+        root.field("rejected", (uint64_t)stats.rejected);
+        root.field("socket_errors", (uint64_t)stats.socket_errors);
+        root.field("file_errors", (uint64_t)stats.file_errors);
+        root.field("commands", (uint64_t)stats.commands);
+        root.field("unknown_commands", (uint64_t)stats.unknown_commands);
+        MemoryStats mem = getMemoryStats();
+        root.withObject("memory", [&](JsonObjectWriter &o) {
+            o.field("fixed", (uint64_t)mem.fixed);
+            o.field("session_bytes", (uint64_t)mem.session_bytes);
+            o.field("sessions", (uint64_t)mem.sessions);
+            o.field("sessions_peak", (uint64_t)mem.sessions_peak);
+            o.field("sessions_max", (uint64_t)mem.sessions_max);
+            o.field("buffers", (uint64_t)mem.buffers);
+            o.field("buffers_peak", (uint64_t)mem.buffers_peak);
+            o.field("listing_cache", (uint64_t)mem.listing_cache);
+        });
+        root.withObject("in", [&](JsonObjectWriter &o) { stats.in.write(o); });
+        root.withObject("out", [&](JsonObjectWriter &o) { stats.out.write(o); });
+
+        // Microseconds spent in each handler, only for verbs that were used
+        root.withObject("verb_us", [&](JsonObjectWriter &verbs) {
+            for (size_t i = 0; i < cmdCount; i++) {
+                if (stats.verb_us[i].count == 0) continue;
+                verbs.withObject(cmdTable[i].cmd, [&](JsonObjectWriter &h) { stats.verb_us[i].write(h); });
+            }
+        });
+
+        const ListingCache::Stats &lc = listingCache.stats();
+        root.withObject("listing_cache", [&](JsonObjectWriter &o) {
+            o.field("hits", (uint64_t)lc.hits);
+            o.field("misses", (uint64_t)lc.misses);
+            o.field("stores", (uint64_t)lc.stores);
+            o.field("invalidations", (uint64_t)lc.invalidations);
+            o.field("evictions", (uint64_t)lc.evictions);
+            o.field("bytes", (uint64_t)listingCache.bytes());
+        });
+
+        const HashCache::Stats &hc = hashCache.stats();
+        root.withObject("hash_cache", [&](JsonObjectWriter &o) {
+            o.field("hits", (uint64_t)hc.hits);
+            o.field("misses", (uint64_t)hc.misses);
+            o.field("stores", (uint64_t)hc.stores);
+            o.field("invalidations", (uint64_t)hc.invalidations);
+        });
+
+        root.withArray("clients", [&](JsonArrayWriter &arr) {
+            for (int i = 0; i < max_clients; i++) {
+                if (!clients[i] || clients[i]->client_sock < 0) continue;
+                const Client &c = *clients[i];
+                arr.withObject([&](JsonObjectWriter &o) {
+                    o.field("slot", (int64_t)i);
+                    o.field("connected_ms", (int64_t)(now - c.stats.connected_ms));
+                    o.field("commands", (uint64_t)c.stats.commands);
+                    o.field("transfers", (uint64_t)c.stats.transfers);
+                    o.field("bytes_in", c.stats.bytes_in);
+                    o.field("bytes_out", c.stats.bytes_out);
+                    o.field("transferring", c.xfer.state != Transfer::IDLE);
+                });
+            }
+        });
+    });
+}
+
+void FtpServer::resetStats() {
+    LOCK(mutex);
+    stats = {};
+    buffer_peak = buffer_bytes;
+}
+
+FtpServer::MemoryStats FtpServer::getMemoryStats() const {
+    LOCK(mutex);
+    MemoryStats m = {};
+    size_t tables = max_clients * (sizeof(Client *) + sizeof(PassivePort)) +
+                    (2 + max_clients * 3) * (sizeof(struct pollfd) + sizeof(PollSlot));
+    m.fixed = sizeof(*this) + (clients ? tables + sessionPool.bytes() : 0);
+    m.session_bytes = sessionPool.blockSize();
+    m.sessions = sessionPool.used();
+    m.sessions_peak = sessionPool.peak();
+    m.sessions_max = max_clients;
+    m.buffers = buffer_bytes;
+    m.buffers_peak = buffer_peak;
+    m.listing_cache = listingCache.bytes();
+    return m;
+}
+
+void FtpServer::setMaxClients(int count) {
+    if (clients || count < 1) return;   // The pool is sized once, by init()
+    max_clients = count;
+}
+
+void FtpServer::setPassivePorts(uint16_t first, uint16_t last) {
+    pasv_port_min = first;
+    pasv_port_max = last;
+}
+
 bool FtpServer::init() {
+    // Sessions come out of one fixed-block pool; connecting and disconnecting never touch the heap
+    int nfds = 2 + max_clients * 3;
+    clients = (Client **)calloc(max_clients, sizeof(Client *));
+    pasvPool = (PassivePort *)calloc(max_clients, sizeof(PassivePort));
+    pollFds = (struct pollfd *)calloc(nfds, sizeof(struct pollfd));
+    pollSlots = (PollSlot *)calloc(nfds, sizeof(PollSlot));
+    if (!clients || !pasvPool || !pollFds || !pollSlots ||
+        !sessionPool.create(sizeof(Client), max_clients)) {
+        ESP_LOGE(TAG_FTP, "No memory for %d sessions", max_clients);
+        return false;
+    }
+
     listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
     if (listen_sock < 0) {
         ESP_LOGE(TAG_FTP, "Unable to create socket");
@@ -598,7 +2013,7 @@ bool FtpServer::init() {
         return false;
     }
 
-    if (listen(listen_sock, FTP_MAX_CLIENTS) < 0) {
+    if (listen(listen_sock, max_clients) < 0) {
         ESP_LOGE(TAG_FTP, "Socket listen failed");
         close(listen_sock);
         return false;
@@ -607,76 +2022,444 @@ bool FtpServer::init() {
     int flags = fcntl(listen_sock, F_GETFL, 0);
     fcntl(listen_sock, F_SETFL, flags | O_NONBLOCK);
 
-    ESP_LOGI(TAG_FTP, "FTP server started on port %d, root=%s",
-             FTP_CTRL_PORT, root_path);
+    openPassivePool();
+
+    MemoryStats mem = getMemoryStats();
+    ESP_LOGI(TAG_FTP, "FTP server started on port %d, passive ports %u-%u, root=%s",
+             FTP_CTRL_PORT, pasv_port_min, pasv_port_max,
+             mounts[0].fs == &posixRoot ? posixRoot.getRoot() : "(custom)");
+    ESP_LOGI(TAG_FTP, "%d sessions x %u bytes, %u bytes held while idle",
+             max_clients, (unsigned)mem.session_bytes, (unsigned)mem.fixed);
     return true;
 }
 
-void FtpServer::tick() {
-    // === Accept new clients ===
+int FtpServer::buildPollSet(struct pollfd *fds, PollSlot *slots) {
+    int n = 0;
+
+    fds[n] = { listen_sock, POLLIN, 0 };
+    slots[n++] = { nullptr, PollSlot::LISTEN };
+    if (wake_fd >= 0) {
+        fds[n] = { wake_fd, POLLIN, 0 };
+        slots[n++] = { nullptr, PollSlot::WAKE };
+    }
+
+    for (int i = 0; i < max_clients; i++) {
+        if (!clients[i] || clients[i]->client_sock < 0) continue;
+        Client &c = *clients[i];
+
+        // A full line buffer waits for the deferred commands to drain first
+        if (c.buffer_len < sizeof(c.buffer) - 1) {
+            fds[n] = { c.client_sock, POLLIN, 0 };
+            slots[n++] = { &c, PollSlot::CONTROL };
+        }
+
+        if (c.pasv_data_sock < 0 && c.pasv_listen_sock >= 0) {
+            fds[n] = { c.pasv_listen_sock, POLLIN, 0 };
+            slots[n++] = { &c, PollSlot::PASV_LISTEN };
+        }
+        // Out of tokens: leave the socket alone, pollTimeout() wakes us for the refill
+        bool moving = c.xfer.state == Transfer::SENDING || c.xfer.state == Transfer::RECEIVING;
+        if (moving && isThrottled(c)) continue;
+
+        if (c.xfer.state == Transfer::SENDING) {
+            fds[n] = { c.pasv_data_sock, POLLOUT, 0 };
+            slots[n++] = { &c, PollSlot::DATA };
+        } else if (c.xfer.state == Transfer::RECEIVING) {
+            // Both upload buffers full: stop reading and let TCP push back on the client
+            if (c.xfer.flush_pending && c.xfer.buf_len[c.xfer.fill] == FTP_STOR_BUFFER_SIZE) continue;
+            fds[n] = { c.pasv_data_sock, POLLIN, 0 };
+            slots[n++] = { &c, PollSlot::DATA };
+        } else if (c.pasv_data_sock >= 0 && !c.data_pending) {
+            fds[n] = { c.pasv_data_sock, POLLIN, 0 };
+            slots[n++] = { &c, PollSlot::DATA };
+        }
+    }
+    return n;
+}
+
+void FtpServer::acceptClient() {
     struct sockaddr_in6 source_addr;
     socklen_t addr_len = sizeof(source_addr);
     int new_sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
-    if (new_sock >= 0) {
-        int assigned = 0;
-        for (int i = 0; i < FTP_MAX_CLIENTS; i++) {
-            if (clients[i].client_sock < 0) {
-                Client &c = clients[i];
-                c.client_sock = new_sock;
-                c.active = true;
-                c.pasv_listen_sock = -1;
-                c.pasv_data_sock = -1;
-                snprintf(c.cwd, sizeof(c.cwd), "/");
-
-                const char *welcome = "220 ESP32 FTP Server Ready\r\n";
-                send(new_sock, welcome, strlen(welcome), 0);
-                assigned = 1;
-                break;
-            }
-        }
-        if (!assigned) {
-            ESP_LOGW(TAG_FTP, "Too many clients, rejecting");
-            close(new_sock);
+    if (new_sock < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            ESP_LOGE(TAG_FTP, "accept() error: %d", errno);
+            stats.socket_errors++;
         }
+        return;
+    }
+
+    for (int i = 0; i < max_clients; i++) {
+        if (clients[i]) continue;
+        void *block = sessionPool.allocate();
+        if (!block) break;
+
+        // Value-initialised: every counter, length and flag starts at zero
+        Client &c = *new (block) Client();
+        clients[i] = &c;
+        c.slot = i;
+        // Replies are small and often back to back (150 then 226): don't let
+        // Nagle hold the second one until the client's delayed ACK arrives
+        int nodelay = 1;
+        setsockopt(new_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        c.client_sock = new_sock;
+        c.active = true;
+        c.pasv_listen_sock = -1;
+        c.pasv_data_sock = -1;
+        c.xfer.state = Transfer::IDLE;
+        c.xfer.fs = nullptr;
+        c.xfer.fd = -1;
+        c.xfer.cache_handle = -1;
+        c.hash_algo = Digest::SHA256;
+        c.bucket.setRate(session_bps, FTP_TRANSFER_CHUNK, monotonicMs());
+        c.stats.connected_ms = monotonicMs();
+        c.last_activity_ms = c.stats.connected_ms;
+        stats.sessions++;
+        snprintf(c.cwd, sizeof(c.cwd), "/");
+
+        const char *welcome = "220 ESP32 FTP Server Ready\r\n";
+        send(new_sock, welcome, strlen(welcome), 0);
+        return;
+    }
+
+    ESP_LOGW(TAG_FTP, "Too many clients, rejecting");
+    stats.rejected++;
+    close(new_sock);
+}
+
+void FtpServer::closeClient(Client &c) {
+    if (c.xfer.state != Transfer::IDLE) {
+        endTransfer(c, nullptr);
+    }
+    if (c.hash) endHash(c, nullptr);
+    if (c.copy) endCopy(c, nullptr);
+    c.buffer_len = 0;
+    c.cmd_deferred = false;
+    c.discard_line = false;
+    if (c.client_sock >= 0) close(c.client_sock);
+    c.client_sock = -1;
+    c.active = false;
+    closeDataConnection(c);
+}
+
+void FtpServer::releaseClosedClients() {
+    // Closed sessions go back to the pool only here, at the end of a tick, so
+    // poll slots and handlers earlier in the tick never see a freed Client
+    for (int i = 0; clients && i < max_clients; i++) {
+        Client *c = clients[i];
+        if (!c || c->client_sock >= 0) continue;
+        clients[i] = nullptr;
+        c->~Client();
+        sessionPool.release(c);
+    }
+}
+
+void FtpServer::handleControl(Client &c) {
+    // Append to whatever partial line is left over from the previous segment
+    size_t space = sizeof(c.buffer) - 1 - c.buffer_len;
+    int len = recv(c.client_sock, c.buffer + c.buffer_len, space, MSG_DONTWAIT);
+    if (len > 0) {
+        c.last_activity_ms = monotonicMs();
+        c.buffer_len += len;
+        c.buffer[c.buffer_len] = 0;
+        processCommands(c);
+    } else if (len == 0) {
+        closeClient(c);
     } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
-        ESP_LOGE(TAG_FTP, "accept() error: %d", errno);
-    }
-
-    // === Process existing clients ===
-    for (int i = 0; i < FTP_MAX_CLIENTS; i++) {
-        Client &c = clients[i];
-        if (c.client_sock < 0) continue;
-
-        int len = recv(c.client_sock, c.buffer, sizeof(c.buffer) - 1, MSG_DONTWAIT);
-        if (len > 0) {
-            c.buffer[len] = 0;
-            char *cmd = strtok(c.buffer, " \r\n");
-            char *args = strtok(NULL, "\r\n");
-            if (!cmd) continue;
-
-            const CommandEntry *entry = cmdTable;
-            while (entry->cmd) {
-                if (strcasecmp(entry->cmd, cmd) == 0) {
-                    (this->*entry->handler)(c, args ? args : "");
-                    break;
-                }
-                entry++;
-            }
-            if (!entry->cmd) {
-                const char *resp = "502 Command not implemented\r\n";
+        ESP_LOGW(TAG_FTP, "Client %d socket error (errno=%d)", c.slot, errno);
+        stats.socket_errors++;
+        closeClient(c);
+    }
+}
+
+const FtpServer::CommandEntry *FtpServer::findCommand(const char *cmd, size_t len) {
+    uint64_t key = commandKey(cmd, len);
+    uint32_t slot = (uint32_t)((key * cmdHash.mult) >> (64 - CMD_HASH_BITS));
+    uint8_t index = cmdHash.index[slot];
+    if (index == CMD_HASH_EMPTY || cmdHash.keys[slot] != key) return nullptr;
+    return &cmdTable[index];
+}
+
+size_t FtpServer::commandCount() {
+    return cmdCount;
+}
+
+const char *FtpServer::commandName(size_t index) {
+    return index < cmdCount ? cmdTable[index].cmd : nullptr;
+}
+
+int FtpServer::commandIndex(const char *cmd, size_t len) {
+    const CommandEntry *entry = findCommand(cmd, len);
+    return entry ? (int)(entry - cmdTable) : -1;
+}
+
+void FtpServer::processCommands(Client &c) {
+    // Runs every complete line in order. A pipelined command that needs the
+    // data connection stays buffered until the running transfer is done, and
+    // every command waits for a running HASH or SITE COPY.
+    char *line = c.buffer;
+    char *end = c.buffer + c.buffer_len;
+    c.cmd_deferred = false;
+
+    while (line < end) {
+        char *eol = (char *)memchr(line, '\n', end - line);
+        if (!eol) break;
+
+        if (c.discard_line) {
+            // Tail of a line that overflowed the buffer and was already rejected
+            c.discard_line = false;
+            line = eol + 1;
+            continue;
+        }
+
+        size_t cmd_len = strcspn(line, " \r\n");
+        const CommandEntry *entry = findCommand(line, cmd_len);
+        if (entry && (entry->flags & CMD_DATA) && c.xfer.state != Transfer::IDLE) {
+            c.cmd_deferred = true;
+            break;
+        }
+        // Nothing overtakes a running HASH or copy, its reply comes first; only ABOR cuts it short
+        if ((c.hash || c.copy) && !(entry && entry->handler == &FtpServer::ftp_cmd_abor)) {
+            c.cmd_deferred = true;
+            break;
+        }
+
+        *eol = 0;
+        if (eol > line && eol[-1] == '\r') eol[-1] = 0;
+        char *args = line + cmd_len;
+        if (*args == ' ') args++;
+
+        // RNTO has to come right after its RNFR
+        if (!entry || entry->handler != &FtpServer::ftp_cmd_rnto) c.rename_from[0] = 0;
+
+        if (entry) {
+            long long t0 = monotonicUs();
+            (this->*entry->handler)(c, args);
+            stats.verb_us[entry - cmdTable].record((uint32_t)(monotonicUs() - t0));
+        } else if (cmd_len) {
+            const char *resp = "502 Command not implemented\r\n";
+            send(c.client_sock, resp, strlen(resp), 0);
+            stats.unknown_commands++;
+        }
+        if (cmd_len) {
+            stats.commands++;
+            c.stats.commands++;
+        }
+
+        // QUIT or a failed send may have released the session
+        if (c.client_sock < 0) return;
+        line = eol + 1;
+    }
+
+    if (line == c.buffer && c.buffer_len == sizeof(c.buffer) - 1 && !c.cmd_deferred) {
+        if (!c.discard_line) {
+            const char *resp = "500 Command line too long\r\n";
+            send(c.client_sock, resp, strlen(resp), 0);
+            c.discard_line = true;
+        }
+        line = end;
+    }
+
+    // Keep the unfinished tail for the next segment
+    c.buffer_len = end - line;
+    memmove(c.buffer, line, c.buffer_len);
+    c.buffer[c.buffer_len] = 0;
+}
+
+void FtpServer::handleIdleData(Client &c) {
+    // Readable data socket outside a transfer: either the client dropped it,
+    // or it started sending ahead of its STOR. Only the first case is ours.
+    char probe;
+    int len = recv(c.pasv_data_sock, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (len > 0) {
+        c.data_pending = true;
+    } else if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        closeDataConnection(c);
+    }
+}
+
+int FtpServer::pollTimeout(int timeout_ms) {
+    // Transfers waiting for the client to connect and idle sessions must still time out
+    long long now = monotonicMs();
+    globalBucket.refill(now);
+    for (int i = 0; i < max_clients; i++) {
+        if (!clients[i] || clients[i]->client_sock < 0) continue;
+        Client &c = *clients[i];
+        if (c.xfer.flush_pending) timeout_ms = 0;
+        if (c.hash || c.copy) {
+            // Never 0: the job's slice is done for this tick, let lower priority tasks run
+            if (timeout_ms < 0 || timeout_ms > FTP_JOB_WAIT_MS) timeout_ms = FTP_JOB_WAIT_MS;
+            continue;
+        }
+
+        if (c.xfer.state == Transfer::IDLE) {
+            long long idle_left = c.last_activity_ms + FTP_IDLE_TIMEOUT_MS - now;
+            if (idle_left <= 0) {
+                ESP_LOGI(TAG_FTP, "Client %d idle, closing", c.slot);
+                const char *resp = "421 Idle timeout, closing control connection\r\n";
                 send(c.client_sock, resp, strlen(resp), 0);
+                closeClient(c);
+                continue;
+            }
+            if (timeout_ms < 0 || idle_left < timeout_ms) timeout_ms = (int)idle_left;
+            continue;
+        }
+
+        if (c.xfer.state == Transfer::SENDING || c.xfer.state == Transfer::RECEIVING) {
+            c.bucket.refill(now);
+            int wait = c.bucket.msUntil(FTP_RATE_MIN_GRANT);
+            int global_wait = globalBucket.msUntil(FTP_RATE_MIN_GRANT);
+            if (global_wait > wait) wait = global_wait;
+            if (wait > 0 && (timeout_ms < 0 || wait < timeout_ms)) timeout_ms = wait;
+            continue;
+        }
+        if (c.xfer.state != Transfer::WAIT_CONNECT) continue;
+
+        long long left = c.xfer.deadline_ms - now;
+        if (left <= 0) {
+            ESP_LOGW(TAG_FTP, "Timeout waiting for PASV data connection");
+            endTransfer(c, "425 Can't open data connection\r\n");
+            continue;
+        }
+        if (timeout_ms < 0 || left < timeout_ms) timeout_ms = (int)left;
+    }
+    return timeout_ms;
+}
+
+void FtpServer::tick(int timeout_ms) {
+    struct pollfd *fds = pollFds;
+    PollSlot *slots = pollSlots;
+    int nfds;
+    {
+        LOCK(mutex);
+        releaseClosedClients();
+        timeout_ms = pollTimeout(timeout_ms);
+        nfds = buildPollSet(fds, slots);
+    }
+
+    // Unlocked while waiting, other tasks may read stats or change limits meanwhile
+    int ready = poll(fds, nfds, timeout_ms);
+    LOCK(mutex);
+    if (ready < 0) {
+        if (errno != EINTR) {
+            ESP_LOGE(TAG_FTP, "poll() error: %d", errno);
+            stats.socket_errors++;
+        }
+        return;
+    }
+
+    for (int i = 0; i < nfds && ready > 0; i++) {
+        if (fds[i].revents == 0) continue;
+        ready--;
+
+        // A handler may have closed this descriptor as a side effect of an earlier one
+        Client *c = slots[i].client;
+        switch (slots[i].kind) {
+        case PollSlot::LISTEN:
+            acceptClient();
+            break;
+        case PollSlot::WAKE: {
+            uint64_t count;
+            read(wake_fd, &count, sizeof(count));
+            break;
+        }
+        case PollSlot::CONTROL:
+            if (c->client_sock == fds[i].fd) handleControl(*c);
+            break;
+        case PollSlot::PASV_LISTEN:
+            if (c->pasv_listen_sock == fds[i].fd && c->pasv_data_sock < 0) acceptDataConnection(*c);
+            break;
+        case PollSlot::DATA:
+            if (c->pasv_data_sock != fds[i].fd) break;
+            if (c->xfer.state == Transfer::SENDING || c->xfer.state == Transfer::RECEIVING) {
+                c->xfer.ready = true;   // Served below, in round robin order
+            } else {
+                handleIdleData(*c);
             }
-        } else if (len == 0) {
-            close(c.client_sock);
-            c.client_sock = -1;
-            c.active = false;
-            closeDataConnection(c);
-        } else if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            ESP_LOGW(TAG_FTP, "Client %d socket error (errno=%d)", i, errno);
-            close(c.client_sock);
-            c.client_sock = -1;
-            c.active = false;
-            closeDataConnection(c);
+            break;
+        }
+    }
+
+    scheduleTransfers();
+
+    // One pending upload buffer per client per tick, after the sockets are served
+    for (int i = 0; i < max_clients; i++) {
+        if (clients[i] && clients[i]->xfer.flush_pending) flushUpload(*clients[i]);
+    }
+
+    // Running HASHes and copies a chunk each in turn, so a large file doesn't
+    // hold up the other sessions, for at most FTP_JOB_SLICE_MS
+    long long slice_end = monotonicMs() + FTP_JOB_SLICE_MS;
+    bool jobs = true;
+    while (jobs && monotonicMs() < slice_end) {
+        jobs = false;
+        for (int i = 0; i < max_clients; i++) {
+            if (!clients[i]) continue;
+            if (clients[i]->hash) serviceHash(*clients[i]);
+            else if (clients[i]->copy) serviceCopy(*clients[i]);
+            else continue;
+            jobs = jobs || clients[i]->hash || clients[i]->copy;
+        }
+    }
+
+    // Resume pipelined commands that were waiting for a transfer, HASH or copy to finish
+    for (int i = 0; i < max_clients; i++) {
+        Client *c = clients[i];
+        if (c && c->cmd_deferred && c->xfer.state == Transfer::IDLE && !c->hash && !c->copy) {
+            processCommands(*c);
         }
     }
 }
+
+void FtpServer::run() {
+    while (!stopping) {
+        tick(-1);
+    }
+    stopped.Give();
+    // Parked here until stop() deletes the task; returning would let the task delete itself
+    vTaskSuspend(nullptr);
+}
+
+bool FtpServer::start(UBaseType_t priority, uint16_t stack_size, BaseType_t core) {
+    if (running || listen_sock < 0) return false;
+
+#if defined(ESP_PLATFORM)
+    // Lets eventfds share a poll() with lwIP sockets; some other component may have done it already
+    esp_vfs_eventfd_config_t config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+    esp_err_t err = esp_vfs_eventfd_register(&config);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        ESP_LOGE(TAG_FTP, "eventfd unavailable (%s)", esp_err_to_name(err));
+        return false;
+    }
+#endif
+    wake_fd = eventfd(0, 0);
+    if (wake_fd < 0) {
+        ESP_LOGE(TAG_FTP, "Unable to create wake eventfd (errno=%d)", errno);
+        return false;
+    }
+
+    stopping = false;
+    task.Init("ftp_server", priority, stack_size);
+    task.SetHandler([this]() { run(); });
+    if (!task.Run(core)) {
+        ESP_LOGE(TAG_FTP, "Unable to create server task");
+        close(wake_fd);
+        wake_fd = -1;
+        return false;
+    }
+    running = true;
+    return true;
+}
+
+void FtpServer::stop() {
+    if (!running) return;
+    stopping = true;
+    uint64_t one = 1;
+    write(wake_fd, &one, sizeof(one));
+    stopped.Take();
+    task.Delete();
+
+    close(wake_fd);
+    wake_fd = -1;
+    running = false;
+}
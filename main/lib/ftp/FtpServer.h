@@ -1,31 +1,328 @@
 #pragma once
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include "sdkconfig.h"
+#include "UnionStorage.h"
+#include "FixedBlockPool.h"
+#include "TransferBackend.h"
+#include "ListingBackend.h"
+#include "FileSystem.h"
+#include "PosixFileSystem.h"
+#include "ListingCache.h"
+#include "Digest.h"
+#include "HashCache.h"
+#include "Zlib.h"
+#include "TokenBucket.h"
+#include "FtpStats.h"
+#include "Stream.h"
+#include "Task.h"
+#include "Semaphore.h"
+#include "RecursiveMutex.h"
 
 
+#ifndef FTP_CTRL_PORT
 #define FTP_CTRL_PORT 21
+#endif
 #define FTP_BUFFER_SIZE 512
-#define FTP_MAX_CLIENTS 4
+#define FTP_MAX_CLIENTS 4           // Default session pool size, see setMaxClients()
+#define FTP_DATA_ACCEPT_TIMEOUT_MS 5000
+#define FTP_TRANSFER_CHUNK 2048     // Bytes moved per data socket readiness event
+#define FTP_STOR_BUFFER_SIZE CONFIG_WL_SECTOR_SIZE  // Upload writes are whole wear-levelling sectors
+#define FTP_LIST_BUFFER_SIZE 4096   // Listing entries are rendered here and sent in bulk
+#ifndef FTP_RETR_ZERO_COPY
+#define FTP_RETR_ZERO_COPY 1        // Default of setZeroCopy()
+#endif
+
+// Passive data ports, fixed so they can be opened in a firewall. One listener
+// per port is bound once in init() and leased to a client for each PASV/EPSV,
+// unless setPassivePool() turns the pool off.
+#ifndef FTP_PASV_PORT_MIN
+#define FTP_PASV_PORT_MIN 50000
+#endif
+#ifndef FTP_PASV_PORT_MAX
+#define FTP_PASV_PORT_MAX (FTP_PASV_PORT_MIN + FTP_MAX_CLIENTS - 1)
+#endif
+#ifndef FTP_PASV_POOL
+#define FTP_PASV_POOL 1             // Default of setPassivePool()
+#endif
+
+// Bandwidth caps in bytes per second, 0 = unlimited. The global cap keeps
+// FTP from starving other users of the radio; the session cap is per client.
+#ifndef FTP_RATE_GLOBAL_BPS
+#define FTP_RATE_GLOBAL_BPS 0
+#endif
+#ifndef FTP_RATE_SESSION_BPS
+#define FTP_RATE_SESSION_BPS 0
+#endif
+#define FTP_RATE_MIN_GRANT 512      // A throttled transfer waits until it can move this much
+
+// HASH/XCRC/XSHA* read the file in chunks of this size, one chunk per client per round
+#ifndef FTP_HASH_CHUNK
+#define FTP_HASH_CHUNK 8192
+#endif
+
+// Background jobs (HASH, SITE COPY) get this much of each tick, then the server task
+// blocks in poll() for at least FTP_JOB_WAIT_MS so that IDLE and lower
+// priority tasks run and the task watchdog stays fed during long jobs
+#ifndef FTP_JOB_SLICE_MS
+#define FTP_JOB_SLICE_MS 20
+#endif
+#ifndef FTP_JOB_WAIT_MS
+#define FTP_JOB_WAIT_MS ((int)portTICK_PERIOD_MS)     // One tick
+#endif
+
+// SITE COPY moves this much per client per round, whole wear-levelling sectors
+#ifndef FTP_COPY_CHUNK
+#define FTP_COPY_CHUNK (4 * CONFIG_WL_SECTOR_SIZE)
+#endif
+
+// Filesystems mount() can add next to the root one
+#ifndef FTP_VFS_MOUNTS
+#define FTP_VFS_MOUNTS 4
+#endif
+
+// Sessions without control traffic or a transfer for this long are closed
+#ifndef FTP_IDLE_TIMEOUT_MS
+#define FTP_IDLE_TIMEOUT_MS 300000
+#endif
+
+// Server task started by start()
+#ifndef FTP_TASK_PRIORITY
+#define FTP_TASK_PRIORITY 5
+#endif
+#ifndef FTP_TASK_STACK
+#define FTP_TASK_STACK 6144
+#endif
+#ifndef FTP_TASK_CORE
+#define FTP_TASK_CORE tskNO_AFFINITY
+#endif
+
+#if defined(__linux__)
+using TransferBackendStorage = UnionStorage<ITransferBackend, CopyBackend, MappedBackend, ListingBackend, SendfileBackend>;
+#else
+using TransferBackendStorage = UnionStorage<ITransferBackend, CopyBackend, MappedBackend, ListingBackend>;
+#endif
 
 class FtpServer {
 public:
+    struct Transfer {
+        enum State { IDLE, WAIT_CONNECT, SENDING, RECEIVING };
+        State state;
+        bool upload;
+        IFileSystem *fs;    // Owner of fd
+        int fd;
+        long offset;        // File bytes moved over the data socket so far
+        long wire;          // Bytes on the data socket, fewer than offset in MODE Z
+        long start_offset;  // File position the transfer started at (REST/APPE)
+        TransferBackendStorage source;  // RETR/LIST: produces the outgoing data
+        char *buf[2];       // RETR copy buffer in buf[0]; STOR fills one while the other is flushed
+        size_t buf_len[2];
+        size_t buf_limit;   // STOR: fill level at which buf[fill] is handed to the flusher
+        int fill;           // STOR: buffer currently being received into
+        bool flush_pending; // STOR: buf[fill ^ 1] is full and waiting to be written
+        int writes;
+        bool trim;          // STOR: cut the file at the last byte received (REST overwrite, ALLO)
+        int cache_handle;   // Pinned ListingCache entry being sent, or -1
+        uint32_t list_gen;  // ListingCache generation the listing was rendered in
+        char path[FTP_PATH_MAX];    // STOR target or listed directory, as the caches know it
+        long long start_ms;
+        long long deadline_ms;  // Give up WAIT_CONNECT after this
+        Deflater *zip;      // MODE Z RETR/LIST: compresses what source produces
+        Inflater *unzip;    // MODE Z STOR: decodes into buf[fill]
+        size_t buf_bytes;   // Allocated behind buf[0], buf[1] and the MODE Z codec
+        bool ready;         // Data socket signalled readiness this tick
+        size_t deficit;     // Deficit round robin credit carried into the next round
+    };
+
+    // A running HASH: the file is digested one chunk per tick, and the
+    // session's further commands wait until the reply has been sent
+    struct HashJob {
+        IFileSystem *fs;
+        int fd;
+        long pos;           // Next file offset to read
+        HashCache::Key key; // Range, and the file state the result is cached under
+        Digest digest;
+        bool x_reply;       // XCRC/XSHA* "250 <hex>" instead of the HASH reply
+        long long start_ms;
+        char name[128];     // As given by the client, echoed in the HASH reply
+        char buf[FTP_HASH_CHUNK];
+    };
+
+    // A running SITE COPY, one chunk per tick like a HashJob
+    struct CopyJob {
+        IFileSystem *src_fs;
+        int src;
+        const uint8_t *src_data;    // Mapped source, written from in place
+        size_t src_size;
+        IFileSystem *dst_fs;
+        int dst;
+        long pos;
+        long long start_ms;
+        char path[FTP_PATH_MAX];    // Target as clients see it
+        char dst_path[FTP_PATH_MAX];    // The same inside dst_fs
+        char buf[FTP_COPY_CHUNK];
+    };
+
     struct Client {
+        int slot;           // Index in clients[]
         int client_sock;
         int pasv_listen_sock;
         int pasv_data_sock;
-        char cwd[128];
-        char buffer[FTP_BUFFER_SIZE];
+        char cwd[FTP_PATH_MAX];     // Normalized, "/" at the root
+        char buffer[FTP_BUFFER_SIZE];   // Received control bytes, may end in a partial line
+        size_t buffer_len;
+        bool cmd_deferred;  // buffer holds a command waiting for the current transfer
+        bool discard_line;  // Dropping the rest of an overlong line up to its newline
         int active;
+        bool data_pending;  // Data socket has unread bytes waiting for a transfer command
+        bool epsv_all;      // Client sent EPSV ALL, PORT and PASV are refused from then on
+        bool mode_z;        // MODE Z: data connections carry zlib streams
+        TokenBucket bucket; // Session bandwidth cap
+        FtpSessionStats stats;
+        long rest_offset;   // REST marker for the next RETR/STOR
+        long alloc_size;    // ALLO size the next STOR/APPE preallocates
+        long long last_activity_ms;
+        Digest::Algorithm hash_algo;    // OPTS HASH selection
+        bool rang_set;      // RANG given for the next HASH
+        long rang_start;
+        long rang_end;      // Inclusive, as sent
+        HashJob *hash;      // Running HASH, or nullptr
+        CopyJob *copy;      // Running SITE COPY, or nullptr
+        char rename_from[FTP_PATH_MAX]; // RNFR path waiting for RNTO, "" if none
+        Transfer xfer;
     };
 
+    // RAM held by the server. fixed is reserved from init() on, idle or not;
+    // buffers come and go with transfers.
+    struct MemoryStats {
+        size_t fixed;           // Server object, session pool and per-slot tables
+        size_t session_bytes;   // One session pool block
+        size_t sessions;
+        size_t sessions_peak;
+        size_t sessions_max;
+        size_t buffers;         // Transfer and listing buffers now
+        size_t buffers_peak;
+        size_t listing_cache;
+    };
+
+    // Serves a directory of the host VFS, or any filesystem, at "/"
     FtpServer(const char* root_path);
+    explicit FtpServer(IFileSystem &root);
     ~FtpServer();
 
+    // Serves fs under path (such as "/ram"), which hides whatever the root
+    // has there. It shows up in the parent's listing only if the parent holds
+    // a directory of that name. Call before init().
+    bool mount(const char *path, IFileSystem &fs);
+
+    // Passive ports are taken from [first, last]. Call before init().
+    void setPassivePorts(uint16_t first, uint16_t last);
+
+    // Size of the session pool allocated by init(), FTP_MAX_CLIENTS by default.
+    // Give the passive port range at least as many ports. Call before init().
+    void setMaxClients(int count);
+
     bool init();
-    void tick();
+
+    // Bytes per second for all transfers together and for each session, 0 = unlimited.
+    // May be changed while transfers are running.
+    void setRateLimits(uint32_t global_bps, uint32_t session_bps);
+
+    // RETR straight from mapped files or through sendfile() where the platform
+    // allows, otherwise through the read-and-send loop. Applies to transfers
+    // that start afterwards; FTP_RETR_ZERO_COPY by default.
+    void setZeroCopy(bool enable) { zero_copy = enable; }
+
+    // Lease passive listeners from the pool bound in init(), or open a fresh
+    // one for each PASV/EPSV and close it with the data connection. Applies
+    // to PASV/EPSV from then on; FTP_PASV_POOL by default.
+    void setPassivePool(bool enable) { pasv_pool = enable; }
+
+    // For code that changes files behind the server's back; path is the
+    // directory as clients see it, such as "/logs"
+    void invalidateListing(const char *path);
+    const ListingCache::Stats &getListingCacheStats() const { return listingCache.stats(); }
+    const HashCache::Stats &getHashCacheStats() const { return hashCache.stats(); }
+
+    // Server-wide counters and histograms, and the same plus the live
+    // sessions as one JSON object (also served by SITE STATS). While the task
+    // runs, getStats() may be mid-update; writeStats() is a consistent snapshot.
+    const FtpStats &getStats() const { return stats; }
+    void writeStats(Stream &out) const;
+    // Also restarts buffers_peak from the buffers held now
+    void resetStats();
+    MemoryStats getMemoryStats() const;
+
+    // The verb table and the dispatcher's lookup in it: a verb's index, or -1
+    static size_t commandCount();
+    static const char *commandName(size_t index);
+    static int commandIndex(const char *cmd, size_t len);
+
+    // Waits up to timeout_ms (-1 = forever, 0 = just check) for socket activity
+    // and only services the descriptors that are ready. Not while the task runs.
+    void tick(int timeout_ms = 0);
+
+    // Runs the server in its own task, which sleeps in poll() until a socket,
+    // a timeout or stop() needs it; nobody has to call tick(). Call after init().
+    bool start(UBaseType_t priority = FTP_TASK_PRIORITY, uint16_t stack_size = FTP_TASK_STACK,
+               BaseType_t core = FTP_TASK_CORE);
+    // Wakes the task and waits for it to finish its tick. Sessions stay open,
+    // start() picks them up again. Call from another task.
+    void stop();
+    bool isRunning() const { return running; }
 
 private:
+    struct PollSlot {
+        enum Kind { LISTEN, WAKE, CONTROL, PASV_LISTEN, DATA };
+        Client *client;
+        Kind kind;
+    };
+
     // === Helpers ===
-    int  openDataConnection(Client& c);
+    int  buildPollSet(struct pollfd *fds, PollSlot *slots);
+    void acceptClient();
+    void handleControl(Client& c);
+    void processCommands(Client& c);
+    void handleIdleData(Client& c);
+    int  pollTimeout(int timeout_ms);
+    IFileSystem *resolve(const Client& c, const char *arg, char *path, const char **fs_path);
+    bool beginTransfer(Client& c, IFileSystem& fs, int fd, bool upload, long start);
+    bool beginListing(Client& c, const char *args, ListingBackend::Format format);
+    void armTransfer(Client& c, int fd, bool upload);
+    void cacheListing(Client& c);
+    void scheduleTransfers();
+    bool isThrottled(const Client& c) const;
+    ssize_t pumpTransfer(Client& c, size_t max);
+    ssize_t pumpSend(Client& c, size_t max);
+    ssize_t pumpReceive(Client& c, size_t max);
+    ssize_t sendCompressed(Client& c, size_t max);
+    ssize_t receiveCompressed(Client& c, size_t max);
+    void completeUpload(Client& c);
+    bool flushUpload(Client& c);
+    bool flushUpload(Client& c, int index);
+    void endTransfer(Client& c, const char *reply);
+    void storeFile(Client& c, const char *args, bool append);
+    void startHash(Client& c, const char *args, Digest::Algorithm algo, bool x_reply);
+    void serviceHash(Client& c);
+    void endHash(Client& c, const char *reply);
+    void startCopy(Client& c, const char *args);
+    void serviceCopy(Client& c);
+    void endCopy(Client& c, const char *reply);
+    void sendHashReply(Client& c, const HashCache::Key& key, bool x_reply, const char *name, const char *hex);
+    void closeClient(Client& c);
+    void releaseClosedClients();
+    char *allocBuffer(Transfer& x, size_t size);
+    void countBuffer(Transfer& x, size_t size);
+    bool attachCodec(Client& c, bool upload);
+    void freeBuffers(Transfer& x);
+    int  acceptDataConnection(Client& c);
     void closeDataConnection(Client& c);
+    void openPassivePool();
+    int  leasePassivePort(Client& c);
+    void drainPassive(int sock);
+    void run();
 
     // === FTP Command Handlers ===
     void ftp_cmd_user(Client &c, const char *args);
@@ -35,9 +332,11 @@ private:
     void ftp_cmd_pwd(Client &c, const char *args);
     void ftp_cmd_list(Client &c, const char *args);
     void ftp_cmd_type(Client &c, const char *args);
+    void ftp_cmd_mode(Client &c, const char *args);
     void ftp_cmd_noop(Client &c, const char *args);
     void ftp_cmd_auth(Client &c, const char *args);
     void ftp_cmd_pasv(Client &c, const char *args);
+    void ftp_cmd_epsv(Client &c, const char *args);
     void ftp_cmd_port(Client &c, const char *args);
     void ftp_cmd_cwd(Client &c, const char *args);
     void ftp_cmd_cdup(Client &c, const char *args);
@@ -48,17 +347,104 @@ private:
     void ftp_cmd_mkd(Client &c, const char *args);
     void ftp_cmd_size(Client &c, const char *args);
     void ftp_cmd_mdtm(Client &c, const char *args);
+    void ftp_cmd_abor(Client &c, const char *args);
+    void ftp_cmd_feat(Client &c, const char *args);
+    void ftp_cmd_mlsd(Client &c, const char *args);
+    void ftp_cmd_mlst(Client &c, const char *args);
+    void ftp_cmd_rest(Client &c, const char *args);
+    void ftp_cmd_appe(Client &c, const char *args);
+    void ftp_cmd_allo(Client &c, const char *args);
+    void ftp_cmd_site(Client &c, const char *args);
+    void ftp_cmd_opts(Client &c, const char *args);
+    void ftp_cmd_hash(Client &c, const char *args);
+    void ftp_cmd_rang(Client &c, const char *args);
+    void ftp_cmd_xcrc(Client &c, const char *args);
+    void ftp_cmd_xmd5(Client &c, const char *args);
+    void ftp_cmd_xsha1(Client &c, const char *args);
+    void ftp_cmd_xsha256(Client &c, const char *args);
+    void ftp_cmd_rnfr(Client &c, const char *args);
+    void ftp_cmd_rnto(Client &c, const char *args);
+
+    enum CommandFlags : uint8_t {
+        CMD_NONE = 0,
+        CMD_DATA = 1 << 0,  // Uses the data connection, so must wait for the current transfer
+    };
 
     struct CommandEntry {
         const char *cmd;
         void (FtpServer::*handler)(Client &c, const char *args);
+        uint8_t flags;
+    };
+
+    // Verbs are at most eight letters (XSHA256), so the case-folded bytes
+    // packed into one word are a unique key. Longer tokens get 0, which matches nothing.
+    static constexpr uint64_t commandKey(const char *cmd, size_t len) {
+        if (len == 0 || len > 8) return 0;
+        uint64_t key = 0;
+        for (size_t i = 0; i < len; i++) {
+            key |= (uint64_t)(uint8_t)cmd[i] << (8 * i);
+        }
+        return key & 0xDFDFDFDFDFDFDFDFull;    // ASCII letters to upper case
+    }
+
+    // Perfect hash over cmdTable: slot = (key * mult) >> (64 - CMD_HASH_BITS)
+    static constexpr int CMD_HASH_BITS = 7;
+    static constexpr uint8_t CMD_HASH_EMPTY = 0xFF;
+    struct CommandHash {
+        uint64_t mult;
+        uint64_t keys[1 << CMD_HASH_BITS];
+        uint8_t index[1 << CMD_HASH_BITS];
     };
 
     static const CommandEntry cmdTable[];
+    static const size_t cmdCount;
+    static const CommandHash cmdHash;
+    static constexpr CommandHash buildCommandHash();
+    static const CommandEntry *findCommand(const char *cmd, size_t len);
 
 
 private:
+    struct PassivePort {
+        int sock;
+        uint16_t port;
+        bool leased;
+    };
+
+    struct Mount {
+        char path[FTP_PATH_MAX];    // "" for the root
+        size_t len;
+        IFileSystem *fs;
+    };
+
     int listen_sock;
-    char root_path[128];
-    Client clients[FTP_MAX_CLIENTS];
+    PosixFileSystem posixRoot;
+    Mount mounts[FTP_VFS_MOUNTS + 1];   // mounts[0] is the root
+    int mount_count;
+    uint16_t pasv_port_min;
+    uint16_t pasv_port_max;
+    int max_clients;
+    FixedBlockPool sessionPool;
+    Client **clients;           // max_clients slots, nullptr when free
+    PassivePort *pasvPool;      // max_clients listeners
+    struct pollfd *pollFds;     // Listen socket, wake eventfd + control, PASV listen and data socket per client
+    PollSlot *pollSlots;
+    size_t buffer_bytes;
+    size_t buffer_peak;
+    TokenBucket globalBucket;
+    uint32_t session_bps;
+    bool zero_copy;
+    bool pasv_pool;
+    int rr_next;        // Client that is served first in the next transfer round
+    ListingCache listingCache;
+    HashCache hashCache;
+    FtpStats stats;
+
+    // The task holds mutex for everything but its poll(), so the public
+    // methods can be called from other tasks while it runs
+    RecursiveMutex mutex;
+    Task task;
+    Semaphore stopped;          // Given by the task once it has seen stopping
+    int wake_fd;                // eventfd that breaks the task out of poll()
+    std::atomic<bool> stopping;
+    bool running;
 };
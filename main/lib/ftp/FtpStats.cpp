@@ -0,0 +1,41 @@
+#include "FtpStats.h"
+
+uint32_t FtpHistogram::percentile(uint32_t pct) const {
+    if (count == 0) return 0;
+    uint64_t rank = ((uint64_t)count * pct + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < FTP_HIST_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            // The top bucket has no upper bound, the largest sample is the best we know
+            if (i == 0) return 0;
+            if (i == FTP_HIST_BUCKETS - 1) return max;
+            uint32_t upper = (1u << i) - 1;
+            return upper < max ? upper : max;
+        }
+    }
+    return max;
+}
+
+void FtpHistogram::write(JsonObjectWriter &obj) const {
+    obj.field("count", (uint64_t)count);
+    obj.field("sum", sum);
+    obj.field("max", (uint64_t)max);
+    obj.field("p50", (uint64_t)percentile(50));
+    obj.field("p90", (uint64_t)percentile(90));
+    obj.field("p99", (uint64_t)percentile(99));
+
+    int used = FTP_HIST_BUCKETS;
+    while (used > 0 && buckets[used - 1] == 0) used--;
+    obj.withArray("log2", [&](JsonArrayWriter &arr) {
+        for (int i = 0; i < used; i++) arr.value((uint64_t)buckets[i]);
+    });
+}
+
+void FtpTransferStats::write(JsonObjectWriter &obj) const {
+    obj.field("bytes", bytes);
+    obj.field("completed", (uint64_t)completed);
+    obj.field("aborted", (uint64_t)aborted);
+    obj.withObject("duration_ms", [&](JsonObjectWriter &h) { duration_ms.write(h); });
+    obj.withObject("kbytes_per_sec", [&](JsonObjectWriter &h) { kbytes_per_sec.write(h); });
+}
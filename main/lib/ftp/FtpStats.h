@@ -0,0 +1,58 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "json.h"
+
+#define FTP_HIST_BUCKETS 20     // Power-of-two buckets, the last one is open-ended
+#define FTP_STATS_VERBS 40      // Room for every entry of the command table
+
+// Log2 histogram: bucket 0 counts zeros, bucket i counts [2^(i-1), 2^i).
+struct FtpHistogram {
+    uint32_t buckets[FTP_HIST_BUCKETS];
+    uint32_t count;
+    uint32_t max;
+    uint64_t sum;
+
+    void record(uint32_t v) {
+        int i = v ? 32 - __builtin_clz(v) : 0;
+        buckets[i < FTP_HIST_BUCKETS ? i : FTP_HIST_BUCKETS - 1]++;
+        count++;
+        sum += v;
+        if (v > max) max = v;
+    }
+
+    // Upper bound of the bucket holding the given percentile
+    uint32_t percentile(uint32_t pct) const;
+    void write(JsonObjectWriter &obj) const;
+};
+
+struct FtpTransferStats {
+    uint64_t bytes;
+    uint32_t completed;
+    uint32_t aborted;
+    FtpHistogram duration_ms;
+    FtpHistogram kbytes_per_sec;
+
+    void write(JsonObjectWriter &obj) const;
+};
+
+// Counters of one control connection, reset when the slot is reused
+struct FtpSessionStats {
+    long long connected_ms;
+    uint32_t commands;
+    uint32_t transfers;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+};
+
+struct FtpStats {
+    uint32_t sessions;
+    uint32_t rejected;          // "Too many clients"
+    uint32_t socket_errors;
+    uint32_t file_errors;
+    uint32_t commands;
+    uint32_t unknown_commands;
+    FtpTransferStats in;        // STOR/APPE
+    FtpTransferStats out;       // RETR and listings
+    FtpHistogram verb_us[FTP_STATS_VERBS];  // Handler latency, indexed like the command table
+};
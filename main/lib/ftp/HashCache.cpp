@@ -0,0 +1,65 @@
+#include "HashCache.h"
+#include <string.h>
+
+uint64_t HashCache::pathKey(const char *path) {
+    // FNV-1a over the path with "//" collapsed and no trailing '/', so the
+    // spellings the command handlers produce for one file share a key
+    uint64_t h = 0xcbf29ce484222325ull;
+    char prev = 0;
+    for (const char *p = path; *p; p++) {
+        if (*p == '/' && (prev == '/' || p[1] == 0)) continue;
+        h = (h ^ (uint8_t)*p) * 0x100000001b3ull;
+        prev = *p;
+    }
+    return h;
+}
+
+static bool sameKey(const HashCache::Key &a, const HashCache::Key &b) {
+    return a.path == b.path && a.algo == b.algo && a.start == b.start && a.end == b.end &&
+           a.mtime == b.mtime && a.size == b.size;
+}
+
+bool HashCache::lookup(const Key &key, long long now_ms, char *hex) {
+    for (Entry &e : entries) {
+        if (e.used_ms == 0 || !sameKey(e.key, key)) continue;
+        e.used_ms = now_ms;
+        memcpy(hex, e.hex, sizeof(e.hex));
+        st.hits++;
+        return true;
+    }
+    st.misses++;
+    return false;
+}
+
+void HashCache::store(const Key &key, const char *hex, long long now_ms) {
+    // Same key again replaces the old result, otherwise the least recently used goes
+    Entry *victim = &entries[0];
+    for (Entry &e : entries) {
+        if (e.used_ms != 0 && sameKey(e.key, key)) {
+            victim = &e;
+            break;
+        }
+        if (e.used_ms < victim->used_ms) victim = &e;
+    }
+    victim->key = key;
+    victim->used_ms = now_ms > 0 ? now_ms : 1;
+    strncpy(victim->hex, hex, sizeof(victim->hex) - 1);
+    victim->hex[sizeof(victim->hex) - 1] = 0;
+    st.stores++;
+}
+
+void HashCache::clear() {
+    for (Entry &e : entries) {
+        if (e.used_ms != 0) st.invalidations++;
+        e.used_ms = 0;
+    }
+}
+
+void HashCache::invalidate(const char *path) {
+    uint64_t key = pathKey(path);
+    for (Entry &e : entries) {
+        if (e.used_ms == 0 || e.key.path != key) continue;
+        e.used_ms = 0;
+        st.invalidations++;
+    }
+}
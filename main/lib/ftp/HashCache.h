@@ -0,0 +1,51 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "Digest.h"
+
+#define FTP_HASH_CACHE_ENTRIES 8
+
+// Recently computed file digests. An entry only matches while the file still
+// has the mtime and size it was hashed at, so most writes invalidate it
+// implicitly; writers that can keep both (FatFs mtime has 2 s resolution)
+// call invalidate() for the path.
+class HashCache {
+public:
+    struct Key {
+        uint64_t path;      // pathKey() of the full path
+        Digest::Algorithm algo;
+        long start;
+        long end;           // Exclusive
+        time_t mtime;
+        off_t size;
+    };
+
+    struct Stats {
+        uint32_t hits;
+        uint32_t misses;
+        uint32_t stores;
+        uint32_t invalidations;
+    };
+
+    static uint64_t pathKey(const char *path);
+
+    // Copies the hex digest to hex on a hit
+    bool lookup(const Key &key, long long now_ms, char *hex);
+    void store(const Key &key, const char *hex, long long now_ms);
+    void invalidate(const char *path);
+    // For changes below a directory, whose paths aren't known one by one
+    void clear();
+
+    const Stats &stats() const { return st; }
+
+private:
+    struct Entry {
+        Key key;
+        long long used_ms;  // 0: free slot
+        char hex[FTP_DIGEST_HEX_MAX];
+    };
+
+    Entry entries[FTP_HASH_CACHE_ENTRIES] = {};
+    Stats st = {};
+};
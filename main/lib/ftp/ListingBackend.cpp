@@ -0,0 +1,130 @@
+#include "ListingBackend.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+ListingBackend::ListingBackend(IFileSystem &fs, int dir, const char *path, Format format, char *buf,
+                               size_t size, size_t capture_limit)
+    : fs(fs), dir(dir), format(format), buf(buf), size(size), capture_limit(capture_limit) {
+    snprintf(this->path, sizeof(this->path), "%s", path);
+    now = time(nullptr);
+}
+
+ListingBackend::~ListingBackend() {
+    if (dir >= 0) fs.closedir(dir);
+    free(capture);
+}
+
+void ListingBackend::appendCapture() {
+    if (capture_limit == 0 || len == 0) return;
+
+    if (capture_len + len > capture_cap) {
+        size_t cap = capture_cap ? capture_cap * 2 : size;
+        while (cap < capture_len + len) cap *= 2;
+        if (cap > capture_limit) cap = capture_limit;
+
+        char *grown = capture_len + len <= cap ? (char *)realloc(capture, cap) : nullptr;
+        if (!grown) {
+            // Too big (or no memory) to cache: keep streaming, stop copying
+            free(capture);
+            capture = nullptr;
+            capture_limit = 0;
+            return;
+        }
+        capture = grown;
+        capture_cap = cap;
+    }
+    memcpy(capture + capture_len, buf, len);
+    capture_len += len;
+}
+
+char *ListingBackend::takeCapture(size_t *len) {
+    if (dir >= 0 || !capture) return nullptr;
+    char *data = capture;
+    *len = capture_len;
+    capture = nullptr;
+    return data;
+}
+
+int ListingBackend::formatEntry(char *out, size_t size, Format format, const char *name,
+                                bool is_dir, const struct stat *st, time_t now) {
+    struct tm tm_info = {};
+    if (st) gmtime_r(&st->st_mtime, &tm_info);
+
+    if (format == MLSD) {
+        if (is_dir && !st) return snprintf(out, size, "type=dir; %s\r\n", name);
+
+        char modify[16];
+        strftime(modify, sizeof(modify), "%Y%m%d%H%M%S", &tm_info);
+        if (is_dir) return snprintf(out, size, "type=dir;modify=%s; %s\r\n", modify, name);
+        return snprintf(out, size, "type=file;size=%lld;modify=%s; %s\r\n",
+                        (long long)st->st_size, modify, name);
+    }
+
+    // ls -l shows the time of day for recent files and the year otherwise
+    char date[16] = "Jan  1  1980";
+    if (st) {
+        bool recent = st->st_mtime <= now && now - st->st_mtime < 180L * 24 * 3600;
+        strftime(date, sizeof(date), recent ? "%b %e %H:%M" : "%b %e  %Y", &tm_info);
+    }
+    return snprintf(out, size, "%s 1 user group %lld %s %s\r\n",
+                    is_dir ? "drwxr-xr-x" : "-rw-r--r--",
+                    st && !is_dir ? (long long)st->st_size : 0LL, date, name);
+}
+
+void ListingBackend::render() {
+    len = 0;
+    pos = 0;
+
+    // Only start an entry while a worst-case line still fits, so none is ever split
+    IFileSystem::DirEntry entry;
+    while (dir >= 0 && size - len >= FTP_LIST_MAX_LINE && fs.readdir(dir, &entry) > 0) {
+        const char *name = entry.name;
+        if (format == MLSD && (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)) continue;
+
+        // Directories the filesystem typed need no stat() at all
+        bool is_dir = entry.is_dir;
+        const struct stat *pst = entry.has_stat ? &entry.st : nullptr;
+        if (!is_dir && !pst) {
+            char fullpath[FTP_PATH_MAX + 258];
+            snprintf(fullpath, sizeof(fullpath), "%s/%s", strcmp(path, "/") ? path : "", name);
+            if (fs.stat(fullpath, &entry.st) != 0) continue;
+            is_dir = S_ISDIR(entry.st.st_mode);
+            pst = &entry.st;
+        }
+
+        int n = formatEntry(buf + len, FTP_LIST_MAX_LINE, format, name, is_dir, pst, now);
+        if (n > 0 && n < FTP_LIST_MAX_LINE) len += n;
+    }
+
+    if (dir >= 0 && size - len >= FTP_LIST_MAX_LINE) {
+        fs.closedir(dir);
+        dir = -1;
+    }
+    appendCapture();
+}
+
+ssize_t ListingBackend::pump(int sock, size_t max) {
+    if (pos == len) {
+        render();
+        if (len == 0) return 0;
+    }
+
+    size_t left = len - pos;
+    ssize_t sent = send(sock, buf + pos, left < max ? left : max, MSG_DONTWAIT);
+    if (sent > 0) pos += sent;
+    return sent;
+}
+
+ssize_t ListingBackend::read(void *out, size_t max) {
+    if (pos == len) {
+        render();
+        if (len == 0) return 0;
+    }
+
+    size_t n = len - pos < max ? len - pos : max;
+    memcpy(out, buf + pos, n);
+    pos += n;
+    return n;
+}
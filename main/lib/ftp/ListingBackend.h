@@ -0,0 +1,57 @@
+#pragma once
+#include <stddef.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "TransferBackend.h"
+#include "FileSystem.h"
+
+#define FTP_LIST_MAX_LINE 320   // Longest rendered entry: facts + 255 byte name + CRLF
+
+// Streams a directory listing to the data socket. Entries are rendered into
+// one large buffer and sent in bulk instead of one send() per entry.
+class ListingBackend : public ITransferBackend {
+public:
+    enum Format {
+        LIST,   // ls -l style, for humans and legacy clients
+        MLSD,   // RFC 3659 machine listing with exact size and UTC modify facts
+    };
+
+    // Takes over dir, an open directory of fs at path. With capture_limit > 0
+    // a copy of everything sent is kept (up to that many bytes) so the
+    // complete listing can be cached afterwards.
+    ListingBackend(IFileSystem &fs, int dir, const char *path, Format format, char *buf, size_t size,
+                   size_t capture_limit = 0);
+    ~ListingBackend() override;
+
+    ssize_t pump(int sock, size_t max) override;
+    ssize_t read(void *out, size_t max) override;
+
+    // Hands over the malloc'd copy of the whole listing once it has been sent, else nullptr
+    char *takeCapture(size_t *len);
+
+    const char *getPath() const { return path; }
+    Format getFormat() const { return format; }
+
+    // Renders one entry. st may be null when the directory entry type already
+    // told us everything the format needs.
+    static int formatEntry(char *out, size_t size, Format format, const char *name,
+                           bool is_dir, const struct stat *st, time_t now);
+
+private:
+    IFileSystem &fs;
+    int dir;            // -1 once every entry is rendered
+    char path[256];
+    Format format;
+    char *buf;
+    size_t size;
+    size_t len = 0;
+    size_t pos = 0;
+    time_t now;
+    char *capture = nullptr;
+    size_t capture_len = 0;
+    size_t capture_cap = 0;
+    size_t capture_limit;
+
+    void render();
+    void appendCapture();
+};
@@ -0,0 +1,153 @@
+#include "ListingCache.h"
+#include <stdlib.h>
+#include <string.h>
+
+ListingCache::ListingCache() {
+    for (Entry &e : entries) {
+        e.data = nullptr;
+        e.len = 0;
+        e.pins = 0;
+        e.stale = false;
+    }
+}
+
+ListingCache::~ListingCache() {
+    for (Entry &e : entries) {
+        free(e.data);
+    }
+}
+
+bool ListingCache::normalize(const char *in, char *out, size_t size) {
+    // "/fat//logs/" and "/fat/logs" must share one entry
+    size_t n = 0;
+    for (const char *p = in; *p; p++) {
+        if (*p == '/' && n > 0 && out[n - 1] == '/') continue;
+        if (n + 1 >= size) return false;
+        out[n++] = *p;
+    }
+    if (n > 1 && out[n - 1] == '/') n--;
+    out[n] = 0;
+    return true;
+}
+
+void ListingCache::drop(Entry &e) {
+    if (!e.data) return;
+    if (e.pins > 0) {
+        e.stale = true;
+        return;
+    }
+    used -= e.len;
+    free(e.data);
+    e.data = nullptr;
+    e.len = 0;
+    e.stale = false;
+}
+
+int ListingCache::acquire(const char *dir, int format, long long now_ms, const char **data, size_t *len) {
+    char key[sizeof(entries[0].dir)];
+    if (normalize(dir, key, sizeof(key))) {
+        for (int i = 0; i < FTP_LIST_CACHE_ENTRIES; i++) {
+            Entry &e = entries[i];
+            if (!e.data || e.stale || e.format != format || strcmp(e.dir, key) != 0) continue;
+
+            if (now_ms - e.stored_ms > FTP_LIST_CACHE_TTL_MS) {
+                drop(e);
+                break;
+            }
+            e.pins++;
+            e.used_ms = now_ms;
+            *data = e.data;
+            *len = e.len;
+            st.hits++;
+            return i;
+        }
+    }
+    st.misses++;
+    return -1;
+}
+
+void ListingCache::release(int handle) {
+    if (handle < 0 || handle >= FTP_LIST_CACHE_ENTRIES) return;
+    Entry &e = entries[handle];
+    if (e.pins > 0) e.pins--;
+    if (e.pins == 0 && e.stale) drop(e);
+}
+
+bool ListingCache::makeRoom(size_t len) {
+    // Evict least recently used unpinned entries until there is a free slot and budget
+    for (;;) {
+        bool have_slot = false;
+        for (Entry &e : entries) have_slot |= e.data == nullptr;
+        if (have_slot && used + len <= FTP_LIST_CACHE_BYTES) return true;
+
+        Entry *victim = nullptr;
+        for (Entry &e : entries) {
+            if (e.data && e.pins == 0 && (!victim || e.used_ms < victim->used_ms)) victim = &e;
+        }
+        if (!victim) return false;
+        drop(*victim);
+        st.evictions++;
+    }
+}
+
+void ListingCache::store(const char *dir, int format, char *data, size_t len, uint32_t gen, long long now_ms) {
+    char key[sizeof(entries[0].dir)];
+    if (gen != this->gen || len == 0 || len > FTP_LIST_CACHE_BYTES || !normalize(dir, key, sizeof(key))) {
+        free(data);
+        return;
+    }
+
+    for (Entry &e : entries) {
+        if (e.data && e.format == format && strcmp(e.dir, key) == 0) drop(e);
+    }
+    if (!makeRoom(len)) {
+        free(data);
+        return;
+    }
+
+    for (Entry &e : entries) {
+        if (e.data) continue;
+        strcpy(e.dir, key);
+        e.format = format;
+        e.data = data;
+        e.len = len;
+        e.stored_ms = now_ms;
+        e.used_ms = now_ms;
+        e.pins = 0;
+        e.stale = false;
+        used += len;
+        st.stores++;
+        return;
+    }
+    free(data);
+}
+
+void ListingCache::invalidate(const char *dir) {
+    gen++;
+    st.invalidations++;
+
+    char key[sizeof(entries[0].dir)];
+    if (!normalize(dir, key, sizeof(key))) return;
+    for (Entry &e : entries) {
+        if (e.data && strcmp(e.dir, key) == 0) drop(e);
+    }
+}
+
+void ListingCache::invalidateParent(const char *path) {
+    char dir[sizeof(entries[0].dir)];
+    if (!normalize(path, dir, sizeof(dir))) {
+        // Too long to be cached, but in-flight renders must still be discarded
+        gen++;
+        st.invalidations++;
+        return;
+    }
+    char *slash = strrchr(dir, '/');
+    if (slash == dir) slash[1] = 0;
+    else if (slash) *slash = 0;
+    invalidate(dir);
+}
+
+void ListingCache::clear() {
+    gen++;
+    for (Entry &e : entries) drop(e);
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define FTP_LIST_CACHE_ENTRIES 4
+#define FTP_LIST_CACHE_BYTES 16384      // Rendered bytes kept across all entries
+#define FTP_LIST_CACHE_TTL_MS 30000     // Bounds staleness from writes that bypass FtpServer
+
+// Bounded in-RAM cache of rendered directory listings, keyed by directory
+// path and listing format. Writers invalidate the directories they touch.
+class ListingCache {
+public:
+    struct Stats {
+        uint32_t hits;
+        uint32_t misses;
+        uint32_t stores;
+        uint32_t invalidations;
+        uint32_t evictions;
+    };
+
+    ListingCache();
+    ~ListingCache();
+
+    ListingCache(const ListingCache&) = delete;
+    ListingCache& operator=(const ListingCache&) = delete;
+
+    // Returns a handle and pins the entry until release(), or -1 on a miss.
+    int acquire(const char *dir, int format, long long now_ms, const char **data, size_t *len);
+    void release(int handle);
+
+    // Takes ownership of a malloc'd rendering. It is dropped instead if any
+    // invalidation happened since generation() returned gen.
+    void store(const char *dir, int format, char *data, size_t len, uint32_t gen, long long now_ms);
+
+    void invalidate(const char *dir);
+    void invalidateParent(const char *path);
+    void clear();
+
+    uint32_t generation() const { return gen; }
+    const Stats &stats() const { return st; }
+    size_t bytes() const { return used; }
+
+private:
+    struct Entry {
+        char dir[160];
+        int format;
+        char *data;         // nullptr: free slot
+        size_t len;
+        long long stored_ms;
+        long long used_ms;
+        int pins;           // Transfers currently sending straight from data
+        bool stale;         // Invalidated while pinned, freed on the last release
+    };
+
+    Entry entries[FTP_LIST_CACHE_ENTRIES];
+    size_t used = 0;
+    uint32_t gen = 0;
+    Stats st = {};
+
+    static bool normalize(const char *in, char *out, size_t size);
+    void drop(Entry &e);
+    bool makeRoom(size_t len);
+};
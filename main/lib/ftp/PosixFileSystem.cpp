@@ -0,0 +1,136 @@
+#include "PosixFileSystem.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+PosixFileSystem::PosixFileSystem(const char *root) {
+    setRoot(root);
+}
+
+PosixFileSystem::~PosixFileSystem() {
+    for (DIR *&d : dirs) {
+        if (d) ::closedir(d);
+        d = nullptr;
+    }
+}
+
+void PosixFileSystem::setRoot(const char *root) {
+    snprintf(this->root, sizeof(this->root), "%s", root);
+}
+
+bool PosixFileSystem::hostPath(const char *path, char *out, size_t size) const {
+    // "/" is the root itself, so a root of "/fat" never turns into "/fat/"
+    int n = strcmp(path, "/") == 0 && root[0] ? snprintf(out, size, "%s", root)
+                                             : snprintf(out, size, "%s%s", root, path);
+    if (n < 0 || (size_t)n >= size) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    return true;
+}
+
+int PosixFileSystem::open(const char *path, int flags) {
+    char full[FTP_PATH_MAX + sizeof(root)];
+    if (!hostPath(path, full, sizeof(full))) return -1;
+    return ::open(full, flags, 0644);
+}
+
+int PosixFileSystem::close(int fd) {
+    return ::close(fd);
+}
+
+ssize_t PosixFileSystem::read(int fd, void *buf, size_t len) {
+    return ::read(fd, buf, len);
+}
+
+ssize_t PosixFileSystem::write(int fd, const void *buf, size_t len) {
+    return ::write(fd, buf, len);
+}
+
+off_t PosixFileSystem::lseek(int fd, off_t offset, int whence) {
+    return ::lseek(fd, offset, whence);
+}
+
+int PosixFileSystem::ftruncate(int fd, off_t length) {
+    return ::ftruncate(fd, length);
+}
+
+int PosixFileSystem::fstat(int fd, struct stat *st) {
+    return ::fstat(fd, st);
+}
+
+int PosixFileSystem::stat(const char *path, struct stat *st) {
+    char full[FTP_PATH_MAX + sizeof(root)];
+    if (!hostPath(path, full, sizeof(full))) return -1;
+    return ::stat(full, st);
+}
+
+int PosixFileSystem::unlink(const char *path) {
+    char full[FTP_PATH_MAX + sizeof(root)];
+    if (!hostPath(path, full, sizeof(full))) return -1;
+    return ::unlink(full);
+}
+
+int PosixFileSystem::mkdir(const char *path) {
+    char full[FTP_PATH_MAX + sizeof(root)];
+    if (!hostPath(path, full, sizeof(full))) return -1;
+    return ::mkdir(full, 0755);
+}
+
+int PosixFileSystem::rmdir(const char *path) {
+    char full[FTP_PATH_MAX + sizeof(root)];
+    if (!hostPath(path, full, sizeof(full))) return -1;
+    return ::rmdir(full);
+}
+
+int PosixFileSystem::rename(const char *from, const char *to) {
+    char src[FTP_PATH_MAX + sizeof(root)];
+    char dst[FTP_PATH_MAX + sizeof(root)];
+    if (!hostPath(from, src, sizeof(src)) || !hostPath(to, dst, sizeof(dst))) return -1;
+    if (::rename(src, dst) == 0) return 0;
+
+    // FatFs refuses to replace an existing file; make room for it like POSIX would
+    struct stat st;
+    if (errno != EEXIST || ::stat(dst, &st) != 0 || !S_ISREG(st.st_mode) || ::unlink(dst) != 0) return -1;
+    return ::rename(src, dst);
+}
+
+int PosixFileSystem::opendir(const char *path) {
+    int slot = 0;
+    while (slot < FTP_POSIX_MAX_DIRS && dirs[slot]) slot++;
+    if (slot == FTP_POSIX_MAX_DIRS) {
+        errno = EMFILE;
+        return -1;
+    }
+
+    char full[FTP_PATH_MAX + sizeof(root)];
+    if (!hostPath(path, full, sizeof(full))) return -1;
+    dirs[slot] = ::opendir(full);
+    return dirs[slot] ? slot : -1;
+}
+
+int PosixFileSystem::readdir(int dir, DirEntry *entry) {
+    if (dir < 0 || dir >= FTP_POSIX_MAX_DIRS || !dirs[dir]) {
+        errno = EBADF;
+        return -1;
+    }
+    struct dirent *e = ::readdir(dirs[dir]);
+    if (!e) return 0;
+
+    // The VFS usually reports the type; directories then need no stat() at all
+    snprintf(entry->name, sizeof(entry->name), "%s", e->d_name);
+    entry->is_dir = e->d_type == DT_DIR;
+    entry->has_stat = false;
+    return 1;
+}
+
+int PosixFileSystem::closedir(int dir) {
+    if (dir < 0 || dir >= FTP_POSIX_MAX_DIRS || !dirs[dir]) {
+        errno = EBADF;
+        return -1;
+    }
+    int r = ::closedir(dirs[dir]);
+    dirs[dir] = nullptr;
+    return r;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <dirent.h>
+#include "FileSystem.h"
+
+#define FTP_POSIX_MAX_DIRS 8    // Listings open at once
+
+// A directory tree of the process's VFS: the FatFs mount on the target, any
+// directory on the host. File handles are the real descriptors.
+class PosixFileSystem : public IFileSystem {
+public:
+    explicit PosixFileSystem(const char *root = "");
+    ~PosixFileSystem() override;
+
+    PosixFileSystem(const PosixFileSystem&) = delete;
+    PosixFileSystem& operator=(const PosixFileSystem&) = delete;
+
+    void setRoot(const char *root);
+    const char *getRoot() const { return root; }
+
+    int open(const char *path, int flags) override;
+    int close(int fd) override;
+    ssize_t read(int fd, void *buf, size_t len) override;
+    ssize_t write(int fd, const void *buf, size_t len) override;
+    off_t lseek(int fd, off_t offset, int whence) override;
+    int ftruncate(int fd, off_t length) override;
+    int fstat(int fd, struct stat *st) override;
+    int stat(const char *path, struct stat *st) override;
+    int unlink(const char *path) override;
+    int mkdir(const char *path) override;
+    int rmdir(const char *path) override;
+    int rename(const char *from, const char *to) override;
+    int opendir(const char *path) override;
+    int readdir(int dir, DirEntry *entry) override;
+    int closedir(int dir) override;
+    int nativeFd(int fd) override { return fd; }
+
+private:
+    char root[128];
+    DIR *dirs[FTP_POSIX_MAX_DIRS] = {};
+
+    // root + path, false (ENAMETOOLONG) when it doesn't fit
+    bool hostPath(const char *path, char *out, size_t size) const;
+};
@@ -0,0 +1,488 @@
+#include "RamFileSystem.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ContextLock.h"
+
+RamFileSystem::RamFileSystem(size_t capacity) : capacity(capacity) {
+    // Node 0 is the root directory, always there
+    nodes[0].used = true;
+    nodes[0].is_dir = true;
+    strcpy(nodes[0].path, "/");
+    nodes[0].mtime = time(nullptr);
+}
+
+RamFileSystem::~RamFileSystem() {
+    for (File &f : files) {
+        if (f.used) releaseBlob(f.blob);
+    }
+    for (Node &n : nodes) {
+        if (n.used) releaseBlob(n.blob);
+    }
+}
+
+int RamFileSystem::find(const char *path) const {
+    for (int i = 0; i < FTP_RAMFS_NODES; i++) {
+        if (nodes[i].used && strcmp(nodes[i].path, path) == 0) return i;
+    }
+    return -1;
+}
+
+int RamFileSystem::create(const char *path, bool is_dir) {
+    size_t len = strlen(path);
+    if (len >= FTP_RAMFS_NAME) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (path[0] != '/' || find(path) >= 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    if (!hasParent(path)) return -1;
+
+    for (int i = 1; i < FTP_RAMFS_NODES; i++) {
+        if (nodes[i].used) continue;
+        Node &n = nodes[i];
+        n.used = true;
+        n.is_dir = is_dir;
+        memcpy(n.path, path, len + 1);
+        n.blob = nullptr;
+        n.mtime = time(nullptr);
+        return i;
+    }
+    errno = ENOSPC;
+    return -1;
+}
+
+bool RamFileSystem::hasParent(const char *path) const {
+    char parent[FTP_RAMFS_NAME];
+    size_t plen = strrchr(path, '/') - path;
+    if (plen == 0) plen = 1;    // Directly under the root
+    memcpy(parent, path, plen);
+    parent[plen] = 0;
+    int p = find(parent);
+    if (p < 0 || !nodes[p].is_dir) {
+        errno = p < 0 ? ENOENT : ENOTDIR;
+        return false;
+    }
+    return true;
+}
+
+bool RamFileSystem::isChild(int node, int dir) const {
+    if (node == 0 || node == dir) return false;
+    const char *np = nodes[node].path;
+    const char *dp = nodes[dir].path;
+    const char *rest;
+    if (dir == 0) {
+        rest = np + 1;
+    } else {
+        size_t dl = strlen(dp);
+        if (strncmp(np, dp, dl) != 0 || np[dl] != '/') return false;
+        rest = np + dl + 1;
+    }
+    return strchr(rest, '/') == nullptr;
+}
+
+RamFileSystem::File *RamFileSystem::file(int fd) {
+    if (fd < 0 || fd >= FTP_RAMFS_FILES || !files[fd].used) {
+        errno = EBADF;
+        return nullptr;
+    }
+    return &files[fd];
+}
+
+RamFileSystem::Blob *RamFileSystem::allocBlob(size_t cap) {
+    if (used + cap > capacity) {
+        errno = ENOSPC;
+        return nullptr;
+    }
+    Blob *b = (Blob *)malloc(sizeof(Blob) + cap);
+    if (!b) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    b->refs = 1;
+    b->size = 0;
+    b->cap = cap;
+    used += cap;
+    return b;
+}
+
+void RamFileSystem::releaseBlob(Blob *b) {
+    if (!b || --b->refs > 0) return;
+    used -= b->cap;
+    free(b);
+}
+
+bool RamFileSystem::reserve(Blob *&b, size_t size) {
+    // Writes go to an unshared blob: one a reader still holds is copied first
+    if (b && b->refs == 1 && b->cap >= size) return true;
+
+    size_t cap = b ? b->cap : 0;
+    if (cap < size) cap = size > 2 * cap ? size : 2 * cap;
+    if (cap < 64) cap = 64;
+    Blob *grown = allocBlob(cap);
+    if (!grown && cap > size) grown = allocBlob(size);
+    if (!grown) return false;
+    if (b) {
+        memcpy(grown->data(), b->data(), b->size);
+        grown->size = b->size;
+        releaseBlob(b);
+    }
+    b = grown;
+    return true;
+}
+
+void RamFileSystem::fillStat(const Node &n, const Blob *b, struct stat *st) const {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = n.is_dir ? S_IFDIR | 0755 : S_IFREG | 0644;
+    st->st_nlink = 1;
+    st->st_size = b ? b->size : 0;
+    st->st_mtime = n.mtime;
+}
+
+bool RamFileSystem::writeFile(const char *path, const void *data, size_t len) {
+    LOCK(mutex);
+    int n = find(path);
+    if (n < 0) n = create(path, false);
+    if (n < 0 || nodes[n].is_dir) return false;
+
+    Blob *b = nullptr;
+    if (len > 0) {
+        b = allocBlob(len);
+        if (!b) return false;
+        memcpy(b->data(), data, len);
+        b->size = len;
+    }
+    // Readers of the old content keep their reference to it
+    releaseBlob(nodes[n].blob);
+    nodes[n].blob = b;
+    nodes[n].mtime = time(nullptr);
+    return true;
+}
+
+bool RamFileSystem::appendFile(const char *path, const void *data, size_t len) {
+    LOCK(mutex);
+    int n = find(path);
+    if (n < 0) n = create(path, false);
+    if (n < 0 || nodes[n].is_dir) return false;
+    if (len == 0) return true;
+
+    Blob *&b = nodes[n].blob;
+    size_t old = b ? b->size : 0;
+    if (!reserve(b, old + len)) return false;
+    memcpy(b->data() + old, data, len);
+    b->size = old + len;
+    nodes[n].mtime = time(nullptr);
+    return true;
+}
+
+size_t RamFileSystem::bytesUsed() const {
+    LOCK(mutex);
+    return used;
+}
+
+int RamFileSystem::open(const char *path, int flags) {
+    LOCK(mutex);
+    int acc = flags & O_ACCMODE;
+    int n = find(path);
+    if (n < 0) {
+        if (acc == O_RDONLY || !(flags & O_CREAT)) {
+            errno = ENOENT;
+            return -1;
+        }
+    } else if (nodes[n].is_dir) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    int fd = 0;
+    while (fd < FTP_RAMFS_FILES && files[fd].used) fd++;
+    if (fd == FTP_RAMFS_FILES) {
+        errno = EMFILE;
+        return -1;
+    }
+    if (n < 0 && (n = create(path, false)) < 0) return -1;
+
+    // Both readers and writers start out sharing the current content; a
+    // writer gets its own copy on the first change
+    File &f = files[fd];
+    f.used = true;
+    f.writing = acc != O_RDONLY;
+    f.node = n;
+    f.pos = 0;
+    f.blob = f.writing && (flags & O_TRUNC) ? nullptr : nodes[n].blob;
+    if (f.blob) f.blob->refs++;
+    if (flags & O_APPEND) f.pos = f.blob ? f.blob->size : 0;
+    return fd;
+}
+
+int RamFileSystem::close(int fd) {
+    LOCK(mutex);
+    File *f = file(fd);
+    if (!f) return -1;
+    if (f->writing) {
+        // The upload becomes the content in one step, the file reference moves to the node
+        Node &n = nodes[f->node];
+        releaseBlob(n.blob);
+        n.blob = f->blob;
+        n.mtime = time(nullptr);
+    } else {
+        releaseBlob(f->blob);
+    }
+    *f = {};
+    return 0;
+}
+
+ssize_t RamFileSystem::read(int fd, void *buf, size_t len) {
+    LOCK(mutex);
+    File *f = file(fd);
+    if (!f) return -1;
+    if (f->writing) {
+        errno = EBADF;
+        return -1;
+    }
+    size_t size = f->blob ? f->blob->size : 0;
+    size_t n = f->pos < size ? size - f->pos : 0;
+    if (n > len) n = len;
+    if (n) memcpy(buf, f->blob->data() + f->pos, n);
+    f->pos += n;
+    return n;
+}
+
+ssize_t RamFileSystem::write(int fd, const void *buf, size_t len) {
+    LOCK(mutex);
+    File *f = file(fd);
+    if (!f) return -1;
+    if (!f->writing) {
+        errno = EBADF;
+        return -1;
+    }
+    if (len == 0) return 0;
+
+    size_t size = f->blob ? f->blob->size : 0;
+    size_t end = f->pos + len;
+    if (!reserve(f->blob, end > size ? end : size)) return -1;
+    Blob *b = f->blob;
+    if (f->pos > size) memset(b->data() + size, 0, f->pos - size);
+    memcpy(b->data() + f->pos, buf, len);
+    if (end > b->size) b->size = end;
+    f->pos = end;
+    return len;
+}
+
+off_t RamFileSystem::lseek(int fd, off_t offset, int whence) {
+    LOCK(mutex);
+    File *f = file(fd);
+    if (!f) return -1;
+    off_t base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? (off_t)f->pos : (off_t)(f->blob ? f->blob->size : 0);
+    if (base + offset < 0 || (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END)) {
+        errno = EINVAL;
+        return -1;
+    }
+    f->pos = base + offset;
+    return f->pos;
+}
+
+int RamFileSystem::ftruncate(int fd, off_t length) {
+    LOCK(mutex);
+    File *f = file(fd);
+    if (!f) return -1;
+    if (!f->writing || length < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t size = f->blob ? f->blob->size : 0;
+    if ((size_t)length == size) return 0;
+    if (!reserve(f->blob, length)) return -1;
+    if ((size_t)length > size) memset(f->blob->data() + size, 0, length - size);
+    f->blob->size = length;
+    return 0;
+}
+
+int RamFileSystem::fstat(int fd, struct stat *st) {
+    LOCK(mutex);
+    File *f = file(fd);
+    if (!f) return -1;
+    fillStat(nodes[f->node], f->blob, st);
+    return 0;
+}
+
+int RamFileSystem::stat(const char *path, struct stat *st) {
+    LOCK(mutex);
+    int n = find(path);
+    if (n < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    fillStat(nodes[n], nodes[n].blob, st);
+    return 0;
+}
+
+int RamFileSystem::unlink(const char *path) {
+    LOCK(mutex);
+    int n = find(path);
+    if (n < 0 || nodes[n].is_dir) {
+        errno = n < 0 ? ENOENT : EISDIR;
+        return -1;
+    }
+    // Like FatFs, an open file can't be removed
+    for (File &f : files) {
+        if (f.used && f.node == n) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+    releaseBlob(nodes[n].blob);
+    nodes[n] = {};
+    return 0;
+}
+
+int RamFileSystem::mkdir(const char *path) {
+    LOCK(mutex);
+    return create(path, true) < 0 ? -1 : 0;
+}
+
+int RamFileSystem::rmdir(const char *path) {
+    LOCK(mutex);
+    int n = find(path);
+    if (n < 0 || !nodes[n].is_dir) {
+        errno = n < 0 ? ENOENT : ENOTDIR;
+        return -1;
+    }
+    if (n == 0) {
+        errno = EBUSY;
+        return -1;
+    }
+    for (int i = 0; i < FTP_RAMFS_NODES; i++) {
+        if (nodes[i].used && isChild(i, n)) {
+            errno = ENOTEMPTY;
+            return -1;
+        }
+    }
+    for (Dir &d : dirs) {
+        if (d.used && d.node == n) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+    nodes[n] = {};
+    return 0;
+}
+
+int RamFileSystem::rename(const char *from, const char *to) {
+    LOCK(mutex);
+    int n = find(from);
+    if (n <= 0) {
+        errno = n < 0 ? ENOENT : EBUSY;
+        return -1;
+    }
+    size_t from_len = strlen(from);
+    size_t to_len = strlen(to);
+    if (strcmp(from, to) == 0) return 0;
+    if (to_len > from_len && strncmp(to, from, from_len) == 0 && to[from_len] == '/') {
+        errno = EINVAL;     // A directory can't move into itself
+        return -1;
+    }
+
+    // An existing file is replaced, like an upload would; nothing else is
+    int old = find(to);
+    if (old >= 0) {
+        if (nodes[old].is_dir || nodes[n].is_dir) {
+            errno = nodes[old].is_dir ? EISDIR : EEXIST;
+            return -1;
+        }
+        for (File &f : files) {
+            if (f.used && f.node == old) {
+                errno = EBUSY;
+                return -1;
+            }
+        }
+    }
+
+    if (to_len >= FTP_RAMFS_NAME) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (!hasParent(to)) return -1;
+
+    // Everything below a directory moves along; make sure every new path fits first
+    for (int i = 1; i < FTP_RAMFS_NODES; i++) {
+        if (i == n || !nodes[i].used || strncmp(nodes[i].path, from, from_len) != 0 ||
+            nodes[i].path[from_len] != '/') continue;
+        if (to_len + strlen(nodes[i].path + from_len) >= FTP_RAMFS_NAME) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+    }
+    for (int i = 1; i < FTP_RAMFS_NODES; i++) {
+        if (i == n || !nodes[i].used || strncmp(nodes[i].path, from, from_len) != 0 ||
+            nodes[i].path[from_len] != '/') continue;
+        char path[FTP_RAMFS_NAME];
+        snprintf(path, sizeof(path), "%s%s", to, nodes[i].path + from_len);
+        strcpy(nodes[i].path, path);
+    }
+
+    if (old >= 0) {
+        releaseBlob(nodes[old].blob);
+        nodes[old] = {};
+    }
+    memcpy(nodes[n].path, to, to_len + 1);
+    return 0;
+}
+
+int RamFileSystem::opendir(const char *path) {
+    LOCK(mutex);
+    int n = find(path);
+    if (n < 0 || !nodes[n].is_dir) {
+        errno = n < 0 ? ENOENT : ENOTDIR;
+        return -1;
+    }
+    for (int i = 0; i < FTP_RAMFS_DIRS; i++) {
+        if (dirs[i].used) continue;
+        dirs[i] = { true, n, 1 };
+        return i;
+    }
+    errno = EMFILE;
+    return -1;
+}
+
+int RamFileSystem::readdir(int dir, DirEntry *entry) {
+    LOCK(mutex);
+    if (dir < 0 || dir >= FTP_RAMFS_DIRS || !dirs[dir].used) {
+        errno = EBADF;
+        return -1;
+    }
+    Dir &d = dirs[dir];
+    while (d.next < FTP_RAMFS_NODES) {
+        int i = d.next++;
+        if (!nodes[i].used || !isChild(i, d.node)) continue;
+        const Node &n = nodes[i];
+        snprintf(entry->name, sizeof(entry->name), "%s", strrchr(n.path, '/') + 1);
+        entry->is_dir = n.is_dir;
+        entry->has_stat = true;
+        fillStat(n, n.blob, &entry->st);
+        return 1;
+    }
+    return 0;
+}
+
+int RamFileSystem::closedir(int dir) {
+    LOCK(mutex);
+    if (dir < 0 || dir >= FTP_RAMFS_DIRS || !dirs[dir].used) {
+        errno = EBADF;
+        return -1;
+    }
+    dirs[dir] = {};
+    return 0;
+}
+
+const void *RamFileSystem::map(int fd, size_t *size) {
+    LOCK(mutex);
+    File *f = file(fd);
+    if (!f || f->writing) return nullptr;
+    // The reader's reference keeps the content in place until close()
+    *size = f->blob ? f->blob->size : 0;
+    return f->blob ? f->blob->data() : (const void *)"";
+}
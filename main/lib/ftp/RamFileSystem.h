@@ -0,0 +1,93 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "FileSystem.h"
+#include "RecursiveMutex.h"
+
+#define FTP_RAMFS_NODES 16      // Files and directories, the root included
+#define FTP_RAMFS_NAME 64       // Longest path inside the filesystem, terminator included
+#define FTP_RAMFS_FILES 8       // Files open at once
+#define FTP_RAMFS_DIRS 4        // Listings open at once
+
+// Files held in RAM: status snapshots and live logs the firmware publishes,
+// served without touching flash. A reader sees the content as it was when it
+// opened the file and an upload replaces the content when it is closed, so
+// the firmware can keep writing while clients download.
+class RamFileSystem : public IFileSystem {
+public:
+    // capacity bounds the bytes allocated for file contents
+    explicit RamFileSystem(size_t capacity);
+    ~RamFileSystem() override;
+
+    RamFileSystem(const RamFileSystem&) = delete;
+    RamFileSystem& operator=(const RamFileSystem&) = delete;
+
+    // For the firmware, from any task: replace or extend a file's content,
+    // creating the file if needed (its directory must exist)
+    bool writeFile(const char *path, const void *data, size_t len);
+    bool appendFile(const char *path, const void *data, size_t len);
+    size_t bytesUsed() const;
+
+    int open(const char *path, int flags) override;
+    int close(int fd) override;
+    ssize_t read(int fd, void *buf, size_t len) override;
+    ssize_t write(int fd, const void *buf, size_t len) override;
+    off_t lseek(int fd, off_t offset, int whence) override;
+    int ftruncate(int fd, off_t length) override;
+    int fstat(int fd, struct stat *st) override;
+    int stat(const char *path, struct stat *st) override;
+    int unlink(const char *path) override;
+    int mkdir(const char *path) override;
+    int rmdir(const char *path) override;
+    int rename(const char *from, const char *to) override;
+    int opendir(const char *path) override;
+    int readdir(int dir, DirEntry *entry) override;
+    int closedir(int dir) override;
+    const void *map(int fd, size_t *size) override;
+
+private:
+    // File content, shared by the node and every reader that opened it
+    struct Blob {
+        uint32_t refs;
+        size_t size;
+        size_t cap;
+        uint8_t *data() { return reinterpret_cast<uint8_t *>(this + 1); }
+    };
+    struct Node {
+        bool used;
+        bool is_dir;
+        char path[FTP_RAMFS_NAME];
+        Blob *blob;         // nullptr while empty
+        time_t mtime;
+    };
+    struct File {
+        bool used;
+        bool writing;       // blob is a private copy, published by close()
+        int node;
+        Blob *blob;
+        size_t pos;
+    };
+    struct Dir {
+        bool used;
+        int node;
+        int next;           // Node index to look at next
+    };
+
+    Node nodes[FTP_RAMFS_NODES] = {};
+    File files[FTP_RAMFS_FILES] = {};
+    Dir dirs[FTP_RAMFS_DIRS] = {};
+    size_t capacity;
+    size_t used = 0;
+    RecursiveMutex mutex;
+
+    int find(const char *path) const;
+    int create(const char *path, bool is_dir);
+    bool hasParent(const char *path) const;
+    bool isChild(int node, int dir) const;
+    File *file(int fd);
+    Blob *allocBlob(size_t cap);
+    void releaseBlob(Blob *b);
+    bool reserve(Blob *&b, size_t size);
+    void fillStat(const Node &n, const Blob *b, struct stat *st) const;
+};
@@ -0,0 +1,48 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define FTP_RATE_BURST_MS 100   // Bucket depth in time at the configured rate
+
+// Byte budget refilled at a fixed rate. A rate of 0 means unlimited.
+class TokenBucket {
+public:
+    void setRate(uint32_t bytes_per_sec, size_t min_depth, long long now_ms) {
+        rate = bytes_per_sec;
+        // Deep enough for at least one whole grant, or a slow bucket could never fill it
+        depth = (size_t)rate * FTP_RATE_BURST_MS / 1000;
+        if (depth < min_depth) depth = min_depth;
+        tokens = depth;
+        last_ms = now_ms;
+    }
+
+    void refill(long long now_ms) {
+        if (rate == 0) return;
+        // Only advance the clock once a whole byte accrued, so slow rates still add up
+        long long add = (now_ms - last_ms) * rate / 1000;
+        if (add <= 0) return;
+        last_ms = now_ms;
+        tokens = (size_t)add >= depth - tokens ? depth : tokens + (size_t)add;
+    }
+
+    size_t available() const { return rate == 0 ? SIZE_MAX : tokens; }
+
+    void consume(size_t n) {
+        if (rate == 0) return;
+        tokens = n < tokens ? tokens - n : 0;
+    }
+
+    // Milliseconds until n bytes are available
+    int msUntil(size_t n) const {
+        if (rate == 0 || tokens >= n) return 0;
+        return (int)(((n - tokens) * 1000ULL + rate - 1) / rate);
+    }
+
+    uint32_t getRate() const { return rate; }
+
+private:
+    uint32_t rate = 0;
+    size_t depth = 0;
+    size_t tokens = 0;
+    long long last_ms = 0;
+};
@@ -0,0 +1,116 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+#include "FileSystem.h"
+
+// Moves outgoing transfer data to a data socket in bounded, non-blocking steps.
+class ITransferBackend {
+public:
+    virtual ~ITransferBackend() = default;
+
+    // Sends at most max bytes. Returns the number of bytes sent, 0 once the
+    // source is exhausted, or -1 with errno set (EAGAIN: socket full, retry later).
+    virtual ssize_t pump(int sock, size_t max) = 0;
+
+    // Copies at most max bytes of the same data into out instead, for a stage
+    // such as MODE Z compression between the source and the socket. Returns
+    // like pump(); a transfer uses either pump() or read(), never both.
+    virtual ssize_t read(void *out, size_t max) = 0;
+};
+
+// Portable fallback: file -> caller-provided buffer -> socket.
+class CopyBackend : public ITransferBackend {
+    IFileSystem &fs;
+    int fd;
+    char *buf;
+    size_t size;
+    size_t len = 0;
+    size_t pos = 0;
+
+public:
+    CopyBackend(IFileSystem &fs, int fd, char *buf, size_t size) : fs(fs), fd(fd), buf(buf), size(size) {}
+
+    ssize_t pump(int sock, size_t max) override {
+        // Refill only once the previous chunk is fully on the wire, so a slow
+        // client never makes us buffer more than one chunk.
+        if (pos == len) {
+            ssize_t n = fs.read(fd, buf, size < max ? size : max);
+            if (n <= 0) return n;
+            len = n;
+            pos = 0;
+        }
+
+        size_t left = len - pos;
+        ssize_t sent = send(sock, buf + pos, left < max ? left : max, MSG_DONTWAIT);
+        if (sent > 0) pos += sent;
+        return sent;
+    }
+
+    ssize_t read(void *out, size_t max) override {
+        return fs.read(fd, out, max);
+    }
+};
+
+// Zero-copy from a read-only region that is already addressable, such as a
+// memory-mapped flash partition or a RAM-resident file.
+class MappedBackend : public ITransferBackend {
+    const uint8_t *data;
+    size_t size;
+    size_t pos = 0;
+
+public:
+    MappedBackend(const void *data, size_t size)
+        : data(static_cast<const uint8_t *>(data)), size(size) {}
+
+    ssize_t pump(int sock, size_t max) override {
+        if (pos == size) return 0;
+        size_t left = size - pos;
+        ssize_t sent = send(sock, data + pos, left < max ? left : max, MSG_DONTWAIT);
+        if (sent > 0) pos += sent;
+        return sent;
+    }
+
+    ssize_t read(void *out, size_t max) override {
+        size_t left = size - pos;
+        size_t n = left < max ? left : max;
+        memcpy(out, data + pos, n);
+        pos += n;
+        return n;
+    }
+};
+
+#if defined(__linux__)
+// Zero-copy on the host build: the kernel moves page cache pages straight to the socket.
+class SendfileBackend : public ITransferBackend {
+    int fd;
+    off_t offset;
+    bool nonblocking = false;
+
+public:
+    explicit SendfileBackend(int fd, off_t offset = 0) : fd(fd), offset(offset) {}
+
+    ssize_t pump(int sock, size_t max) override {
+        // sendfile() has no MSG_DONTWAIT, it follows the socket's own O_NONBLOCK
+        if (!nonblocking) {
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+            nonblocking = true;
+        }
+        return sendfile(sock, fd, &offset, max);
+    }
+
+    ssize_t read(void *out, size_t max) override {
+        ssize_t n = pread(fd, out, max, offset);
+        if (n > 0) offset += n;
+        return n;
+    }
+};
+#endif
@@ -0,0 +1,845 @@
+#include "Zlib.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+
+static_assert(FTP_DEFLATE_WINDOW_BITS >= 9 && FTP_DEFLATE_WINDOW_BITS <= 14,
+              "window positions + 1 must fit the uint16_t hash chains");
+static_assert(FTP_INFLATE_WINDOW_BITS >= 8 && FTP_INFLATE_WINDOW_BITS <= 15, "zlib windows are 256 B..32 KiB");
+
+static constexpr unsigned MIN_MATCH = 3;
+static constexpr unsigned MAX_MATCH = 258;
+
+// Length symbols 257..285 and distance symbols 0..29: base value and extra bits
+static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                         35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                         3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+                                       513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7,
+                                       8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+static uint32_t adler32(uint32_t adler, const uint8_t *p, size_t len) {
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+    while (len) {
+        // Largest run that cannot overflow b before the modulo
+        size_t n = len < 5552 ? len : 5552;
+        len -= n;
+        while (n--) {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+// Huffman codes go out most significant bit first, putBits() sends least first
+static constexpr uint16_t reverseBits(unsigned code, int bits) {
+    unsigned r = 0;
+    for (int i = 0; i < bits; i++) r |= ((code >> i) & 1) << (bits - 1 - i);
+    return r;
+}
+
+// The fixed literal/length and distance codes (RFC 1951 3.2.6)
+static constexpr struct FixedCodes {
+    uint16_t lit[288];
+    uint8_t lit_bits[288];
+    uint8_t dist[30];
+
+    constexpr FixedCodes() : lit(), lit_bits(), dist() {
+        for (unsigned s = 0; s < 288; s++) {
+            unsigned code = s < 144 ? 0x30 + s : s < 256 ? 0x190 + s - 144 : s < 280 ? s - 256 : 0xC0 + s - 280;
+            int bits = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8;
+            lit[s] = reverseBits(code, bits);
+            lit_bits[s] = bits;
+        }
+        for (unsigned d = 0; d < 30; d++) dist[d] = reverseBits(d, 5);
+    }
+} fixedCodes;
+
+// Length symbols come in groups of four sharing an extra bit count; index from 0 = symbol 257
+static unsigned lengthIndex(unsigned len) {
+    unsigned lc = len - MIN_MATCH;
+    if (lc < 8) return lc;
+    if (len == MAX_MATCH) return 28;
+    int top = 31 - __builtin_clz(lc);
+    return 4 * (top - 1) + ((lc >> (top - 2)) & 3);
+}
+
+// Distance symbols likewise, in pairs
+static unsigned distIndex(unsigned dist) {
+    unsigned d = dist - 1;
+    if (d < 4) return d;
+    int top = 31 - __builtin_clz(d);
+    return 2 * top + ((d >> (top - 1)) & 1);
+}
+
+// Canonical codes for the given lengths (RFC 1951 3.2.2), bit-reversed
+static void assignCodes(const uint8_t *lengths, int n, uint16_t *codes) {
+    uint16_t count[16] = {};
+    for (int s = 0; s < n; s++) count[lengths[s]]++;
+    count[0] = 0;
+    uint16_t next[16];
+    unsigned code = 0;
+    for (int bits = 1; bits < 16; bits++) {
+        code = (code + count[bits - 1]) << 1;
+        next[bits] = code;
+    }
+    for (int s = 0; s < n; s++) {
+        if (lengths[s]) codes[s] = reverseBits(next[lengths[s]]++, lengths[s]);
+    }
+}
+
+// Huffman code lengths in place (Moffat and Katajainen): a holds n >= 2
+// weights in ascending order and ends up with the code length of each
+static void minimumRedundancy(uint32_t *a, int n) {
+    // Combine the two lightest of the leaves and the trees built so far, each
+    // new tree stored at next, the tree it replaced pointing to it
+    a[0] += a[1];
+    int root = 0, leaf = 2;
+    for (int next = 1; next < n - 1; next++) {
+        if (leaf >= n || a[root] < a[leaf]) {
+            a[next] = a[root];
+            a[root++] = next;
+        } else {
+            a[next] = a[leaf++];
+        }
+        if (leaf >= n || (root < next && a[root] < a[leaf])) {
+            a[next] += a[root];
+            a[root++] = next;
+        } else {
+            a[next] += a[leaf++];
+        }
+    }
+
+    // Parent pointers to internal node depths
+    a[n - 2] = 0;
+    for (int next = n - 3; next >= 0; next--) a[next] = a[a[next]] + 1;
+
+    // Internal node depths to leaf depths
+    int avail = 1, used = 0, depth = 0;
+    root = n - 2;
+    int next = n - 1;
+    while (avail > 0) {
+        while (root >= 0 && (int)a[root] == depth) {
+            used++;
+            root--;
+        }
+        while (avail > used) {
+            a[next--] = depth;
+            avail--;
+        }
+        avail = 2 * used;
+        depth++;
+        used = 0;
+    }
+}
+
+
+/* ==== Deflater ==== */
+static_assert(FTP_DEFLATE_BLOCK_SYMBOLS >= 256 && FTP_DEFLATE_BLOCK_SYMBOLS < 65535,
+              "symbol counts must fit the uint16_t frequencies");
+
+// A match must end inside the lookahead; keeping this much buffered lets
+// every position try the longest one
+static constexpr unsigned MIN_LOOKAHEAD = MAX_MATCH + MIN_MATCH + 1;
+
+// Largest block header: 17 bits of counts, 19 code length codes of 3 bits,
+// and 316 code lengths of at most 7 + 7 bits
+static constexpr size_t MAX_BLOCK_HEADER = (17 + 19 * 3 + 316 * 14 + 7) / 8;
+
+// Order the code length code lengths are sent in (RFC 1951 3.2.7)
+static const uint8_t lengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+Deflater *Deflater::create() {
+    void *mem = malloc(sizeof(Deflater));
+    return mem ? new (mem) Deflater() : nullptr;
+}
+
+void Deflater::destroy(Deflater *d) {
+    if (!d) return;
+    d->~Deflater();
+    free(d);
+}
+
+Deflater::Deflater() {
+    memset(prev, 0, sizeof(prev));
+    memset(head, 0, sizeof(head));
+    memset(lit_freq, 0, sizeof(lit_freq));
+    memset(dist_freq, 0, sizeof(dist_freq));
+
+    // CMF carries the window size; FLG makes the pair a multiple of 31
+    unsigned cmf = ((FTP_DEFLATE_WINDOW_BITS - 8) << 4) | 8;
+    out[out_len++] = cmf;
+    out[out_len++] = 31 - (cmf * 256) % 31;
+}
+
+static inline unsigned hash3(const uint8_t *p) {
+    uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+    return (v * 2654435761u) >> (32 - FTP_DEFLATE_HASH_BITS);
+}
+
+void Deflater::putBits(uint32_t value, int count) {
+    bitbuf |= value << bitcnt;
+    bitcnt += count;
+    while (bitcnt >= 8) {
+        out[out_len++] = (uint8_t)bitbuf;
+        bitbuf >>= 8;
+        bitcnt -= 8;
+    }
+}
+
+void Deflater::putSymbol(unsigned i) {
+    unsigned dist = sym_dist[i];
+    if (dist == 0) {
+        putBits(lit_code[sym_lc[i]], lit_len[sym_lc[i]]);
+        return;
+    }
+    unsigned len = sym_lc[i] + MIN_MATCH;
+    unsigned li = lengthIndex(len);
+    putBits(lit_code[257 + li], lit_len[257 + li]);
+    if (lengthExtra[li]) putBits(len - lengthBase[li], lengthExtra[li]);
+    unsigned di = distIndex(dist);
+    putBits(dist_code[di], dist_len[di]);
+    if (distExtra[di]) putBits(dist - distBase[di], distExtra[di]);
+}
+
+void Deflater::buildLengths(const uint16_t *freq, int n, int limit, uint8_t *lengths) {
+    // Used symbols by ascending frequency, the symbol in the low half. A lone
+    // symbol gets an unused partner: decoders want a complete code.
+    int used = 0;
+    for (int s = 0; s < n; s++) {
+        if (freq[s]) sorted[used++] = (uint32_t)freq[s] << 16 | s;
+    }
+    for (int s = 0; s < n && used < 2; s++) {
+        if (!freq[s]) sorted[used++] = 1u << 16 | s;
+    }
+    std::sort(sorted, sorted + used);
+    for (int i = 0; i < used; i++) {
+        order[i] = (uint16_t)sorted[i];
+        sorted[i] >>= 16;
+    }
+    minimumRedundancy(sorted, used);
+
+    // Codes longer than the limit are cut to it, then codes are moved down a
+    // level from the deepest shorter one until the lengths fit a prefix code
+    uint16_t count[16] = {};
+    for (int i = 0; i < used; i++) count[sorted[i] > (uint32_t)limit ? limit : sorted[i]]++;
+    uint32_t kraft = 0;
+    for (int len = 1; len <= limit; len++) kraft += (uint32_t)count[len] << (limit - len);
+    while (kraft > (1u << limit)) {
+        count[limit]--;
+        for (int len = limit - 1; len > 0; len--) {
+            if (count[len]) {
+                count[len]--;
+                count[len + 1] += 2;
+                break;
+            }
+        }
+        kraft--;
+    }
+
+    // Rarest symbols get the longest codes
+    memset(lengths, 0, n);
+    int i = 0;
+    for (int len = limit; len > 0; len--) {
+        for (unsigned k = 0; k < count[len]; k++) lengths[order[i++]] = len;
+    }
+}
+
+void Deflater::startBlock(bool last) {
+    last_block = last;
+    lit_freq[256] = 1;
+    buildLengths(lit_freq, LIT_CODES, 15, lit_len);
+    buildLengths(dist_freq, DIST_CODES, 15, dist_len);
+
+    int nlit = LIT_CODES, ndist = DIST_CODES;
+    while (nlit > 257 && !lit_len[nlit - 1]) nlit--;
+    while (ndist > 1 && !dist_len[ndist - 1]) ndist--;
+
+    // Both length lists run-length coded as one: 16 repeats the previous
+    // length 3..6 times, 17 and 18 give runs of 3..10 and 11..138 zeros
+    uint8_t all[LIT_CODES + DIST_CODES];
+    memcpy(all, lit_len, nlit);
+    memcpy(all + nlit, dist_len, ndist);
+    int total = nlit + ndist;
+    uint8_t rle[LIT_CODES + DIST_CODES];
+    uint8_t rle_extra[LIT_CODES + DIST_CODES];
+    int nrle = 0;
+    uint16_t cl_freq[19] = {};
+    for (int i = 0; i < total;) {
+        uint8_t len = all[i];
+        int run = 1;
+        while (i + run < total && all[i + run] == len) run++;
+        i += run;
+        if (len == 0) {
+            while (run >= 11) {
+                int r = run < 138 ? run : 138;
+                rle[nrle] = 18;
+                rle_extra[nrle++] = r - 11;
+                run -= r;
+            }
+            if (run >= 3) {
+                rle[nrle] = 17;
+                rle_extra[nrle++] = run - 3;
+                run = 0;
+            }
+        } else {
+            rle[nrle++] = len;
+            run--;
+            while (run >= 3) {
+                int r = run < 6 ? run : 6;
+                rle[nrle] = 16;
+                rle_extra[nrle++] = r - 3;
+                run -= r;
+            }
+        }
+        while (run-- > 0) rle[nrle++] = len;
+    }
+    for (int i = 0; i < nrle; i++) cl_freq[rle[i]]++;
+
+    uint8_t cl_len[19];
+    uint16_t cl_code[19];
+    buildLengths(cl_freq, 19, 7, cl_len);
+    int ncl = 19;
+    while (ncl > 4 && !cl_len[lengthOrder[ncl - 1]]) ncl--;
+
+    static const uint8_t rleExtraBits[19] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7 };
+    uint32_t dynamic_bits = 3 + 14 + 3 * ncl + extra_bits;
+    for (int i = 0; i < nrle; i++) dynamic_bits += cl_len[rle[i]] + rleExtraBits[rle[i]];
+    uint32_t fixed_bits = 3 + extra_bits;
+    for (int s = 0; s < LIT_CODES; s++) {
+        dynamic_bits += (uint32_t)lit_freq[s] * lit_len[s];
+        fixed_bits += (uint32_t)lit_freq[s] * fixedCodes.lit_bits[s];
+    }
+    for (int d = 0; d < DIST_CODES; d++) {
+        dynamic_bits += (uint32_t)dist_freq[d] * dist_len[d];
+        fixed_bits += (uint32_t)dist_freq[d] * 5;
+    }
+
+    // Stored: the header padded to a byte boundary, LEN and NLEN, the bytes.
+    // Only while the block's bytes are all still in the window.
+    uint32_t stored_bits = UINT32_MAX;
+    unsigned span = block_start >= 0 ? strstart - block_start : 0;
+    if (block_start >= 0) stored_bits = 3 + (8 - (bitcnt + 3) % 8) % 8 + 32 + 8 * span;
+
+    if (stored_bits < fixed_bits && stored_bits < dynamic_bits) {
+        putBits(last, 3);
+        if (bitcnt > 0) putBits(0, 8 - bitcnt);
+        putBits(span, 16);
+        putBits(~span & 0xFFFF, 16);
+        stored = true;
+        store_pos = block_start;
+    } else if (fixed_bits <= dynamic_bits) {
+        putBits(last | 1 << 1, 3);
+        memcpy(lit_code, fixedCodes.lit, sizeof(lit_code));
+        memcpy(lit_len, fixedCodes.lit_bits, sizeof(lit_len));
+        for (int d = 0; d < DIST_CODES; d++) {
+            dist_code[d] = fixedCodes.dist[d];
+            dist_len[d] = 5;
+        }
+    } else {
+        putBits(last | 2 << 1, 3);
+        putBits(nlit - 257, 5);
+        putBits(ndist - 1, 5);
+        putBits(ncl - 4, 4);
+        for (int i = 0; i < ncl; i++) putBits(cl_len[lengthOrder[i]], 3);
+        assignCodes(cl_len, 19, cl_code);
+        for (int i = 0; i < nrle; i++) {
+            putBits(cl_code[rle[i]], cl_len[rle[i]]);
+            if (rleExtraBits[rle[i]]) putBits(rle_extra[i], rleExtraBits[rle[i]]);
+        }
+        assignCodes(lit_len, LIT_CODES, lit_code);
+        assignCodes(dist_len, DIST_CODES, dist_code);
+    }
+    sym_next = 0;
+    sending = true;
+}
+
+void Deflater::endBlock() {
+    if (!stored) putBits(lit_code[256], lit_len[256]);
+    sending = false;
+    stored = false;
+    sym_count = 0;
+    block_start = seg_start = strstart;
+    seg_bits = 0;
+    extra_bits = 0;
+    memset(lit_freq, 0, sizeof(lit_freq));
+    memset(dist_freq, 0, sizeof(dist_freq));
+    if (!last_block) return;
+
+    if (bitcnt > 0) out[out_len++] = (uint8_t)bitbuf;
+    bitbuf = 0;
+    bitcnt = 0;
+    out[out_len++] = adler >> 24;
+    out[out_len++] = adler >> 16;
+    out[out_len++] = adler >> 8;
+    out[out_len++] = adler;
+    done = true;
+}
+
+void Deflater::slide() {
+    // Everything below WSIZE is further back than any match may reach
+    memcpy(window, window + WSIZE, WSIZE);
+    strstart -= WSIZE;
+    block_start = block_start >= (int)WSIZE ? block_start - WSIZE : -1;
+    seg_start = strstart;
+    seg_bits = 0;
+    for (uint16_t &h : head) h = h > WSIZE ? h - WSIZE : 0;
+    for (uint16_t &p : prev) p = p > WSIZE ? p - WSIZE : 0;
+}
+
+bool Deflater::refill(ITransferBackend &source) {
+    while (lookahead < MIN_LOOKAHEAD && !eof) {
+        if (strstart >= 2 * WSIZE - MIN_LOOKAHEAD) slide();
+        size_t end = strstart + lookahead;
+        ssize_t n = source.read(window + end, sizeof(window) - end);
+        if (n < 0) return false;
+        if (n == 0) {
+            eof = true;
+            break;
+        }
+        adler = adler32(adler, window + end, n);
+        lookahead += n;
+        total_in += n;
+    }
+    return true;
+}
+
+void Deflater::insert(unsigned pos) {
+    unsigned h = hash3(window + pos);
+    prev[pos & (WSIZE - 1)] = head[h];
+    head[h] = pos + 1;
+}
+
+unsigned Deflater::longestMatch(unsigned *dist) const {
+    const uint8_t *scan = window + strstart;
+    unsigned max_len = lookahead < MAX_MATCH ? lookahead : MAX_MATCH;
+    unsigned max_dist = WSIZE - MIN_LOOKAHEAD;
+    unsigned limit = strstart > max_dist ? strstart - max_dist : 0;
+    unsigned best = MIN_MATCH - 1;
+
+    unsigned cand = head[hash3(scan)];
+    for (int chain = FTP_DEFLATE_MAX_CHAIN; cand && chain > 0; chain--) {
+        unsigned pos = cand - 1;
+        if (pos < limit) break;
+        const uint8_t *m = window + pos;
+        // The byte that would make this one longer than the best is the likeliest miss
+        if (m[best] == scan[best] && m[0] == scan[0] && m[1] == scan[1]) {
+            unsigned len = 2;
+            while (len < max_len && m[len] == scan[len]) len++;
+            if (len > best) {
+                best = len;
+                *dist = strstart - pos;
+                if (len == max_len) break;
+            }
+        }
+        cand = prev[pos & (WSIZE - 1)];
+    }
+    return best >= MIN_MATCH ? best : 0;
+}
+
+bool Deflater::fill(ITransferBackend &source) {
+    if (out_pos == out_len) out_pos = out_len = 0;
+
+    // A symbol codes to at most 48 bits, the end of block and trailer to 7
+    // bytes, so 8 free bytes always take the next step
+    while (!done && out_len + 8 <= sizeof(out)) {
+        if (sending && stored) {
+            if (store_pos == strstart) {
+                endBlock();
+                continue;
+            }
+            size_t n = sizeof(out) - out_len;
+            if (n > strstart - store_pos) n = strstart - store_pos;
+            memcpy(out + out_len, window + store_pos, n);
+            out_len += n;
+            store_pos += n;
+            continue;
+        }
+        if (sending) {
+            if (sym_next < sym_count) putSymbol(sym_next++);
+            else endBlock();
+            continue;
+        }
+
+        if (lookahead < MIN_LOOKAHEAD && !eof) {
+            // A slide drops the start of a block begun in the lower half, and
+            // with it the chance to store the block. If what came in since the
+            // last slide grew under the fixed codes the block ends here instead.
+            if (sym_count && block_start < (int)WSIZE && strstart >= 2 * WSIZE - MIN_LOOKAHEAD &&
+                seg_bits > 8 * (strstart - seg_start)) {
+                if (out_len + MAX_BLOCK_HEADER > sizeof(out)) break;
+                startBlock(false);
+                continue;
+            }
+            if (!refill(source)) return false;
+        }
+        if (lookahead == 0 || sym_count == FTP_DEFLATE_BLOCK_SYMBOLS) {
+            // The header goes out in one piece
+            if (out_len + MAX_BLOCK_HEADER > sizeof(out)) break;
+            startBlock(lookahead == 0);
+            continue;
+        }
+
+        unsigned dist = 0;
+        unsigned len = 0;
+        if (lookahead >= MIN_MATCH) {
+            len = longestMatch(&dist);
+            insert(strstart);
+        }
+        if (len) {
+            sym_lc[sym_count] = len - MIN_MATCH;
+            sym_dist[sym_count++] = dist;
+            unsigned li = lengthIndex(len);
+            unsigned di = distIndex(dist);
+            lit_freq[257 + li]++;
+            dist_freq[di]++;
+            extra_bits += lengthExtra[li] + distExtra[di];
+            seg_bits += fixedCodes.lit_bits[257 + li] + lengthExtra[li] + 5 + distExtra[di];
+            // Index the matched bytes too, later text often repeats from inside them
+            for (unsigned i = 1; i < len && i + MIN_MATCH <= lookahead; i++) insert(strstart + i);
+            strstart += len;
+            lookahead -= len;
+        } else {
+            uint8_t c = window[strstart];
+            sym_lc[sym_count] = c;
+            sym_dist[sym_count++] = 0;
+            lit_freq[c]++;
+            seg_bits += fixedCodes.lit_bits[c];
+            strstart++;
+            lookahead--;
+        }
+    }
+    return true;
+}
+
+
+/* ==== Inflater ==== */
+Inflater *Inflater::create() {
+    void *mem = malloc(sizeof(Inflater));
+    return mem ? new (mem) Inflater() : nullptr;
+}
+
+void Inflater::destroy(Inflater *z) {
+    if (!z) return;
+    z->~Inflater();
+    free(z);
+}
+
+uint8_t *Inflater::input(size_t *space) {
+    // Past the end of the stream anything the client sends is dropped
+    if (state == END) in_len = in_pos = 0;
+    if (in_pos > 0) {
+        memmove(in, in + in_pos, in_len - in_pos);
+        in_len -= in_pos;
+        in_pos = 0;
+    }
+    *space = sizeof(in) - in_len;
+    return in + in_len;
+}
+
+bool Inflater::need(int count) {
+    while (bitcnt < count) {
+        if (in_pos == in_len) return false;
+        bitbuf |= (uint64_t)in[in_pos++] << bitcnt;
+        bitcnt += 8;
+    }
+    return true;
+}
+
+uint32_t Inflater::bits(int count) {
+    uint32_t v = (uint32_t)(bitbuf & ((1ull << count) - 1));
+    bitbuf >>= count;
+    bitcnt -= count;
+    return v;
+}
+
+void Inflater::alignToByte() {
+    // Whole bytes loaded ahead go back to the input, the partial one is padding
+    in_pos -= bitcnt >> 3;
+    bitbuf = 0;
+    bitcnt = 0;
+}
+
+void Inflater::restore(const Mark &m) {
+    in_pos = m.in_pos;
+    bitbuf = m.bitbuf;
+    bitcnt = m.bitcnt;
+}
+
+void Inflater::put(uint8_t b) {
+    out[out_len++] = b;
+    window[wpos] = b;
+    wpos = (wpos + 1) & (WSIZE - 1);
+    if (have < WSIZE) have++;
+}
+
+Inflater::Status Inflater::fail(const char *why) {
+    state = BAD;
+    err = why;
+    return FAILED;
+}
+
+int Inflater::build(Huffman &h, const uint8_t *lengths, int n) {
+    memset(h.count, 0, sizeof(h.count));
+    for (int s = 0; s < n; s++) h.count[lengths[s]]++;
+    if (h.count[0] == n) return 0;  // No codes at all, nothing will decode
+
+    // Codes left over after each length; below zero is over-subscribed
+    int left = 1;
+    for (int len = 1; len < 16; len++) {
+        left <<= 1;
+        left -= h.count[len];
+        if (left < 0) return left;
+    }
+
+    uint16_t offs[16];
+    offs[1] = 0;
+    for (int len = 1; len < 15; len++) offs[len + 1] = offs[len] + h.count[len];
+    for (int s = 0; s < n; s++) {
+        if (lengths[s]) h.symbol[offs[lengths[s]]++] = s;
+    }
+    return left;
+}
+
+int Inflater::decodeSymbol(const Huffman &h) {
+    // Walk the canonical code one bit at a time: -1 needs more input, -2 is no code
+    need(64 - 8);
+    uint64_t b = bitbuf;
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len < 16; len++) {
+        if (len > bitcnt) return -1;
+        code |= b & 1;
+        b >>= 1;
+        int count = h.count[len];
+        if (code - count < first) {
+            bits(len);
+            return h.symbol[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    return -2;
+}
+
+// 1 when the tables are built, 0 when the header runs past the staged input, -1 when invalid
+int Inflater::readDynamic() {
+    static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+    if (!need(14)) return 0;
+    int nlen = bits(5) + 257;
+    int ndist = bits(5) + 1;
+    int ncode = bits(4) + 4;
+    if (nlen > 286 || ndist > 30) return -1;
+
+    uint8_t lengths[286 + 30] = {};
+    for (int i = 0; i < ncode; i++) {
+        if (!need(3)) return 0;
+        lengths[order[i]] = bits(3);
+    }
+    if (build(lencode, lengths, 19) != 0) return -1;
+
+    for (int index = 0; index < nlen + ndist;) {
+        int sym = decodeSymbol(lencode);
+        if (sym == -1) return 0;
+        if (sym < 0) return -1;
+        if (sym < 16) {
+            lengths[index++] = sym;
+            continue;
+        }
+
+        uint8_t len = 0;
+        int repeat;
+        if (sym == 16) {
+            if (index == 0) return -1;
+            len = lengths[index - 1];
+            if (!need(2)) return 0;
+            repeat = 3 + bits(2);
+        } else if (sym == 17) {
+            if (!need(3)) return 0;
+            repeat = 3 + bits(3);
+        } else {
+            if (!need(7)) return 0;
+            repeat = 11 + bits(7);
+        }
+        if (index + repeat > nlen + ndist) return -1;
+        while (repeat--) lengths[index++] = len;
+    }
+    if (lengths[256] == 0) return -1;
+
+    // Incomplete codes are only valid as a single one-bit code
+    int left = build(lencode, lengths, nlen);
+    if (left < 0 || (left > 0 && nlen - lencode.count[0] != 1)) return -1;
+    left = build(distcode, lengths + nlen, ndist);
+    if (left < 0 || (left > 0 && ndist - distcode.count[0] != 1)) return -1;
+    return 1;
+}
+
+Inflater::Status Inflater::run(uint8_t *dst, size_t size, size_t *produced) {
+    out = dst;
+    out_size = size;
+    out_len = 0;
+    adler_len = 0;
+
+    Status st = decode();
+
+    if (state != END) adler = adler32(adler, out + adler_len, out_len - adler_len);
+    // Bytes loaded ahead go back, input() may compact the buffer before the next run
+    if (state != BAD && state != END) {
+        in_pos -= bitcnt >> 3;
+        bitcnt &= 7;
+        bitbuf &= (1u << bitcnt) - 1;
+    }
+    *produced = out_len;
+    out = nullptr;
+    return st;
+}
+
+Inflater::Status Inflater::decode() {
+    for (;;) {
+        switch (state) {
+        case ZLIB_HEADER: {
+            if (!need(16)) return NEED_INPUT;
+            unsigned cmf = bits(8);
+            unsigned flg = bits(8);
+            if ((cmf & 0x0F) != 8 || (cmf * 256 + flg) % 31 != 0) return fail("not a zlib stream");
+            if ((cmf >> 4) + 8 > FTP_INFLATE_WINDOW_BITS) return fail("window too large");
+            if (flg & 0x20) return fail("preset dictionary");
+            state = BLOCK_HEADER;
+            break;
+        }
+
+        case BLOCK_HEADER: {
+            Mark m = mark();
+            if (!need(3)) return NEED_INPUT;
+            last = bits(1);
+            unsigned type = bits(2);
+            if (type == 0) {
+                alignToByte();
+                if (!need(32)) {
+                    restore(m);
+                    return NEED_INPUT;
+                }
+                unsigned len = bits(16);
+                if (len != (~bits(16) & 0xFFFF)) return fail("stored length mismatch");
+                stored_left = len;
+                state = STORED;
+            } else if (type == 1) {
+                uint8_t lengths[288 + 30];
+                memset(lengths, 8, 144);
+                memset(lengths + 144, 9, 112);
+                memset(lengths + 256, 7, 24);
+                memset(lengths + 280, 8, 8);
+                memset(lengths + 288, 5, 30);
+                build(lencode, lengths, 288);
+                build(distcode, lengths + 288, 30);
+                state = CODES;
+            } else if (type == 2) {
+                int r = readDynamic();
+                if (r < 0) return fail("invalid code lengths");
+                if (r == 0) {
+                    restore(m);
+                    return NEED_INPUT;
+                }
+                state = CODES;
+            } else {
+                return fail("invalid block type");
+            }
+            break;
+        }
+
+        case STORED:
+            while (stored_left > 0) {
+                if (out_len == out_size) return OUTPUT_FULL;
+                if (in_pos == in_len) return NEED_INPUT;
+                size_t n = stored_left;
+                if (n > out_size - out_len) n = out_size - out_len;
+                if (n > in_len - in_pos) n = in_len - in_pos;
+                for (size_t i = 0; i < n; i++) put(in[in_pos + i]);
+                in_pos += n;
+                stored_left -= n;
+            }
+            state = last ? TRAILER : BLOCK_HEADER;
+            break;
+
+        case CODES:
+            for (;;) {
+                if (out_len == out_size) return OUTPUT_FULL;
+                Mark m = mark();
+                int sym = decodeSymbol(lencode);
+                if (sym == -1) return NEED_INPUT;
+                if (sym < 0) return fail("invalid literal/length code");
+                if (sym < 256) {
+                    put(sym);
+                    continue;
+                }
+                if (sym == 256) {
+                    state = last ? TRAILER : BLOCK_HEADER;
+                    break;
+                }
+
+                sym -= 257;
+                if (sym >= 29) return fail("invalid length symbol");
+                if (!need(lengthExtra[sym])) {
+                    restore(m);
+                    return NEED_INPUT;
+                }
+                unsigned len = lengthBase[sym] + bits(lengthExtra[sym]);
+                int ds = decodeSymbol(distcode);
+                if (ds == -1) {
+                    restore(m);
+                    return NEED_INPUT;
+                }
+                if (ds < 0 || ds >= 30) return fail("invalid distance code");
+                if (!need(distExtra[ds])) {
+                    restore(m);
+                    return NEED_INPUT;
+                }
+                unsigned dist = distBase[ds] + bits(distExtra[ds]);
+                if (dist > have) return fail("distance too far back");
+                match_len = len;
+                match_dist = dist;
+                state = MATCH;
+                break;
+            }
+            break;
+
+        case MATCH:
+            while (match_len > 0) {
+                if (out_len == out_size) return OUTPUT_FULL;
+                put(window[(wpos - match_dist) & (WSIZE - 1)]);
+                match_len--;
+            }
+            state = CODES;
+            break;
+
+        case TRAILER: {
+            alignToByte();
+            if (!need(32)) return NEED_INPUT;
+            uint32_t expected = bits(8) << 24;
+            expected |= bits(8) << 16;
+            expected |= bits(8) << 8;
+            expected |= bits(8);
+            adler = adler32(adler, out + adler_len, out_len - adler_len);
+            adler_len = out_len;
+            if (expected != adler) return fail("checksum mismatch");
+            state = END;
+            return DONE;
+        }
+
+        case END:
+            return DONE;
+
+        case BAD:
+            return FAILED;
+        }
+    }
+}
@@ -0,0 +1,184 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "TransferBackend.h"
+
+// MODE Z transfers carry one zlib stream (RFC 1950 around RFC 1951 deflate)
+// per data connection. Both directions work in bounded steps on fixed
+// buffers, so a transfer's memory is known when it starts.
+
+// Compressor history. 4 KiB catches the repetition in log and JSON lines at
+// a fraction of zlib's default memory; at most 14 (16 KiB).
+#ifndef FTP_DEFLATE_WINDOW_BITS
+#define FTP_DEFLATE_WINDOW_BITS 12
+#endif
+#define FTP_DEFLATE_HASH_BITS 11
+#ifndef FTP_DEFLATE_MAX_CHAIN
+#define FTP_DEFLATE_MAX_CHAIN 32    // Earlier occurrences tried per position, bounds CPU per byte
+#endif
+#define FTP_DEFLATE_OUT_SIZE 2048   // Compressed bytes waiting for the socket
+// LZ77 symbols per block. Each block gets Huffman codes fitted to its own
+// symbols, so a longer block spreads its code tables over more data; costs 3
+// bytes per symbol.
+#ifndef FTP_DEFLATE_BLOCK_SYMBOLS
+#define FTP_DEFLATE_BLOCK_SYMBOLS 2048
+#endif
+
+// Decompressor history. The sender picks the window and zlib defaults to
+// 32 KiB, so anything smaller refuses most clients' uploads.
+#ifndef FTP_INFLATE_WINDOW_BITS
+#define FTP_INFLATE_WINDOW_BITS 15
+#endif
+#define FTP_INFLATE_IN_SIZE 1024    // Received bytes staged for decoding, holds any block header
+
+// Greedy LZ77 over a small sliding window. Symbols are collected a block at a
+// time and the block goes out with dynamic Huffman codes built from their
+// frequencies, the fixed codes, or stored as the raw bytes, whichever comes
+// out shortest. Storing bounds the growth of incompressible data to the 5
+// byte stored header per block.
+class Deflater {
+public:
+    // All state is one allocation of bytes()
+    static Deflater *create();
+    static void destroy(Deflater *d);
+    static size_t bytes() { return sizeof(Deflater); }
+
+    // Compresses what source produces until the output buffer is nearly full
+    // or the source is exhausted. False if the source failed.
+    bool fill(ITransferBackend &source);
+
+    const uint8_t *data() const { return out + out_pos; }
+    size_t pending() const { return out_len - out_pos; }
+    void consume(size_t n) { out_pos += n; }
+    bool finished() const { return done && out_pos == out_len; }
+    uint64_t totalIn() const { return total_in; }
+
+private:
+    static constexpr unsigned WSIZE = 1u << FTP_DEFLATE_WINDOW_BITS;
+    static constexpr int LIT_CODES = 286;   // Literals, end of block, match lengths
+    static constexpr int DIST_CODES = 30;
+
+    Deflater();
+    bool refill(ITransferBackend &source);
+    void slide();
+    void insert(unsigned pos);
+    unsigned longestMatch(unsigned *dist) const;
+    void putBits(uint32_t value, int count);
+    void putSymbol(unsigned i);
+    void startBlock(bool last);
+    void endBlock();
+    void buildLengths(const uint16_t *freq, int n, int limit, uint8_t *lengths);
+
+    uint8_t window[2 * WSIZE];  // History in the lower half, lookahead read in above it
+    uint16_t prev[WSIZE];       // Previous position+1 with the same hash, 0 = none
+    uint16_t head[1 << FTP_DEFLATE_HASH_BITS];
+    uint8_t out[FTP_DEFLATE_OUT_SIZE];
+    size_t out_len = 0;
+    size_t out_pos = 0;
+    uint32_t bitbuf = 0;
+    int bitcnt = 0;
+    unsigned strstart = 0;      // Next window position to code
+    unsigned lookahead = 0;     // Bytes read but not yet coded
+    bool eof = false;
+    bool done = false;
+
+    // The block: a literal (dist 0) or match length - 3 and distance per symbol
+    uint8_t sym_lc[FTP_DEFLATE_BLOCK_SYMBOLS];
+    uint16_t sym_dist[FTP_DEFLATE_BLOCK_SYMBOLS];
+    unsigned sym_count = 0;
+    unsigned sym_next = 0;      // Next symbol to code while the block goes out
+    bool sending = false;       // Codes are chosen, the block is going out
+    bool last_block = false;
+    bool stored = false;        // The block goes out as its raw bytes
+    unsigned store_pos = 0;     // Next raw byte to copy out
+    int block_start = 0;        // Window position of the block's first byte, -1 once slid out
+    unsigned seg_start = 0;     // Block bytes since the last slide...
+    uint32_t seg_bits = 0;      // ...and their size under the fixed codes
+    uint32_t extra_bits = 0;    // Length and distance extra bits of the block
+    uint16_t lit_freq[LIT_CODES];
+    uint16_t dist_freq[DIST_CODES];
+    uint16_t lit_code[LIT_CODES];   // Bit-reversed, ready for putBits()
+    uint8_t lit_len[LIT_CODES];
+    uint16_t dist_code[DIST_CODES];
+    uint8_t dist_len[DIST_CODES];
+    uint32_t sorted[LIT_CODES];     // buildLengths() scratch
+    uint16_t order[LIT_CODES];
+
+    uint32_t adler = 1;
+    uint64_t total_in = 0;
+};
+
+// Decodes stored, fixed and dynamic blocks. Input is staged in an internal
+// buffer; a symbol cut off at the end of it is retried once more arrives,
+// and a match that doesn't fit the output resumes in the next run().
+class Inflater {
+public:
+    enum Status {
+        NEED_INPUT,     // Everything staged is decoded
+        OUTPUT_FULL,    // More to come once there is room
+        DONE,           // Stream ended and the checksum matched
+        FAILED,         // Corrupt or unsupported stream, see error()
+    };
+
+    static Inflater *create();
+    static void destroy(Inflater *z);
+    static size_t bytes() { return sizeof(Inflater); }
+
+    // Where received bytes go, and how many fit there
+    uint8_t *input(size_t *space);
+    void commitInput(size_t n) { in_len += n; }
+
+    // Decodes staged input into out, *produced is set to the bytes written
+    Status run(uint8_t *out, size_t size, size_t *produced);
+    bool finished() const { return state == END; }
+    const char *error() const { return err; }
+
+private:
+    static constexpr unsigned WSIZE = 1u << FTP_INFLATE_WINDOW_BITS;
+
+    // Canonical code: code lengths counted per length, symbols in code order
+    struct Huffman {
+        uint16_t count[16];
+        uint16_t symbol[288];
+    };
+    struct Mark {
+        size_t in_pos;
+        uint64_t bitbuf;
+        int bitcnt;
+    };
+    enum State { ZLIB_HEADER, BLOCK_HEADER, STORED, CODES, MATCH, TRAILER, END, BAD };
+
+    Status decode();
+    int readDynamic();
+    int decodeSymbol(const Huffman &h);
+    static int build(Huffman &h, const uint8_t *lengths, int n);
+    bool need(int count);
+    uint32_t bits(int count);
+    void alignToByte();
+    void put(uint8_t b);
+    Status fail(const char *why);
+    Mark mark() const { return { in_pos, bitbuf, bitcnt }; }
+    void restore(const Mark &m);
+
+    State state = ZLIB_HEADER;
+    bool last = false;          // Current block is the final one
+    uint8_t in[FTP_INFLATE_IN_SIZE];
+    size_t in_len = 0;
+    size_t in_pos = 0;
+    uint64_t bitbuf = 0;
+    int bitcnt = 0;
+    uint8_t *out = nullptr;     // Caller's buffer for the current run()
+    size_t out_size = 0;
+    size_t out_len = 0;
+    size_t adler_len = 0;       // Bytes of out already in adler
+    uint32_t adler = 1;
+    uint32_t stored_left = 0;
+    unsigned match_len = 0;
+    unsigned match_dist = 0;
+    Huffman lencode;
+    Huffman distcode;
+    uint8_t window[WSIZE];
+    unsigned wpos = 0;
+    unsigned have = 0;          // Valid window bytes, up to WSIZE
+    const char *err = nullptr;
+};
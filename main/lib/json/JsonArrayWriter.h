@@ -9,6 +9,7 @@ class JsonArrayWriter : public JsonContext {
 public:
     void value(int64_t v) { writeComma(); writer.writeInt(v); }
     void value(uint64_t v) { writeComma(); writer.writeUInt(v); }
+    void value(double v) { writeComma(); writer.writeDouble(v); }
     void value(const char* v) { writeComma(); writer.writeString(v); }
     void value(bool v) { writeComma(); writer.writeBool(v); }
     void fieldData(const uint8_t* data, size_t len) {        writeComma(); writer.writeData(data, len);    }
@@ -1,46 +1,84 @@
 #pragma once
 #include "Stream.h"
+#include <cstddef>
 #include <cstdint>
-#include <cstdio>
+#include <cstring>
 #include <cassert>
 
+// Escapes what it is given for a JSON string. Most strings need no escaping
+// at all, so the input is scanned a machine word at a time for quotes,
+// backslashes and control characters, and each clean run goes downstream in
+// one write().
 class JsonEscapedStream : public Stream {
     Stream& out;
 
+    using Word = uintptr_t;
+    static constexpr Word ones = ~Word(0) / 0xFF;   // 0x0101...
+    static constexpr Word highs = ones * 0x80;
+
     static void writeHex(Stream& s, uint8_t c) {
-        char buf[6];
-        snprintf(buf, sizeof(buf), "\\u%04X", c);
+        static constexpr char hex[] = "0123456789ABCDEF";
+        char buf[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
         s.write(buf, 6);
     }
 
+    static bool special(char c) {
+        return c == '"' || c == '\\' || static_cast<unsigned char>(c) < 0x20;
+    }
+
+    // Nonzero if any byte of w is a quote, a backslash or below 0x20. The
+    // classic zero-byte test can flag bytes after a real hit, never without one.
+    static Word specialBytes(Word w) {
+        Word quote = w ^ (ones * '"');
+        Word backslash = w ^ (ones * '\\');
+        Word hits = ((quote - ones) & ~quote) | ((backslash - ones) & ~backslash) | ((w - ones * 0x20) & ~w);
+        return hits & highs;
+    }
+
+    // First character in [p, end) that needs escaping, or end
+    static const char* scan(const char* p, const char* end) {
+        // Aligned loads only: unaligned ones trap into a slow handler on RISC-V
+        while (p < end && reinterpret_cast<uintptr_t>(p) % sizeof(Word) != 0) {
+            if (special(*p)) return p;
+            ++p;
+        }
+        while (end - p >= static_cast<ptrdiff_t>(sizeof(Word))) {
+            Word w;
+            memcpy(&w, __builtin_assume_aligned(p, sizeof(Word)), sizeof(w));
+            if (specialBytes(w)) break;
+            p += sizeof(Word);
+        }
+        while (p < end && !special(*p)) ++p;
+        return p;
+    }
+
+    static void writeEscape(Stream& s, char c) {
+        switch (c) {
+            case '\"': s.write("\\\"", 2); break;
+            case '\\': s.write("\\\\", 2); break;
+            case '\b': s.write("\\b", 2); break;
+            case '\f': s.write("\\f", 2); break;
+            case '\n': s.write("\\n", 2); break;
+            case '\r': s.write("\\r", 2); break;
+            case '\t': s.write("\\t", 2); break;
+            default: writeHex(s, static_cast<uint8_t>(c)); break;
+        }
+    }
+
 public:
     explicit JsonEscapedStream(Stream& s) : out(s) {}
 
     size_t write(const void* data, size_t len) override {
         const char* p = static_cast<const char*>(data);
-        size_t written = 0;
-
-        for (size_t i = 0; i < len; ++i) {
-            char c = p[i];
-            switch (c) {
-                case '\"': out.write("\\\"", 2); break;
-                case '\\': out.write("\\\\", 2); break;
-                case '\b': out.write("\\b", 2); break;
-                case '\f': out.write("\\f", 2); break;
-                case '\n': out.write("\\n", 2); break;
-                case '\r': out.write("\\r", 2); break;
-                case '\t': out.write("\\t", 2); break;
-                default:
-                    if (static_cast<unsigned char>(c) < 0x20) {
-                        writeHex(out, static_cast<uint8_t>(c));
-                    } else {
-                        out.write(&c, 1);
-                    }
-                    break;
-            }
-            ++written;
+        const char* end = p + len;
+        while (p < end) {
+            const char* hit = scan(p, end);
+            if (hit > p) out.write(p, hit - p);
+            if (hit == end) break;
+            writeEscape(out, *hit);
+            p = hit + 1;
         }
-        return written;
+        return len;
     }
 
     size_t read(void*, size_t) override {
@@ -0,0 +1,336 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+// Number formatting for the JSON writers without snprintf: no locale, no
+// heap, a few dozen bytes of stack. Integers are written two digits at a
+// time from a pair table. Floating point uses Grisu2 (Loitsch, "Printing
+// floating-point numbers quickly and accurately with integers"), whose
+// output always parses back to the same float or double and is the
+// shortest such string for all but a tiny fraction of inputs; %g keeps only
+// six digits. JSON has no NaN or infinity, those come out as null.
+class JsonNumber {
+public:
+    // Longest output of any format function, e.g. "-1.7976931348623157e+308"
+    static constexpr size_t MaxLength = 32;
+
+    // Each returns the length written to out, which isn't terminated
+    static size_t formatUInt(uint64_t v, char* out) {
+        char tmp[20];
+        char* end = tmp + sizeof(tmp);
+        char* p = end;
+        // 64-bit division is a library call on 32-bit cores; peel off eight
+        // digits at a time until the rest fits a register
+        while (v > UINT32_MAX) {
+            uint32_t low = static_cast<uint32_t>(v % 100000000u);
+            v /= 100000000u;
+            for (int i = 0; i < 4; ++i) {
+                p = writePair(p, low % 100);
+                low /= 100;
+            }
+        }
+        uint32_t u = static_cast<uint32_t>(v);
+        while (u >= 100) {
+            p = writePair(p, u % 100);
+            u /= 100;
+        }
+        if (u >= 10) p = writePair(p, u);
+        else *--p = static_cast<char>('0' + u);
+        size_t len = end - p;
+        memcpy(out, p, len);
+        return len;
+    }
+
+    static size_t formatInt(int64_t v, char* out) {
+        if (v >= 0) return formatUInt(static_cast<uint64_t>(v), out);
+        *out = '-';
+        return 1 + formatUInt(0 - static_cast<uint64_t>(v), out + 1);
+    }
+
+    static size_t formatDouble(double v, char* out) { return formatReal(v, out); }
+    static size_t formatFloat(float v, char* out) { return formatReal(v, out); }
+
+private:
+    static char* writePair(char* p, uint32_t pair) {
+        static constexpr char digits[] =
+            "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+            "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+            "8081828384858687888990919293949596979899";
+        p -= 2;
+        memcpy(p, digits + pair * 2, 2);
+        return p;
+    }
+
+    // f * 2^e
+    struct DiyFp {
+        uint64_t f;
+        int e;
+    };
+
+    static DiyFp sub(DiyFp x, DiyFp y) { return { x.f - y.f, x.e }; }
+
+    // Upper 64 bits of the product, rounded; built from 32-bit halves since
+    // there is no 128-bit type on the target
+    static DiyFp mul(DiyFp x, DiyFp y) {
+        uint64_t a = x.f >> 32, b = x.f & 0xFFFFFFFFu;
+        uint64_t c = y.f >> 32, d = y.f & 0xFFFFFFFFu;
+        uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+        uint64_t mid = (bd >> 32) + (ad & 0xFFFFFFFFu) + (bc & 0xFFFFFFFFu) + (1u << 31);
+        return { ac + (ad >> 32) + (bc >> 32) + (mid >> 32), x.e + y.e + 64 };
+    }
+
+    static DiyFp normalize(DiyFp x) {
+        int shift = __builtin_clzll(x.f);
+        return { x.f << shift, x.e - shift };
+    }
+
+    // The neighbours' midpoints m- and m+ around v: everything strictly
+    // between them reads back as v. m- and m+ share an exponent.
+    struct Boundaries {
+        DiyFp w;
+        DiyFp minus;
+        DiyFp plus;
+    };
+
+    template <typename T>
+    static Boundaries boundaries(T value) {
+        constexpr int precision = std::numeric_limits<T>::digits;  // With the hidden bit
+        constexpr int bias = std::numeric_limits<T>::max_exponent - 1 + (precision - 1);
+        constexpr int min_exp = 1 - bias;
+        constexpr uint64_t hidden = uint64_t(1) << (precision - 1);
+        using Bits = typename std::conditional<sizeof(T) == 4, uint32_t, uint64_t>::type;
+
+        Bits bits;
+        memcpy(&bits, &value, sizeof(bits));
+        uint64_t fraction = bits & (hidden - 1);
+        int exponent = static_cast<int>(bits >> (precision - 1));
+        DiyFp v = exponent == 0 ? DiyFp{ fraction, min_exp } : DiyFp{ fraction + hidden, exponent - bias };
+
+        // At a power of two the next smaller value is only half as far away
+        bool closer_below = fraction == 0 && exponent > 1;
+        DiyFp plus = normalize({ 2 * v.f + 1, v.e - 1 });
+        DiyFp minus = closer_below ? DiyFp{ 4 * v.f - 1, v.e - 2 } : DiyFp{ 2 * v.f - 1, v.e - 1 };
+        minus.f <<= minus.e - plus.e;
+        minus.e = plus.e;
+        return { normalize(v), minus, plus };
+    }
+
+    struct CachedPower {
+        uint64_t f;
+        int e;
+        int k;      // 10^k ~ f * 2^e
+    };
+
+    // A power of ten that scales 2^e into [2^-60, 2^-32), so the integral
+    // part of the scaled value fits 32 bits
+    static CachedPower cachedPower(int e) {
+        static constexpr CachedPower powers[] = {
+            { 0xAB70FE17C79AC6CA, -1060, -300 },
+            { 0xFF77B1FCBEBCDC4F, -1034, -292 },
+            { 0xBE5691EF416BD60C, -1007, -284 },
+            { 0x8DD01FAD907FFC3C,  -980, -276 },
+            { 0xD3515C2831559A83,  -954, -268 },
+            { 0x9D71AC8FADA6C9B5,  -927, -260 },
+            { 0xEA9C227723EE8BCB,  -901, -252 },
+            { 0xAECC49914078536D,  -874, -244 },
+            { 0x823C12795DB6CE57,  -847, -236 },
+            { 0xC21094364DFB5637,  -821, -228 },
+            { 0x9096EA6F3848984F,  -794, -220 },
+            { 0xD77485CB25823AC7,  -768, -212 },
+            { 0xA086CFCD97BF97F4,  -741, -204 },
+            { 0xEF340A98172AACE5,  -715, -196 },
+            { 0xB23867FB2A35B28E,  -688, -188 },
+            { 0x84C8D4DFD2C63F3B,  -661, -180 },
+            { 0xC5DD44271AD3CDBA,  -635, -172 },
+            { 0x936B9FCEBB25C996,  -608, -164 },
+            { 0xDBAC6C247D62A584,  -582, -156 },
+            { 0xA3AB66580D5FDAF6,  -555, -148 },
+            { 0xF3E2F893DEC3F126,  -529, -140 },
+            { 0xB5B5ADA8AAFF80B8,  -502, -132 },
+            { 0x87625F056C7C4A8B,  -475, -124 },
+            { 0xC9BCFF6034C13053,  -449, -116 },
+            { 0x964E858C91BA2655,  -422, -108 },
+            { 0xDFF9772470297EBD,  -396, -100 },
+            { 0xA6DFBD9FB8E5B88F,  -369,  -92 },
+            { 0xF8A95FCF88747D94,  -343,  -84 },
+            { 0xB94470938FA89BCF,  -316,  -76 },
+            { 0x8A08F0F8BF0F156B,  -289,  -68 },
+            { 0xCDB02555653131B6,  -263,  -60 },
+            { 0x993FE2C6D07B7FAC,  -236,  -52 },
+            { 0xE45C10C42A2B3B06,  -210,  -44 },
+            { 0xAA242499697392D3,  -183,  -36 },
+            { 0xFD87B5F28300CA0E,  -157,  -28 },
+            { 0xBCE5086492111AEB,  -130,  -20 },
+            { 0x8CBCCC096F5088CC,  -103,  -12 },
+            { 0xD1B71758E219652C,   -77,   -4 },
+            { 0x9C40000000000000,   -50,    4 },
+            { 0xE8D4A51000000000,   -24,   12 },
+            { 0xAD78EBC5AC620000,     3,   20 },
+            { 0x813F3978F8940984,    30,   28 },
+            { 0xC097CE7BC90715B3,    56,   36 },
+            { 0x8F7E32CE7BEA5C70,    83,   44 },
+            { 0xD5D238A4ABE98068,   109,   52 },
+            { 0x9F4F2726179A2245,   136,   60 },
+            { 0xED63A231D4C4FB27,   162,   68 },
+            { 0xB0DE65388CC8ADA8,   189,   76 },
+            { 0x83C7088E1AAB65DB,   216,   84 },
+            { 0xC45D1DF942711D9A,   242,   92 },
+            { 0x924D692CA61BE758,   269,  100 },
+            { 0xDA01EE641A708DEA,   295,  108 },
+            { 0xA26DA3999AEF774A,   322,  116 },
+            { 0xF209787BB47D6B85,   348,  124 },
+            { 0xB454E4A179DD1877,   375,  132 },
+            { 0x865B86925B9BC5C2,   402,  140 },
+            { 0xC83553C5C8965D3D,   428,  148 },
+            { 0x952AB45CFA97A0B3,   455,  156 },
+            { 0xDE469FBD99A05FE3,   481,  164 },
+            { 0xA59BC234DB398C25,   508,  172 },
+            { 0xF6C69A72A3989F5C,   534,  180 },
+            { 0xB7DCBF5354E9BECE,   561,  188 },
+            { 0x88FCF317F22241E2,   588,  196 },
+            { 0xCC20CE9BD35C78A5,   614,  204 },
+            { 0x98165AF37B2153DF,   641,  212 },
+            { 0xE2A0B5DC971F303A,   667,  220 },
+            { 0xA8D9D1535CE3B396,   694,  228 },
+            { 0xFB9B7CD9A4A7443C,   720,  236 },
+            { 0xBB764C4CA7A44410,   747,  244 },
+            { 0x8BAB8EEFB6409C1A,   774,  252 },
+            { 0xD01FEF10A657842C,   800,  260 },
+            { 0x9B10A4E5E9913129,   827,  268 },
+            { 0xE7109BFBA19C0C9D,   853,  276 },
+            { 0xAC2820D9623BF429,   880,  284 },
+            { 0x80444B5E7AA7CF85,   907,  292 },
+            { 0xBF21E44003ACDD2D,   933,  300 },
+            { 0x8E679C2F5E44FF8F,   960,  308 },
+            { 0xD433179D9C8CB841,   986,  316 },
+            { 0x9E19DB92B4E31BA9,  1013,  324 },
+        };
+        constexpr int alpha = -60;
+        int f = alpha - e - 1;
+        int k = (f * 78913) / (1 << 18) + (f > 0);
+        return powers[(300 + k + 7) / 8];
+    }
+
+    // Steps the last digit down while that brings it closer to w
+    static void round(char* buf, size_t len, uint64_t dist, uint64_t delta, uint64_t rest, uint64_t ten_k) {
+        while (rest < dist && delta - rest >= ten_k &&
+               (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
+            buf[len - 1]--;
+            rest += ten_k;
+        }
+    }
+
+    // Shortest digit string within (m-, m+), as digits * 10^exponent
+    static size_t digits(char* buf, int& exponent, DiyFp minus, DiyFp w, DiyFp plus) {
+        uint64_t delta = sub(plus, minus).f;
+        uint64_t dist = sub(plus, w).f;
+        const int shift = -plus.e;
+        const uint64_t one = uint64_t(1) << shift;
+        uint32_t p1 = static_cast<uint32_t>(plus.f >> shift);
+        uint64_t p2 = plus.f & (one - 1);
+
+        uint32_t pow10 = 1;
+        int n = 1;
+        while (n < 10 && p1 >= pow10 * 10) {
+            pow10 *= 10;
+            n++;
+        }
+
+        size_t len = 0;
+        while (n > 0) {
+            buf[len++] = static_cast<char>('0' + p1 / pow10);
+            p1 %= pow10;
+            n--;
+            uint64_t rest = (static_cast<uint64_t>(p1) << shift) + p2;
+            if (rest <= delta) {
+                exponent += n;
+                round(buf, len, dist, delta, rest, static_cast<uint64_t>(pow10) << shift);
+                return len;
+            }
+            pow10 /= 10;
+        }
+
+        int m = 0;
+        for (;;) {
+            p2 *= 10;
+            buf[len++] = static_cast<char>('0' + (p2 >> shift));
+            p2 &= one - 1;
+            m++;
+            delta *= 10;
+            dist *= 10;
+            if (p2 <= delta) break;
+        }
+        exponent -= m;
+        round(buf, len, dist, delta, p2, one);
+        return len;
+    }
+
+    template <typename T>
+    static size_t formatReal(T value, char* out) {
+        if (!std::isfinite(value)) {
+            memcpy(out, "null", 4);
+            return 4;
+        }
+        char* p = out;
+        if (std::signbit(value)) *p++ = '-';
+        if (value == 0) {
+            *p++ = '0';
+            return p - out;
+        }
+
+        Boundaries b = boundaries(value < 0 ? -value : value);
+        CachedPower c = cachedPower(b.plus.e);
+        DiyFp scale = { c.f, c.e };
+        DiyFp w = mul(b.w, scale);
+        DiyFp minus = mul(b.minus, scale);
+        DiyFp plus = mul(b.plus, scale);
+        // One unit of slack either way for the rounding in mul()
+        minus.f++;
+        plus.f--;
+
+        char buf[20];
+        int exponent = -c.k;
+        size_t len = digits(buf, exponent, minus, w, plus);
+        return p - out + layout(buf, len, exponent, p);
+    }
+
+    // digits * 10^exponent, plain up to 17 integral digits and for small
+    // fractions down to 0.0001, scientific otherwise
+    static size_t layout(const char* buf, size_t len, int exponent, char* out) {
+        int point = static_cast<int>(len) + exponent;    // Digits before the decimal point
+        char* p = out;
+        if (exponent >= 0 && point <= 17) {
+            memcpy(p, buf, len);
+            memset(p + len, '0', exponent);
+            return len + exponent;
+        }
+        if (point > 0 && point <= 17) {
+            memcpy(p, buf, point);
+            p[point] = '.';
+            memcpy(p + point + 1, buf + point, len - point);
+            return len + 1;
+        }
+        if (point > -4 && point <= 0) {
+            memcpy(p, "0.", 2);
+            memset(p + 2, '0', -point);
+            memcpy(p + 2 - point, buf, len);
+            return 2 - point + len;
+        }
+
+        *p++ = buf[0];
+        if (len > 1) {
+            *p++ = '.';
+            memcpy(p, buf + 1, len - 1);
+            p += len - 1;
+        }
+        int e = point - 1;
+        *p++ = 'e';
+        *p++ = e < 0 ? '-' : '+';
+        p += formatUInt(static_cast<uint64_t>(e < 0 ? -e : e), p);
+        return p - out;
+    }
+};
@@ -13,6 +13,9 @@ public:
     void field(const char* key, uint64_t v) {
         writeComma(); writer.writeString(key); writeColon(); writer.writeUInt(v);
     }
+    void field(const char* key, double v) {
+        writeComma(); writer.writeString(key); writeColon(); writer.writeDouble(v);
+    }
     void field(const char* key, const char* v) {
         writeComma(); writer.writeString(key); writeColon(); writer.writeString(v);
     }
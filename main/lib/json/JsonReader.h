@@ -0,0 +1,586 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include "Stream.h"
+#include "Base64Stream.h"
+
+#ifndef JSON_READER_BUFFER
+#define JSON_READER_BUFFER 64       // Input read ahead from the stream
+#endif
+#ifndef JSON_READER_TOKEN
+#define JSON_READER_TOKEN 64        // Longest key, string or number kept, with the NUL
+#endif
+#define JSON_READER_DEPTH 32        // Nesting levels, one bit each
+
+enum class JsonToken {
+    BeginObject, EndObject, BeginArray, EndArray,
+    Key, String, Number, True, False, Null,
+    End,        // After the document
+    Error
+};
+
+// Pull parser for what JsonObjectWriter and JsonArrayWriter produce, read
+// incrementally from a Stream. State is a small read-ahead buffer, one token
+// and a bit per nesting level, so a document of any size parses in about
+// 200 bytes and nothing is allocated.
+//
+// next() returns one token at a time. The read*() functions consume the next
+// value and convert it, which binds a document straight into fixed structs:
+//
+//   reader.readObject([&](JsonReader &r, const char *key) {
+//       if (!strcmp(key, "port")) r.read(config.port);
+//       else if (!strcmp(key, "name")) r.read(config.name, sizeof(config.name));
+//   });
+//
+// Values a callback doesn't read are skipped. A value of the wrong type is
+// skipped too and its read() returns false; errors stop the parse for good.
+class JsonReader {
+public:
+    explicit JsonReader(Stream& in) : in(in) {}
+
+    JsonReader(const JsonReader&) = delete;
+    JsonReader& operator=(const JsonReader&) = delete;
+
+    JsonToken next() {
+        if (err) return JsonToken::Error;
+        int c = separator();
+        if (err) return JsonToken::Error;
+        if (level == 0 && done) return c < 0 ? JsonToken::End : fail("Data after the document");
+        if (c < 0) return fail("Unexpected end");
+
+        if (c == '}' || c == ']') {
+            if (level == 0 || (c == '}') != inObject() || state == AfterComma || state == AfterKey) {
+                return fail("Unexpected closing bracket");
+            }
+            pos++;
+            level--;
+            valueDone();
+            return c == '}' ? JsonToken::EndObject : JsonToken::EndArray;
+        }
+
+        if (inObject() && state != AfterKey) {
+            if (c != '"') return fail("Expected a key");
+            pos++;
+            if (!readString(token, sizeof(token), &tokenLen)) return JsonToken::Error;
+            if (skipSpace() != ':') return fail("Expected :");
+            pos++;
+            state = AfterKey;
+            return JsonToken::Key;
+        }
+
+        pos++;
+        switch (c) {
+            case '{': return push(true, JsonToken::BeginObject);
+            case '[': return push(false, JsonToken::BeginArray);
+            case '"':
+                if (!readString(token, sizeof(token), &tokenLen)) return JsonToken::Error;
+                valueDone();
+                return JsonToken::String;
+            case 't': return literal("rue", JsonToken::True);
+            case 'f': return literal("alse", JsonToken::False);
+            case 'n': return literal("ull", JsonToken::Null);
+            default:
+                if (c == '-' || (c >= '0' && c <= '9')) return numberToken(c);
+                return fail("Unexpected character");
+        }
+    }
+
+    // Unescaped text of the last Key, String or Number, NUL-terminated.
+    // Valid until the next token is read.
+    const char* text() const { return token; }
+    size_t length() const { return tokenLen; }
+    // The last key or string didn't fit JSON_READER_TOKEN and was cut
+    bool truncated() const { return cut; }
+    int depth() const { return level; }
+
+    // Conversions of the last Number; false if it doesn't fit the type
+    bool number(int64_t& v) const {
+        const char* p = token;
+        bool negative = *p == '-';
+        if (negative) p++;
+        uint64_t u;
+        if (!digits(p, &u)) return false;
+        if (negative ? u > uint64_t(INT64_MAX) + 1 : u > uint64_t(INT64_MAX)) return false;
+        v = negative ? static_cast<int64_t>(0 - u) : static_cast<int64_t>(u);
+        return true;
+    }
+
+    bool number(uint64_t& v) const {
+        return token[0] != '-' && digits(token, &v);
+    }
+
+    bool number(double& v) const {
+        // Up to 19 significant digits and a power of ten up to 22 convert
+        // exactly with one multiply or divide; anything else goes to strtod
+        static constexpr double powers[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+        const char* p = token;
+        bool negative = *p == '-';
+        if (negative) p++;
+        uint64_t m = 0;
+        int significant = 0, exponent = 0;
+        bool fraction = false;
+        for (; *p && *p != 'e' && *p != 'E'; p++) {
+            if (*p == '.') {
+                fraction = true;
+                continue;
+            }
+            if (m == 0 && *p == '0') {
+                if (fraction) exponent--;
+                continue;
+            }
+            if (significant == 19) {
+                v = strtod(token, nullptr);
+                return true;
+            }
+            m = m * 10 + (*p - '0');
+            significant++;
+            if (fraction) exponent--;
+        }
+        if (*p) {
+            int e = atoi(p + 1);
+            exponent += e < -400 ? -400 : e > 400 ? 400 : e;
+        }
+        if (m > (uint64_t(1) << 53) || exponent < -22 || exponent > 22) {
+            v = strtod(token, nullptr);
+            return true;
+        }
+        double d = static_cast<double>(m);
+        d = exponent < 0 ? d / powers[-exponent] : d * powers[exponent];
+        v = negative ? -d : d;
+        return true;
+    }
+
+    // Each reads the next value into v. On a type mismatch the value is
+    // skipped, v is left alone and the result is false.
+    // Any integer type, range-checked: int32_t is long on the target, so
+    // fixed overloads would miss plain int fields
+    template <typename T, typename = std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>>
+    bool read(T& v) {
+        if constexpr (std::is_signed_v<T>) {
+            int64_t wide;
+            if (!readNumber(wide) || wide < std::numeric_limits<T>::min() || wide > std::numeric_limits<T>::max()) return false;
+            v = static_cast<T>(wide);
+        } else {
+            uint64_t wide;
+            if (!readNumber(wide) || wide > std::numeric_limits<T>::max()) return false;
+            v = static_cast<T>(wide);
+        }
+        return true;
+    }
+
+    bool read(double& v) { return readNumber(v); }
+
+    bool read(float& v) {
+        double wide;
+        if (!read(wide)) return false;
+        v = static_cast<float>(wide);
+        return true;
+    }
+
+    bool read(bool& v) {
+        JsonToken t = next();
+        if (t == JsonToken::True || t == JsonToken::False) {
+            v = t == JsonToken::True;
+            return true;
+        }
+        return mismatch(t);
+    }
+
+    // A string of any length straight into dst; false if it had to be cut
+    bool read(char* dst, size_t size) {
+        if (!atValue()) return false;
+        if (buf[pos] != '"') {
+            skip();
+            return false;
+        }
+        pos++;
+        size_t n;
+        if (!readString(dst, size, &n)) return false;
+        valueDone();
+        return !cut;
+    }
+
+    // A Base64 string, as written by writeData(), decoded into dst without
+    // holding the text. False if it doesn't fit size or isn't Base64.
+    bool readData(void* dst, size_t size, size_t* len) {
+        if (!atValue()) return false;
+        if (buf[pos] != '"') {
+            skip();
+            return false;
+        }
+        pos++;
+        startString();
+        StringStream text(*this);
+        Base64Stream b64(text);
+        uint8_t* out = static_cast<uint8_t*>(dst);
+        size_t n = 0, got;
+        while (n < size && (got = b64.read(out + n, size - n)) > 0) n += got;
+        uint8_t extra;
+        bool fits = n < size || b64.read(&extra, 1) == 0;
+        drainString();
+        if (err) return false;
+        valueDone();
+        *len = n;
+        return fits && !b64.failed();
+    }
+
+    // Skips the next value, nested containers included
+    bool skip() {
+        mismatch(next());
+        return !err;
+    }
+
+    // Reads an object, calling fn(reader, key) for each member. The key
+    // lives in the token buffer: compare it before reading the value.
+    template <typename FUNC>
+    bool readObject(FUNC fn) {
+        JsonToken t = next();
+        if (t != JsonToken::BeginObject) return mismatch(t);
+        int d = level;
+        for (;;) {
+            t = next();
+            if (t == JsonToken::EndObject) return true;
+            if (t != JsonToken::Key) return false;
+            fn(*this, static_cast<const char*>(token));
+            if (err) return false;
+            if (level == d && state == AfterKey && !skip()) return false;
+        }
+    }
+
+    // Reads an array, calling fn(reader, index) for each element
+    template <typename FUNC>
+    bool readArray(FUNC fn) {
+        JsonToken t = next();
+        if (t != JsonToken::BeginArray) return mismatch(t);
+        int d = level;
+        for (size_t i = 0;; i++) {
+            int c = separator();
+            if (err) return false;
+            if (c == ']') return next() == JsonToken::EndArray;
+            fn(*this, i);
+            if (err) return false;
+            if (level == d && state != AfterValue && !skip()) return false;
+        }
+    }
+
+    bool failed() const { return err != nullptr; }
+    // What went wrong, and about where in the input
+    const char* error() const { return err; }
+    size_t offset() const { return consumed + pos; }
+
+private:
+    enum State : uint8_t {
+        Start,          // Container just opened
+        AfterComma,
+        AfterKey,       // Colon read, value next
+        AfterValue
+    };
+
+    // The characters of a string being read, for Base64Stream
+    class StringStream : public Stream {
+        JsonReader& r;
+
+    public:
+        explicit StringStream(JsonReader& r) : r(r) {}
+        size_t write(const void*, size_t) override { return 0; }
+        size_t read(void* buffer, size_t len) override { return r.stringChunk(static_cast<char*>(buffer), len); }
+        void flush() override {}
+    };
+
+    Stream& in;
+    char buf[JSON_READER_BUFFER];
+    size_t pos = 0;
+    size_t len = 0;
+    size_t consumed = 0;        // Input before buf
+    bool eof = false;
+
+    char token[JSON_READER_TOKEN] = {};
+    size_t tokenLen = 0;
+    bool cut = false;
+
+    uint32_t objects = 0;       // Bit n set: level n + 1 is an object
+    int level = 0;
+    State state = Start;
+    bool done = false;          // The top-level value is complete
+    const char* err = nullptr;
+
+    // String being read, and the UTF-8 of an escape that didn't fit yet
+    bool inString = false;
+    char carry[4];
+    uint8_t carryPos = 0;
+    uint8_t carryLen = 0;
+
+    int peek() {
+        if (pos == len) {
+            if (eof) return -1;
+            consumed += len;
+            pos = 0;
+            len = in.read(buf, sizeof(buf));
+            if (len == 0) {
+                eof = true;
+                return -1;
+            }
+        }
+        return static_cast<uint8_t>(buf[pos]);
+    }
+
+    int get() {
+        int c = peek();
+        if (c >= 0) pos++;
+        return c;
+    }
+
+    int skipSpace() {
+        int c;
+        while ((c = peek()) == ' ' || c == '\n' || c == '\r' || c == '\t') pos++;
+        return c;
+    }
+
+    JsonToken fail(const char* message) {
+        if (!err) err = message;
+        return JsonToken::Error;
+    }
+
+    bool inObject() const { return level > 0 && (objects >> (level - 1)) & 1; }
+
+    JsonToken push(bool object, JsonToken t) {
+        if (level == JSON_READER_DEPTH) return fail("Nested too deep");
+        objects = (objects & ~(uint32_t(1) << level)) | (uint32_t(object) << level);
+        level++;
+        state = Start;
+        return t;
+    }
+
+    void valueDone() {
+        if (level == 0) done = true;
+        else state = AfterValue;
+    }
+
+    // Consumes the comma due after a value and returns the next character
+    // without consuming it; idempotent until a token is read
+    int separator() {
+        int c = skipSpace();
+        if (level > 0 && state == AfterValue) {
+            if (c == ',') {
+                pos++;
+                state = AfterComma;
+                c = skipSpace();
+            } else if (c != (inObject() ? '}' : ']')) {
+                fail(c < 0 ? "Unexpected end" : "Expected , or closing bracket");
+            }
+        }
+        return c;
+    }
+
+    // A value, not a key or the end of a container, comes next; buf[pos]
+    // is its first character
+    bool atValue() {
+        int c = separator();
+        if (err) return false;
+        if (c < 0) {
+            fail("Unexpected end");
+            return false;
+        }
+        return c != '}' && c != ']' && !(inObject() && state != AfterKey) && !(level == 0 && done);
+    }
+
+    // Skips the rest of a value whose first token was t; always false so
+    // typed reads can return it
+    bool mismatch(JsonToken t) {
+        if (t == JsonToken::BeginObject || t == JsonToken::BeginArray) {
+            int d = level - 1;
+            while (level > d && next() != JsonToken::Error) {}
+        }
+        return false;
+    }
+
+    template <typename T>
+    bool readNumber(T& v) {
+        JsonToken t = next();
+        if (t == JsonToken::Number && number(v)) return true;
+        return mismatch(t);
+    }
+
+    static bool digits(const char* p, uint64_t* out) {
+        uint64_t v = 0;
+        for (; *p; p++) {
+            if (*p < '0' || *p > '9') return false;
+            unsigned d = *p - '0';
+            if (v > (UINT64_MAX - d) / 10) return false;
+            v = v * 10 + d;
+        }
+        *out = v;
+        return true;
+    }
+
+    JsonToken literal(const char* rest, JsonToken t) {
+        for (; *rest; rest++) {
+            if (get() != *rest) return fail("Unknown literal");
+        }
+        valueDone();
+        return t;
+    }
+
+    JsonToken numberToken(int c) {
+        size_t n = 0;
+        token[n++] = static_cast<char>(c);
+        for (;;) {
+            int d = peek();
+            if (!((d >= '0' && d <= '9') || d == '.' || d == 'e' || d == 'E' || d == '+' || d == '-')) break;
+            if (n == sizeof(token) - 1) return fail("Number too long");
+            token[n++] = static_cast<char>(d);
+            pos++;
+        }
+        token[n] = 0;
+        tokenLen = n;
+        cut = false;
+
+        // -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+        const char* p = token;
+        if (*p == '-') p++;
+        if (*p == '0') p++;
+        else if (*p >= '1' && *p <= '9') while (*p >= '0' && *p <= '9') p++;
+        else return fail("Malformed number");
+        if (*p == '.') {
+            if (*++p < '0' || *p > '9') return fail("Malformed number");
+            while (*p >= '0' && *p <= '9') p++;
+        }
+        if (*p == 'e' || *p == 'E') {
+            if (*++p == '+' || *p == '-') p++;
+            if (*p < '0' || *p > '9') return fail("Malformed number");
+            while (*p >= '0' && *p <= '9') p++;
+        }
+        if (*p) return fail("Malformed number");
+        valueDone();
+        return JsonToken::Number;
+    }
+
+    void startString() {
+        inString = true;
+        carryPos = carryLen = 0;
+    }
+
+    int hex4() {
+        int v = 0;
+        for (int i = 0; i < 4; i++) {
+            int c = get();
+            int d = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (d < 0) return -1;
+            v = v << 4 | d;
+        }
+        return v;
+    }
+
+    // Decodes the escape after a backslash into carry
+    bool escape() {
+        int c = get();
+        char simple = c == '"' ? '"' : c == '\\' ? '\\' : c == '/' ? '/' : c == 'b' ? '\b' : c == 'f' ? '\f'
+                    : c == 'n' ? '\n' : c == 'r' ? '\r' : c == 't' ? '\t' : 0;
+        carryPos = 0;
+        if (simple) {
+            carry[0] = simple;
+            carryLen = 1;
+            return true;
+        }
+        if (c != 'u') {
+            fail("Bad escape");
+            return false;
+        }
+
+        long cp = hex4();
+        if (cp >= 0xD800 && cp < 0xDC00) {
+            // High surrogate, the low one has to follow
+            long low = get() == '\\' && get() == 'u' ? hex4() : -1;
+            if (low < 0xDC00 || low > 0xDFFF) {
+                fail("Bad surrogate pair");
+                return false;
+            }
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        } else if (cp < 0 || (cp >= 0xDC00 && cp <= 0xDFFF)) {
+            fail("Bad \\u escape");
+            return false;
+        }
+
+        if (cp < 0x80) {
+            carry[0] = static_cast<char>(cp);
+            carryLen = 1;
+        } else if (cp < 0x800) {
+            carry[0] = static_cast<char>(0xC0 | cp >> 6);
+            carry[1] = static_cast<char>(0x80 | (cp & 0x3F));
+            carryLen = 2;
+        } else if (cp < 0x10000) {
+            carry[0] = static_cast<char>(0xE0 | cp >> 12);
+            carry[1] = static_cast<char>(0x80 | (cp >> 6 & 0x3F));
+            carry[2] = static_cast<char>(0x80 | (cp & 0x3F));
+            carryLen = 3;
+        } else {
+            carry[0] = static_cast<char>(0xF0 | cp >> 18);
+            carry[1] = static_cast<char>(0x80 | (cp >> 12 & 0x3F));
+            carry[2] = static_cast<char>(0x80 | (cp >> 6 & 0x3F));
+            carry[3] = static_cast<char>(0x80 | (cp & 0x3F));
+            carryLen = 4;
+        }
+        return true;
+    }
+
+    // Up to room unescaped characters of the current string; 0 once its
+    // closing quote has been read
+    size_t stringChunk(char* dst, size_t room) {
+        size_t n = 0;
+        while (n < room && !err) {
+            if (carryPos < carryLen) {
+                dst[n++] = carry[carryPos++];
+                continue;
+            }
+            if (!inString) break;
+
+            // Plain runs straight from the read-ahead buffer
+            while (pos < len && n < room) {
+                char ch = buf[pos];
+                if (ch == '"' || ch == '\\' || static_cast<uint8_t>(ch) < 0x20) break;
+                dst[n++] = ch;
+                pos++;
+            }
+            if (n == room) break;
+
+            int c = get();
+            if (c < 0) fail("Unterminated string");
+            else if (c == '"') inString = false;
+            else if (c < 0x20) fail("Control character in string");
+            else if (c == '\\') escape();
+            else dst[n++] = static_cast<char>(c);
+        }
+        return n;
+    }
+
+    // Reads and drops what is left of the current string
+    void drainString() {
+        char scratch[16];
+        while (!err && (inString || carryPos < carryLen)) stringChunk(scratch, sizeof(scratch));
+    }
+
+    // A whole string into dst after its opening quote; what doesn't fit is
+    // dropped and flagged with cut
+    bool readString(char* dst, size_t size, size_t* n) {
+        startString();
+        *n = stringChunk(dst, size - 1);
+        dst[*n] = 0;
+        cut = false;
+        if (!err && inString && carryPos == carryLen && peek() == '"') {
+            pos++;
+            inString = false;
+        }
+        if (inString || carryPos < carryLen) {
+            cut = true;
+            drainString();
+        }
+        return !err;
+    }
+};
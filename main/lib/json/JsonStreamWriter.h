@@ -1,11 +1,11 @@
 #pragma once
 #include <cstdint>
-#include <cstdio>
 #include <cstring>
 #include "Stream.h"
 #include "IStreamWriter.h"
 #include "Base64Stream.h"
 #include "JsonEscapedStream.h"
+#include "JsonNumber.h"
 
 class JsonStreamWriter : public IStreamWriter
 {
@@ -22,33 +22,26 @@ public:
 
     void writeInt(int64_t v) override
     {
-        char buf[32];
-        int n = snprintf(buf, sizeof(buf), "%lld",
-                         static_cast<long long>(v));
-        out.write(buf, n);
+        char buf[JsonNumber::MaxLength];
+        out.write(buf, JsonNumber::formatInt(v, buf));
     }
 
     void writeUInt(uint64_t v) override
     {
-        char buf[32];
-        int n = snprintf(buf, sizeof(buf), "%llu",
-                         static_cast<unsigned long long>(v));
-        out.write(buf, n);
+        char buf[JsonNumber::MaxLength];
+        out.write(buf, JsonNumber::formatUInt(v, buf));
     }
 
     void writeFloat(float v) override
     {
-        char buf[32];
-        int n = snprintf(buf, sizeof(buf), "%g",
-                         static_cast<double>(v));
-        out.write(buf, n);
+        char buf[JsonNumber::MaxLength];
+        out.write(buf, JsonNumber::formatFloat(v, buf));
     }
 
     void writeDouble(double v) override
     {
-        char buf[64];
-        int n = snprintf(buf, sizeof(buf), "%g", v);
-        out.write(buf, n);
+        char buf[JsonNumber::MaxLength];
+        out.write(buf, JsonNumber::formatDouble(v, buf));
     }
 
     void writeString(const char *v) override
@@ -56,7 +49,6 @@ public:
         out.write("\"", 1);
         JsonEscapedStream esc(out);
         esc.write(v, std::strlen(v));
-        esc.flush();
         out.write("\"", 1);
     }
 
@@ -65,7 +57,7 @@ public:
         out.write("\"", 1);
         Base64Stream b64(out);
         b64.write(data, len);
-        b64.flush();
+        b64.finish();
         out.write("\"", 1);
     }
 };
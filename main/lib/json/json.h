@@ -3,6 +3,8 @@
 #include "JsonArrayWriter.h"
 #include "JsonContext.h"
 #include "JsonEscapedStream.h"
+#include "JsonNumber.h"
 #include "JsonObjectWriter.h"
+#include "JsonReader.h"
 #include "JsonStreamWriter.h"
 
@@ -87,6 +87,12 @@ public:
 
 #endif // configUSE_TASK_NOTIFICATIONS
 
+	// For a task that parks itself instead of returning from its handler
+	void Delete()
+	{
+		DeleteTaskIfExists();
+	}
+
 	static int GetCurrentCoreID()
 	{
 		return xPortGetCoreID();
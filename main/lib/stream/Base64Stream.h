@@ -1,17 +1,70 @@
 #pragma once
+#include <array>
 #include <cstddef>
 #include <cstdint>
-#include <cassert>
+#include <cstring>
 #include "Stream.h"
 
+// Base64 over another stream in both directions: write() encodes into it,
+// read() decodes from it. Both work on whole groups: the encoder turns
+// 3-byte groups into a local block that goes downstream in one write(), the
+// decoder reads as much text as the caller has room for and converts it in
+// one pass. Only a partial group is carried from one call to the next.
 class Base64Stream : public Stream {
-    Stream& out;
+    Stream& inner;
+
+    // Encoder: input bytes short of a group
     uint8_t buf[3];
     size_t bufLen = 0;
 
+    // Decoder: sextets of an incomplete quad, and decoded bytes that didn't
+    // fit the caller's buffer
+    uint32_t quad = 0;
+    size_t quadLen = 0;
+    uint8_t pend[2];
+    size_t pendPos = 0;
+    size_t pendLen = 0;
+    bool padded = false;
+    bool ended = false;
+    bool error = false;
+
+    static constexpr size_t Block = 256;    // Encoded bytes per downstream write
+
     static constexpr const char* table =
         "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
+    // Both characters for every 12-bit value: two lookups per group instead
+    // of four shifts and masks. 8 KB of flash.
+    static constexpr std::array<char, 8192> pairs = [] {
+        std::array<char, 8192> t{};
+        for (size_t i = 0; i < 4096; ++i) {
+            t[2 * i] = table[i >> 6];
+            t[2 * i + 1] = table[i & 0x3F];
+        }
+        return t;
+    }();
+
+    static constexpr uint8_t Invalid = 0x80;
+    static constexpr uint8_t Space = 0x81;
+    static constexpr uint8_t Pad = 0x82;
+
+    static constexpr std::array<uint8_t, 256> sextets = [] {
+        std::array<uint8_t, 256> t{};
+        for (size_t i = 0; i < 256; ++i) t[i] = Invalid;
+        for (uint8_t i = 0; i < 64; ++i) t[static_cast<uint8_t>(table[i])] = i;
+        t[' '] = t['\t'] = t['\r'] = t['\n'] = Space;
+        t['='] = Pad;
+        return t;
+    }();
+
+    static void encodeGroups(const uint8_t* src, size_t groups, char* dst) {
+        for (size_t i = 0; i < groups; ++i, src += 3, dst += 4) {
+            uint32_t v = (uint32_t(src[0]) << 16) | (uint32_t(src[1]) << 8) | src[2];
+            memcpy(dst, &pairs[(v >> 12) * 2], 2);
+            memcpy(dst + 2, &pairs[(v & 0xFFF) * 2], 2);
+        }
+    }
+
     void encodeBlock(const uint8_t* block, size_t len) {
         uint32_t triple = (block[0] << 16) |
                           ((len > 1 ? block[1] : 0) << 8) |
@@ -23,37 +76,138 @@ class Base64Stream : public Stream {
         outbuf[2] = (len > 1) ? table[(triple >> 6) & 0x3F] : '=';
         outbuf[3] = (len > 2) ? table[triple & 0x3F] : '=';
 
-        out.write(outbuf, 4);
+        inner.write(outbuf, 4);
+    }
+
+    // Decoded bytes go to the caller while there is room, the rest to pend
+    void emit(uint32_t bits, size_t count, uint8_t* dst, size_t& n, size_t len) {
+        for (size_t i = 0; i < count; ++i) {
+            uint8_t b = static_cast<uint8_t>(bits >> (16 - 8 * i));
+            if (n < len) dst[n++] = b;
+            else pend[pendLen++] = b;
+        }
+    }
+
+    // The bytes of a quad cut short by padding or the end of the input
+    void finishQuad(uint8_t* dst, size_t& n, size_t len) {
+        if (quadLen == 1) error = true;
+        else if (quadLen > 1) emit(quad << (6 * (4 - quadLen)), quadLen - 1, dst, n, len);
+        quad = 0;
+        quadLen = 0;
     }
 
 public:
-    explicit Base64Stream(Stream& s) : out(s) {}
+    explicit Base64Stream(Stream& s) : inner(s) {}
 
     size_t write(const void* data, size_t len) override {
         const uint8_t* bytes = static_cast<const uint8_t*>(data);
-        size_t written = 0;
+        size_t left = len;
+        char block[Block];
+        size_t used = 0;
 
-        for (size_t i = 0; i < len; ++i) {
-            buf[bufLen++] = bytes[i];
-            if (bufLen == 3) {
-                encodeBlock(buf, 3);
-                bufLen = 0;
+        // Complete the group left over from the last call
+        if (bufLen > 0) {
+            while (bufLen < 3 && left > 0) {
+                buf[bufLen++] = *bytes++;
+                --left;
+            }
+            if (bufLen < 3) return len;
+            encodeGroups(buf, 1, block);
+            used = 4;
+            bufLen = 0;
+        }
+        while (left >= 3) {
+            size_t groups = (sizeof(block) - used) / 4;
+            if (groups > left / 3) groups = left / 3;
+            encodeGroups(bytes, groups, block + used);
+            used += groups * 4;
+            bytes += groups * 3;
+            left -= groups * 3;
+            if (used == sizeof(block)) {
+                inner.write(block, used);
+                used = 0;
             }
-            ++written;
         }
-        return written;
+        if (used > 0) inner.write(block, used);
+        for (size_t i = 0; i < left; ++i) buf[i] = bytes[i];
+        bufLen = left;
+        return len;
     }
 
+    // Decodes text read from the inner stream. Whitespace is skipped, the
+    // final quad may be padded or not, nothing but padding may follow it. Returns 0 at the end of the text or
+    // on malformed input; failed() tells the two apart.
     size_t read(void* buffer, size_t len) override {
-        assert(false && "Base64Stream does not support read()");
-        return 0; // not supported
+        uint8_t* dst = static_cast<uint8_t*>(buffer);
+        size_t n = 0;
+        while (n < len && pendPos < pendLen) dst[n++] = pend[pendPos++];
+        if (pendPos == pendLen) pendPos = pendLen = 0;
+
+        char text[Block];
+        while (n < len && !ended) {
+            // No more text than the space left needs, counting the partial
+            // quad: at most two decoded bytes end up in pend
+            size_t want = ((len - n + 2) / 3) * 4 - quadLen;
+            if (want > sizeof(text)) want = sizeof(text);
+            size_t got = inner.read(text, want);
+            if (got == 0) {
+                finishQuad(dst, n, len);
+                ended = true;
+                break;
+            }
+
+            const uint8_t* p = reinterpret_cast<const uint8_t*>(text);
+            const uint8_t* end = p + got;
+            while (p < end && !ended) {
+                // Clean quads in one go while the caller has room for them
+                while (quadLen == 0 && !padded && end - p >= 4 && len - n >= 3) {
+                    uint8_t a = sextets[p[0]], b = sextets[p[1]], c = sextets[p[2]], d = sextets[p[3]];
+                    if ((a | b | c | d) & 0x80) break;
+                    uint32_t v = (uint32_t(a) << 18) | (uint32_t(b) << 12) | (uint32_t(c) << 6) | d;
+                    dst[n++] = static_cast<uint8_t>(v >> 16);
+                    dst[n++] = static_cast<uint8_t>(v >> 8);
+                    dst[n++] = static_cast<uint8_t>(v);
+                    p += 4;
+                }
+                if (p == end) break;
+
+                uint8_t s = sextets[*p++];
+                if (s == Space) continue;
+                if (s == Pad) {
+                    finishQuad(dst, n, len);
+                    padded = true;
+                    continue;
+                }
+                // Only more padding may follow padding
+                if (s == Invalid || padded) {
+                    error = true;
+                    ended = true;
+                    break;
+                }
+                quad = (quad << 6) | s;
+                if (++quadLen == 4) {
+                    emit(quad, 3, dst, n, len);
+                    quad = 0;
+                    quadLen = 0;
+                }
+            }
+        }
+        return n;
     }
 
-    void flush() override {
+    // Pads out the last group; unlike flush() leaves the downstream stream alone
+    void finish() {
         if (bufLen > 0) {
             encodeBlock(buf, bufLen);
             bufLen = 0;
         }
-        out.flush();
     }
+
+    void flush() override {
+        finish();
+        inner.flush();
+    }
+
+    // read() stopped at something that isn't Base64
+    bool failed() const { return error; }
 };
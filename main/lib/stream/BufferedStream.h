@@ -0,0 +1,94 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include "Stream.h"
+
+// Collects small writes into one buffer and hands them downstream in one
+// write() when it fills up, when flush() is called or when the stream goes
+// out of scope. Writes that don't fit an empty buffer skip it. The JSON
+// writers emit punctuation, escapes and Base64 quads a few bytes at a time;
+// this keeps those from turning into as many socket or file writes.
+// write() returns how much of the data was taken. When the downstream stream
+// takes less than it is given, the rest stays buffered and failed() is set.
+class BufferedStream : public Stream {
+    Stream& out;
+    char* buf;
+    size_t cap;
+    size_t len = 0;
+    size_t downstreamWrites = 0;
+    bool error = false;
+
+protected:
+    // True when everything went downstream; otherwise the unwritten tail
+    // moves to the front of the buffer
+    bool drain() {
+        if (len == 0) return true;
+        size_t n = out.write(buf, len);
+        ++downstreamWrites;
+        if (n < len) {
+            memmove(buf, buf + n, len - n);
+            len -= n;
+            error = true;
+            return false;
+        }
+        len = 0;
+        return true;
+    }
+
+public:
+    BufferedStream(Stream& s, void* buffer, size_t size)
+        : out(s), buf(static_cast<char*>(buffer)), cap(size) {}
+    // Pending bytes still go downstream; the downstream stream isn't flushed
+    ~BufferedStream() override { drain(); }
+
+    BufferedStream(const BufferedStream&) = delete;
+    BufferedStream& operator=(const BufferedStream&) = delete;
+
+    size_t write(const void* data, size_t n) override {
+        if (n <= cap - len) {
+            memcpy(buf + len, data, n);
+            len += n;
+            return n;
+        }
+        // Nothing may overtake bytes that are still buffered
+        if (!drain()) return 0;
+        if (n >= cap) {
+            ++downstreamWrites;
+            size_t written = out.write(data, n);
+            if (written < n) error = true;
+            return written;
+        }
+        memcpy(buf, data, n);
+        len = n;
+        return n;
+    }
+
+    // Pending output goes first, a reply may depend on it
+    size_t read(void* buffer, size_t n) override {
+        if (!drain()) return 0;
+        return out.read(buffer, n);
+    }
+
+    void flush() override {
+        drain();
+        out.flush();
+    }
+
+    size_t buffered() const { return len; }
+    size_t capacity() const { return cap; }
+    // write() calls made on the downstream stream so far
+    size_t writes() const { return downstreamWrites; }
+    // The downstream stream took less than it was given at least once
+    bool failed() const { return error; }
+};
+
+// BufferedStream with its buffer inline, for use on the stack
+template <size_t N>
+class FixedBufferedStream : public BufferedStream {
+    char storage[N];
+
+public:
+    explicit FixedBufferedStream(Stream& s) : BufferedStream(s, storage, N) {}
+    // Before storage goes away
+    ~FixedBufferedStream() override { drain(); }
+};
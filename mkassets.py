@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+"""Packs a directory into the read-only asset image read by AssetImage.
+
+usage: mkassets.py <dir> <image> [--max-size BYTES]
+
+Layout, little endian:
+  header   magic "AIMG", u16 version, u16 count, u32 image size, u32 build time
+  entries  count x (u32 path offset, u32 data offset, u32 data length, u32 mtime),
+           sorted by path so lookups can bisect
+  paths    "/dir/name" strings, NUL terminated
+  data     file contents, each starting on an 8-byte boundary
+"""
+import argparse
+import os
+import struct
+import sys
+
+MAGIC = b"AIMG"
+VERSION = 1
+HEADER = struct.Struct("<4sHHII")
+ENTRY = struct.Struct("<IIII")
+ALIGN = 8
+PATH_MAX = 255      # FTP_PATH_MAX without the terminator
+
+
+def collect(root):
+    files = []
+    for dirpath, dirnames, filenames in os.walk(root):
+        dirnames[:] = sorted(d for d in dirnames if not d.startswith("."))
+        for name in filenames:
+            if name.startswith("."):
+                continue
+            full = os.path.join(dirpath, name)
+            rel = os.path.relpath(full, root).replace(os.sep, "/")
+            path = ("/" + rel).encode("utf-8")
+            if len(path) > PATH_MAX:
+                sys.exit(f"mkassets: path too long: {rel}")
+            files.append((path, full))
+    files.sort()
+    return files
+
+
+def pack(files):
+    count = len(files)
+    if count > 0xFFFF:
+        sys.exit("mkassets: too many files")
+
+    paths_off = HEADER.size + count * ENTRY.size
+    paths = b"".join(path + b"\0" for path, _ in files)
+    offset = paths_off + len(paths)
+
+    entries = []
+    blobs = []
+    path_off = paths_off
+    built = 0
+    for path, full in files:
+        with open(full, "rb") as f:
+            data = f.read()
+        mtime = int(os.stat(full).st_mtime)
+        built = max(built, mtime)
+        pad = -offset % ALIGN
+        blobs.append(b"\0" * pad + data)
+        offset += pad
+        entries.append(ENTRY.pack(path_off, offset, len(data), mtime))
+        offset += len(data)
+        path_off += len(path) + 1
+
+    header = HEADER.pack(MAGIC, VERSION, count, offset, built)
+    return header + b"".join(entries) + paths + b"".join(blobs)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Pack a directory into an asset image")
+    parser.add_argument("dir")
+    parser.add_argument("image")
+    parser.add_argument("--max-size", type=lambda s: int(s, 0), default=0,
+                        help="fail if the image is larger, such as the partition size")
+    args = parser.parse_args()
+
+    image = pack(collect(args.dir) if os.path.isdir(args.dir) else [])
+    if args.max_size and len(image) > args.max_size:
+        sys.exit(f"mkassets: image is {len(image)} bytes, partition holds {args.max_size}")
+    with open(args.image, "wb") as f:
+        f.write(image)
+    print(f"mkassets: {args.image}, {len(image)} bytes")
+
+
+if __name__ == "__main__":
+    main()